@@ -1,20 +1,77 @@
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <math.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// realtime audio backends, see CAudioDevice. Turned on with make ALSA=1 and/or
+// make JACK=1.
+#ifdef GRANULAR_ALSA
+#include <alsa/asoundlib.h>
+#endif
+#ifdef GRANULAR_JACK
+#include <jack/jack.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
 
 // typedefs
+typedef int16_t int16;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
 typedef int32_t int32;
 
 const float c_pi = 3.14159265359f;
 
+// hot kernels get compiled once for AVX2 and once for the baseline instruction
+// set (SSE2 on x86-64), and the loader picks the best one for the running cpu.
+// Only gcc on ELF targets supports this, elsewhere it does nothing.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__ELF__)
+#define GRANULAR_MULTIVERSION __attribute__((target_clones("avx2", "default")))
+#else
+#define GRANULAR_MULTIVERSION
+#endif
+
+// half float sources (see SHalf) are converted with F16C instructions when the
+// running cpu has them. gcc and clang on x86-64 can compile them in without
+// turning them on for the whole program.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define GRANULAR_F16C
+#include <immintrin.h>
+#endif
+
 // https://stackoverflow.com/a/24207339
 #ifndef errno_t
 #define errno_t int
@@ -33,6 +90,363 @@ errno_t fopen_s(FILE** f, const char* name, const char* mode) {
 }
 #endif
 
+// opens a file, where "-" means stdin or stdout (depending on mode) so the
+// program can be used in shell pipelines
+FILE* OpenFile(const char* fileName, const char* mode) {
+  if (strcmp(fileName, "-")) {
+    FILE* file = nullptr;
+    fopen_s(&file, fileName, mode);
+    return file;
+  }
+
+  FILE* file = (mode[0] == 'r') ? stdin : stdout;
+#ifdef _WIN32
+  _setmode(_fileno(file), _O_BINARY);
+#endif
+  return file;
+}
+
+// closes a file from OpenFile(), leaving stdin and stdout open. Returns
+// false if writing out what was still buffered failed.
+bool CloseFile(FILE* file) {
+  if (file == stdin || file == stdout) return fflush(file) == 0;
+  return fclose(file) == 0;
+}
+
+// stdin ("-") and pipes can only be read front to back, as they arrive
+bool IsStreamInput(const char* fileName) {
+  if (!strcmp(fileName, "-")) return true;
+#ifdef _WIN32
+  return false;
+#else
+  struct stat status;
+  return stat(fileName, &status) == 0 && S_ISFIFO(status.st_mode);
+#endif
+}
+
+// Instrumentation. Scoped timers and counters for the hot paths, cheap enough
+// to leave on in production, plus optional timeline tracing. Build with
+// -DGRANULAR_INSTRUMENT=0 to compile them out entirely.
+#ifndef GRANULAR_INSTRUMENT
+#define GRANULAR_INSTRUMENT 1
+#endif
+
+enum class ETimer {
+  ReadWaveFile,
+  WriteWaveFile,
+  TimeAdjust,
+  PlanGrains,
+  GranularLoop,
+  SplatGrainToOutput,
+
+  Count
+};
+
+enum class ECounter {
+  GrainsRendered,
+  GrainsRepeated,
+  GrainsSkipped,
+  CrossFades,
+  FramesInterpolated,
+  SamplesClipped,
+  BytesRead,
+  BytesWritten,
+
+  Count
+};
+
+static const char* c_timerNames[] = {
+    "ReadWaveFile", "WriteWaveFile",      "TimeAdjust",
+    "PlanGrains",   "GranularLoop", "SplatGrainToOutput",
+};
+
+static const char* c_counterNames[] = {
+    "grainsRendered",     "grainsRepeated", "grainsSkipped", "crossFades",
+    "framesInterpolated", "samplesClipped", "bytesRead",     "bytesWritten",
+};
+
+// atomics so that worker threads can all report into the same job
+struct SStats {
+  std::atomic<uint64_t> m_timerNanoseconds[size_t(ETimer::Count)];
+  std::atomic<uint64_t> m_timerCalls[size_t(ETimer::Count)];
+  std::atomic<uint64_t> m_counters[size_t(ECounter::Count)];
+};
+
+static SStats g_stats;
+
+// Timeline tracing. When enabled, scoped timers and trace scopes record
+// begin/end events into a ring buffer owned by the recording thread, and
+// TraceStop() writes them all out as a Chrome trace (chrome://tracing or
+// ui.perfetto.dev). Recording never takes a lock; only the first event on a
+// new thread does, to register its ring. When tracing is off the cost is one
+// relaxed atomic load per scope.
+struct STraceEvent {
+  const char* m_name;
+  uint64_t m_timestamp;  // nanoseconds since TraceStart()
+  char m_phase;          // 'B' for begin, 'E' for end
+};
+
+struct STraceRing {
+  // power of two. When a thread records more events than this, the oldest are
+  // overwritten.
+  static const size_t c_capacity = 1 << 18;
+
+  std::vector<STraceEvent> m_events;
+  std::atomic<size_t> m_count;
+  uint32 m_threadId;
+};
+
+static std::atomic<bool> g_traceEnabled(false);
+static std::chrono::steady_clock::time_point g_traceStart;
+static std::mutex g_traceRingsMutex;
+static std::vector<std::unique_ptr<STraceRing>> g_traceRings;
+static thread_local STraceRing* t_traceRing = nullptr;
+
+inline bool TraceEnabled() {
+  return g_traceEnabled.load(std::memory_order_relaxed);
+}
+
+void TraceEvent(const char* name, char phase) {
+  uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - g_traceStart)
+                           .count();
+
+  // register a ring for this thread the first time it records anything.
+  // Rings live until exit so a flush can still see threads that finished.
+  if (!t_traceRing) {
+    std::unique_ptr<STraceRing> ring(new STraceRing);
+    ring->m_events.resize(STraceRing::c_capacity);
+    ring->m_count = 0;
+
+    std::lock_guard<std::mutex> lock(g_traceRingsMutex);
+    ring->m_threadId = static_cast<uint32>(g_traceRings.size()) + 1;
+    t_traceRing = ring.get();
+    g_traceRings.push_back(std::move(ring));
+  }
+
+  // only this thread writes to the ring, so a relaxed load is enough. The
+  // release store publishes the event to TraceStop().
+  size_t count = t_traceRing->m_count.load(std::memory_order_relaxed);
+  STraceEvent& event =
+      t_traceRing->m_events[count & (STraceRing::c_capacity - 1)];
+  event.m_name = name;
+  event.m_timestamp = timestamp;
+  event.m_phase = phase;
+  t_traceRing->m_count.store(count + 1, std::memory_order_release);
+}
+
+// records a begin event now and the matching end event when it goes out of
+// scope. name must be a string that outlives the trace, like a literal, or
+// null to record nothing.
+class CScopedTrace {
+ public:
+  explicit CScopedTrace(const char* name)
+      : m_name(TraceEnabled() ? name : nullptr) {
+    if (m_name) TraceEvent(m_name, 'B');
+  }
+
+  ~CScopedTrace() {
+    if (m_name) TraceEvent(m_name, 'E');
+  }
+
+ private:
+  const char* m_name;
+};
+
+void TraceStart() {
+  std::lock_guard<std::mutex> lock(g_traceRingsMutex);
+  for (std::unique_ptr<STraceRing>& ring : g_traceRings) ring->m_count = 0;
+  g_traceStart = std::chrono::steady_clock::now();
+  g_traceEnabled = true;
+}
+
+// stops recording and writes everything recorded since TraceStart(). Call it
+// once the threads being traced are done, since rings are read as they are.
+bool TraceStop(const char* fileName) {
+  g_traceEnabled = false;
+
+  FILE* file = nullptr;
+  fopen_s(&file, fileName, "w+b");
+  if (!file) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  bool first = true;
+  std::lock_guard<std::mutex> lock(g_traceRingsMutex);
+  for (const std::unique_ptr<STraceRing>& ring : g_traceRings) {
+    size_t count = ring->m_count.load(std::memory_order_acquire);
+    size_t begin =
+        (count > STraceRing::c_capacity) ? count - STraceRing::c_capacity : 0;
+    for (size_t i = begin; i < count; ++i) {
+      const STraceEvent& event =
+          ring->m_events[i & (STraceRing::c_capacity - 1)];
+      fprintf(file,
+              "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,"
+              "\"tid\":%u}",
+              first ? "" : ",", event.m_name, event.m_phase,
+              double(event.m_timestamp) / 1000.0, ring->m_threadId);
+      first = false;
+    }
+  }
+  fprintf(file, "\n]}\n");
+
+  fclose(file);
+  printf("%s saved.\n", fileName);
+  return true;
+}
+
+class CScopedTimer {
+ public:
+  explicit CScopedTimer(ETimer timer)
+      : m_timer(timer),
+        m_start(std::chrono::steady_clock::now()),
+        m_trace(c_timerNames[size_t(timer)]) {}
+
+  ~CScopedTimer() {
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - m_start)
+                           .count();
+    g_stats.m_timerNanoseconds[size_t(m_timer)].fetch_add(
+        elapsed, std::memory_order_relaxed);
+    g_stats.m_timerCalls[size_t(m_timer)].fetch_add(1,
+                                                    std::memory_order_relaxed);
+  }
+
+ private:
+  ETimer m_timer;
+  std::chrono::steady_clock::time_point m_start;
+  CScopedTrace m_trace;
+};
+
+#if GRANULAR_INSTRUMENT
+#define GRANULAR_CONCAT_INNER(a, b) a##b
+#define GRANULAR_CONCAT(a, b) GRANULAR_CONCAT_INNER(a, b)
+#define GRANULAR_TIMER(name) \
+  CScopedTimer GRANULAR_CONCAT(scopedTimer, __LINE__)(ETimer::name)
+#define GRANULAR_TRACE(name) \
+  CScopedTrace GRANULAR_CONCAT(scopedTrace, __LINE__)(name)
+#define GRANULAR_COUNT(name, amount)                        \
+  g_stats.m_counters[size_t(ECounter::name)].fetch_add( \
+      uint64_t(amount), std::memory_order_relaxed)
+#else
+#define GRANULAR_TIMER(name)
+#define GRANULAR_TRACE(name)
+#define GRANULAR_COUNT(name, amount) \
+  do {                               \
+  } while (0)
+#endif
+
+void StatsReset() {
+  for (size_t i = 0; i < size_t(ETimer::Count); ++i) {
+    g_stats.m_timerNanoseconds[i] = 0;
+    g_stats.m_timerCalls[i] = 0;
+  }
+  for (size_t i = 0; i < size_t(ECounter::Count); ++i)
+    g_stats.m_counters[i] = 0;
+}
+
+// Writes text as one CSV field, quoted with doubled quotes when it holds a
+// comma, a quote or a line break, so any job name keeps the columns intact.
+void WriteCsvField(FILE* file, const char* text) {
+  if (!strpbrk(text, ",\"\r\n")) {
+    fputs(text, file);
+    return;
+  }
+  fputc('"', file);
+  for (const char* c = text; *c; ++c) {
+    if (*c == '"') fputc('"', file);
+    fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// Writes text as a quoted JSON string, escaping quotes, backslashes and
+// control characters.
+void WriteJsonString(FILE* file, const char* text) {
+  fputc('"', file);
+  for (const char* c = text; *c; ++c) {
+    unsigned char value = static_cast<unsigned char>(*c);
+    if (value == '"' || value == '\\')
+      fprintf(file, "\\%c", value);
+    else if (value < 0x20)
+      fprintf(file, "\\u%04x", value);
+    else
+      fputc(value, file);
+  }
+  fputc('"', file);
+}
+
+// Appends the stats gathered since the last StatsReset() to a summary file,
+// one line per job. The format is picked by extension: ".csv" gives CSV with a
+// header row at the top of a new file, anything else gives one JSON object per
+// line.
+bool StatsAppendSummary(const char* fileName, const char* jobName) {
+  size_t length = strlen(fileName);
+  bool csv = length >= 4 && !strcmp(&fileName[length - 4], ".csv");
+
+  FILE* file = nullptr;
+  fopen_s(&file, fileName, "a+b");
+  if (!file) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
+
+  if (csv) {
+    // only write the header if the file is empty
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0) {
+      fprintf(file, "job");
+      for (size_t i = 0; i < size_t(ETimer::Count); ++i)
+        fprintf(file, ",%sCalls,%sMs", c_timerNames[i], c_timerNames[i]);
+      for (size_t i = 0; i < size_t(ECounter::Count); ++i)
+        fprintf(file, ",%s", c_counterNames[i]);
+      fprintf(file, "\n");
+    }
+
+    WriteCsvField(file, jobName);
+    for (size_t i = 0; i < size_t(ETimer::Count); ++i)
+      fprintf(file, ",%" PRIu64 ",%.3f", uint64_t(g_stats.m_timerCalls[i]),
+              double(g_stats.m_timerNanoseconds[i]) / 1000000.0);
+    for (size_t i = 0; i < size_t(ECounter::Count); ++i)
+      fprintf(file, ",%" PRIu64, uint64_t(g_stats.m_counters[i]));
+    fprintf(file, "\n");
+  } else {
+    fprintf(file, "{\"job\":");
+    WriteJsonString(file, jobName);
+    fprintf(file, ",\"timers\":{");
+    for (size_t i = 0; i < size_t(ETimer::Count); ++i)
+      fprintf(file, "%s\"%s\":{\"calls\":%" PRIu64 ",\"ms\":%.3f}",
+              i ? "," : "", c_timerNames[i], uint64_t(g_stats.m_timerCalls[i]),
+              double(g_stats.m_timerNanoseconds[i]) / 1000000.0);
+    fprintf(file, "},\"counters\":{");
+    for (size_t i = 0; i < size_t(ECounter::Count); ++i)
+      fprintf(file, "%s\"%s\":%" PRIu64, i ? "," : "", c_counterNames[i],
+              uint64_t(g_stats.m_counters[i]));
+    fprintf(file, "}}\n");
+  }
+
+  fclose(file);
+  return true;
+}
+
+// little endian helpers for building and parsing binary formats
+template <typename T>
+void AppendBytes(std::vector<unsigned char>* data, const T& value) {
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+  data->insert(data->end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+bool ConsumeBytes(const std::vector<unsigned char>& data, size_t* index,
+                  T* value) {
+  if (data.size() < *index + sizeof(T)) return false;
+  memcpy(value, &data[*index], sizeof(T));
+  *index += sizeof(T);
+  return true;
+}
+
 // this struct is the minimal required header data for a wav file
 struct SMinimalWaveFileHeader {
   // the main chunk
@@ -63,7 +477,12 @@ enum class ECrossFade {
   Out,
 };
 
-inline void FloatToPCM(unsigned char* PCM, const float& in, size_t numBytes) {
+inline void FloatToPCM(unsigned char* PCM, const float& inUnclipped,
+                       size_t numBytes) {
+  // overlapping grains can add up past full scale. Clip, instead of letting
+  // the integer conversion wrap around.
+  float in = std::min(std::max(inUnclipped, -1.0f), 1.0f);
+
   // 8 bit is unsigned
   if (numBytes == 1) {
     PCM[0] = static_cast<unsigned char>((in * 0.5f + 0.5f) * 255.0f);
@@ -141,656 +560,7993 @@ inline void PCMToFloat(float* out, const unsigned char* PCM, size_t numBytes) {
   }
 }
 
-// numBytes can be 1, 2, 3, or 4.
-// Coresponding to 8 bit, 16 bit, 24 bit, and 32 bit audio.
-bool WriteWaveFile(const char* fileName, std::vector<float>* dataFloat,
-                   uint16 numChannels, uint32 sampleRate, uint16 numBytes) {
-  std::vector<unsigned char> data;
-  data.resize(dataFloat->size() * numBytes);
-  for (size_t i = 0; i < dataFloat->size(); ++i)
-    FloatToPCM((unsigned char*)&data[i * numBytes], (*dataFloat)[i], numBytes);
+enum class EDither {
+  None,         // plain quantization, bit for bit what FloatToPCM() does
+  Triangular,   // TPDF dither of +/- 1 LSB
+  NoiseShaped,  // TPDF dither with the error pushed up in frequency
+};
 
-  uint32 dataSize = static_cast<uint32>(data.size());
-  uint16 bitsPerSample = numBytes * 8;
+// Converts blocks of float samples to PCM, optionally dithered. Dither
+// decorrelates the quantization error from the signal, which otherwise shows
+// up as distortion on quiet tails at 16 bits and below, and noise shaping
+// moves that noise to the top of the spectrum where it is heard least.
+// Samples past full scale are clipped. 32 bit output is never dithered since
+// float samples don't have that much precision to begin with.
+class CPCMEncoder {
+ public:
+  CPCMEncoder(uint16 numChannels, uint16 numBytes, EDither dither,
+              uint32 seed = 0x9e3779b9)
+      : m_numChannels(numChannels),
+        m_numBytes(numBytes),
+        m_dither(numBytes < 4 ? dither : EDither::None) {
+    // seed every lane of the random number generator differently. Xorshift
+    // must never be seeded with zero.
+    for (uint32 lane = 0; lane < c_numLanes; ++lane) {
+      uint32 state = seed + lane * 0x6d2b79f5u;
+      m_rngState[lane] = state ? state : 1;
+    }
+    m_errors.resize(m_numChannels * 3, 0.0f);
+  }
 
-  // open the file if we can
-  FILE* File = nullptr;
-  fopen_s(&File, fileName, "w+b");
-  if (!File) {
-    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
-    return false;
+  // converts numValues interleaved samples to numValues * numBytes bytes of PCM
+  void Encode(const float* in, size_t numValues, unsigned char* PCM) {
+    size_t numClipped = CountClipped(in, numValues);
+    GRANULAR_COUNT(SamplesClipped, numClipped);
+
+    if (m_dither == EDither::None) {
+      for (size_t i = 0; i < numValues; ++i)
+        FloatToPCM(&PCM[i * m_numBytes], in[i], m_numBytes);
+      return;
+    }
+
+    // quantize to integers in blocks, then pack them to bytes
+    float scale = float(1 << (m_numBytes * 8 - 1));
+    for (size_t start = 0; start < numValues; start += c_blockSize) {
+      size_t count = std::min(c_blockSize, numValues - start);
+      MakeNoise(m_noise, count);
+      if (m_dither == EDither::Triangular)
+        Quantize(&in[start], m_noise, count, scale, m_quantized);
+      else
+        QuantizeShaped(&in[start], count, scale);
+
+      unsigned char* out = &PCM[start * m_numBytes];
+      for (size_t i = 0; i < count; ++i) {
+        uint32 data = static_cast<uint32>(m_quantized[i]);
+        switch (m_numBytes) {
+          case 3:
+            out[i * 3 + 2] = (data >> 16) & 0xFF;
+            out[i * 3 + 1] = (data >> 8) & 0xFF;
+            out[i * 3 + 0] = data & 0xFF;
+            break;
+          case 2:
+            out[i * 2 + 1] = (data >> 8) & 0xFF;
+            out[i * 2 + 0] = data & 0xFF;
+            break;
+          case 1:
+            // 8 bit is unsigned
+            out[i] = static_cast<unsigned char>(data + 128);
+            break;
+        }
+      }
+    }
   }
 
-  SMinimalWaveFileHeader waveHeader;
+ private:
+  static const size_t c_blockSize = 1024;
+  static const uint32 c_numLanes = 8;
 
-  // fill out the main chunk
-  memcpy(waveHeader.m_chunkID, "RIFF", 4);
-  waveHeader.m_chunkSize = dataSize + 36;
-  memcpy(waveHeader.m_format, "WAVE", 4);
+  GRANULAR_MULTIVERSION
+  static size_t CountClipped(const float* in, size_t numValues) {
+    size_t numClipped = 0;
+    for (size_t i = 0; i < numValues; ++i)
+      numClipped += (in[i] > 1.0f || in[i] < -1.0f) ? 1 : 0;
+    return numClipped;
+  }
 
-  // fill out sub chunk 1 "fmt "
-  memcpy(waveHeader.m_subChunk1ID, "fmt ", 4);
-  waveHeader.m_subChunk1Size = 16;
-  waveHeader.m_audioFormat = 1;
-  waveHeader.m_numChannels = numChannels;
-  waveHeader.m_sampleRate = sampleRate;
-  waveHeader.m_byteRate = sampleRate * numChannels * bitsPerSample / 8;
-  waveHeader.m_blockAlign = numChannels * bitsPerSample / 8;
-  waveHeader.m_bitsPerSample = bitsPerSample;
+  // triangular noise in [-1, 1) LSB. Independent xorshift32 generators run
+  // side by side so this vectorizes; each output is the difference of two
+  // uniform values, one from each half of the lanes.
+  GRANULAR_MULTIVERSION
+  void MakeNoise(float* noise, size_t count) {
+    const uint32 half = c_numLanes / 2;
+    for (size_t i = 0; i < count; i += half) {
+      float uniform[c_numLanes];
+      for (uint32 lane = 0; lane < c_numLanes; ++lane) {
+        uint32 x = m_rngState[lane];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        m_rngState[lane] = x;
+        uniform[lane] = float(x >> 8) * (1.0f / 16777216.0f);
+      }
+      for (uint32 lane = 0; lane < half; ++lane)
+        noise[i + lane] = uniform[lane] - uniform[lane + half];
+    }
+  }
 
-  // fill out sub chunk 2 "data"
-  memcpy(waveHeader.m_subChunk2ID, "data", 4);
-  waveHeader.m_subChunk2Size = dataSize;
+  GRANULAR_MULTIVERSION
+  static void Quantize(const float* in, const float* noise, size_t count,
+                       float scale, int32* out) {
+    for (size_t i = 0; i < count; ++i) {
+      float value = std::floor(in[i] * scale + noise[i] + 0.5f);
+      value = std::min(std::max(value, -scale), scale - 1.0f);
+      out[i] = static_cast<int32>(value);
+    }
+  }
 
-  // write the header
-  fwrite(&waveHeader, sizeof(SMinimalWaveFileHeader), 1, File);
+  // error feedback quantizer. The filter is Wannamaker's 3 tap E-weighted
+  // shaping filter, which puts the noise where the ear is least sensitive at
+  // 44.1kHz and 48kHz. This one is serial per channel so it is left scalar.
+  void QuantizeShaped(const float* in, size_t count, float scale) {
+    const float c_shaping[3] = {1.623f, -0.982f, 0.109f};
+    for (size_t i = 0; i < count; ++i) {
+      float* errors = &m_errors[m_channel * 3];
+      float wanted = std::min(std::max(in[i], -1.0f), 1.0f) * scale;
+      float shaped = wanted - (c_shaping[0] * errors[0] +
+                               c_shaping[1] * errors[1] +
+                               c_shaping[2] * errors[2]);
+      float value = std::floor(shaped + m_noise[i] + 0.5f);
+      value = std::min(std::max(value, -scale), scale - 1.0f);
+      m_quantized[i] = static_cast<int32>(value);
 
-  // write the wave data itself
-  fwrite(&data[0], dataSize, 1, File);
+      errors[2] = errors[1];
+      errors[1] = errors[0];
+      errors[0] = value - shaped;
 
-  // close the file and return success
-  fclose(File);
-  printf("%s saved.\n", fileName);
-  return true;
-}
+      // keep a full scale signal from making the error run away
+      errors[0] = std::min(std::max(errors[0], -4.0f), 4.0f);
 
-bool ReadFileIntoMemory(const char* fileName,
-                        std::vector<unsigned char>* data) {
-  // open the file if we can
-  FILE* file = nullptr;
-  fopen_s(&file, fileName, "rb");
-  if (!file) {
-    printf("[-----ERROR-----]Could not open %s for reading.\n", fileName);
-    return false;
+      if (++m_channel == m_numChannels) m_channel = 0;
+    }
   }
 
-  // get the file size and resize the vector to hold the data
-  fseek(file, 0, SEEK_END);
-  data->resize(ftell(file));
+  uint16 m_numChannels;
+  uint16 m_numBytes;
+  EDither m_dither;
+  uint32 m_rngState[c_numLanes];
+  std::vector<float> m_errors;  // last 3 shaping errors per channel
+  uint16 m_channel = 0;         // channel of the next value, for shaping
+  float m_noise[c_blockSize];
+  int32 m_quantized[c_blockSize];
+};
 
-  // read the file into the vector
-  fseek(file, 0, SEEK_SET);
-  fread(&(*data)[0], 1, data->size(), file);
+const size_t CPCMEncoder::c_blockSize;
+const uint32 CPCMEncoder::c_numLanes;
 
-  // return success
-  fclose(file);
-  return true;
-}
+// a chunk of a wave file that isn't audio, like LIST or bext metadata, kept so
+// it can be written back out
+struct SWaveChunk {
+  unsigned char m_id[4];
+  std::vector<unsigned char> m_data;
+};
 
-bool ReadWaveFile(const char* fileName, std::vector<float>* data,
-                  uint16* numChannels, uint32* sampleRate, uint16* numBytes) {
-  // read the whole file into memory if we can
-  std::vector<unsigned char> fileData;
-  if (!ReadFileIntoMemory(fileName, &fileData)) return false;
-  size_t fileIndex = 0;
+// where a chunk is in a file that is in memory
+struct SRiffChunk {
+  unsigned char m_id[4];
+  size_t m_offset;  // of the chunk data, after the id and size
+  uint64_t m_size;
+};
 
-  // make sure the main chunk ID is "RIFF"
-  if ((fileData.size() < fileIndex + 4) ||
-      memcmp(&fileData[fileIndex], "RIFF", 4)) {
-    printf("[-----ERROR-----]%s is an invalid input file. (1)\n", fileName);
-    return false;
-  }
-  fileIndex += 4;
+// dataSize for a header whose size isn't known yet
+const uint64_t c_unknownDataSize = uint64_t(-1);
 
-  // get the main chunk size
-  uint32 chunkSize;
-  if (fileData.size() < fileIndex + 4) {
-    printf("[-----ERROR-----]%s is an invalid input file. (2)\n", fileName);
-    return false;
-  }
-  chunkSize = *(uint32*)&fileData[fileIndex];
-  fileIndex += 4;
+// Makes the header of a wave file: everything up to the sample data. Files
+// too big for 32 bit RIFF sizes are written as RF64, with the real sizes in a
+// ds64 chunk right after "WAVE". reserveDs64 puts a JUNK chunk there in plain
+// RIFF files instead, so a streaming writer that finds out it went past 4GB
+// can turn the header into RF64 in place. With an unknown dataSize the sizes
+// are placeholders.
+void MakeWaveHeader(std::vector<unsigned char>* header, uint64_t dataSize,
+                    uint16 numChannels, uint32 sampleRate, uint16 numBytes,
+                    const std::vector<SWaveChunk>* metadata,
+                    bool reserveDs64) {
+  uint16 bitsPerSample = numBytes * 8;
 
-  // make sure the format is "WAVE"
-  if ((fileData.size() < fileIndex + 4) ||
-      memcmp(&fileData[fileIndex], "WAVE", 4)) {
-    printf("[-----ERROR-----]%s is an invalid input file. (3)\n", fileName);
-    return false;
+  // everything in the RIFF chunk, after its id and size
+  uint64_t metadataSize = 0;
+  if (metadata) {
+    for (const SWaveChunk& chunk : *metadata)
+      metadataSize += 8 + chunk.m_data.size() + (chunk.m_data.size() & 1);
   }
-  fileIndex += 4;
+  bool sizeKnown = dataSize != c_unknownDataSize;
+  uint64_t riffSize = 4 + 24 + metadataSize + 8 + (sizeKnown ? dataSize : 0);
+  bool rf64 = sizeKnown && riffSize + (reserveDs64 ? 36 : 0) > 0xFFFFFFFF;
+  if (rf64 || reserveDs64) riffSize += 36;
 
-  size_t chunkPosFmt = -1;
-  size_t chunkPosData = -1;
-  while (chunkPosFmt == -1 || chunkPosData == -1) {
-    // get a chunk id and chunk size if we can
-    if (fileData.size() < fileIndex + 8) {
-      printf("[-----ERROR-----]%s is an invalid input file. (4)\n", fileName);
-      return false;
-    }
+  header->clear();
 
-    // get the chunk id if we can
-    const unsigned char* chunkID = (unsigned char*)&fileData[fileIndex];
-    fileIndex += 4;
-    chunkSize = *(uint32*)&fileData[fileIndex];
-    fileIndex += 4;
+  // the main chunk
+  const char* riffID = rf64 ? "RF64" : "RIFF";
+  header->insert(header->end(), riffID, riffID + 4);
+  AppendBytes(header, uint32(rf64 || !sizeKnown ? 0xFFFFFFFF : riffSize));
+  header->insert(header->end(), "WAVE", "WAVE" + 4);
 
-    // if we hit a fmt
-    if (!memcmp(chunkID, "fmt ", 4)) {
-      chunkPosFmt = static_cast<size_t>(fileIndex - 8);
-      // else if we hit a data
-    } else if (!memcmp(chunkID, "data", 4)) {
-      chunkPosData = static_cast<size_t>(fileIndex - 8);
-    }
+  // ds64, or room for it
+  if (rf64) {
+    header->insert(header->end(), "ds64", "ds64" + 4);
+    AppendBytes(header, uint32(28));
+    AppendBytes(header, riffSize);
+    AppendBytes(header, dataSize);
+    AppendBytes(header, uint64_t(dataSize / (numChannels * numBytes)));
+    AppendBytes(header, uint32(0));  // no table of other big chunks
+  } else if (reserveDs64) {
+    header->insert(header->end(), "JUNK", "JUNK" + 4);
+    AppendBytes(header, uint32(28));
+    header->resize(header->size() + 28, 0);
+  }
+
+  // "fmt "
+  header->insert(header->end(), "fmt ", "fmt " + 4);
+  AppendBytes(header, uint32(16));
+  AppendBytes(header, uint16(1));
+  AppendBytes(header, numChannels);
+  AppendBytes(header, sampleRate);
+  AppendBytes(header, uint32(sampleRate * numChannels * bitsPerSample / 8));
+  AppendBytes(header, uint16(numChannels * bitsPerSample / 8));
+  AppendBytes(header, bitsPerSample);
 
-    // skip to the next chunk
-    fileIndex += chunkSize;
+  // metadata, with pad bytes to keep chunks word aligned
+  if (metadata) {
+    for (const SWaveChunk& chunk : *metadata) {
+      header->insert(header->end(), chunk.m_id, chunk.m_id + 4);
+      AppendBytes(header, uint32(chunk.m_data.size()));
+      header->insert(header->end(), chunk.m_data.begin(), chunk.m_data.end());
+      if (chunk.m_data.size() & 1) header->push_back(0);
+    }
   }
 
-  // we'll use this handy struct to load in
-  SMinimalWaveFileHeader waveData;
+  // "data", followed by the samples
+  header->insert(header->end(), "data", "data" + 4);
+  AppendBytes(header, uint32(rf64 || !sizeKnown ? 0xFFFFFFFF : dataSize));
+}
 
-  // load the fmt part if we can
-  fileIndex = chunkPosFmt;
-  if (fileData.size() < fileIndex + 24) {
-    printf("[-----ERROR-----]%s is an invalid input file. (5)\n", fileName);
+// Indexes the chunks of a RIFF, RF64 or BW64 wave file in one pass. For RF64
+// and BW64 the real sizes of the chunks with 0xFFFFFFFF sizes come from ds64.
+// A chunk that runs past the end of the file (a data chunk with a placeholder
+// size, or a truncated file) is cut to what is there and ends the scan.
+bool IndexWaveChunks(const std::vector<unsigned char>& fileData,
+                     const char* fileName, std::vector<SRiffChunk>* chunks) {
+  // make sure the main chunk ID is "RIFF", "RF64" or "BW64"
+  if ((fileData.size() < 4) || (memcmp(&fileData[0], "RIFF", 4) &&
+                                memcmp(&fileData[0], "RF64", 4) &&
+                                memcmp(&fileData[0], "BW64", 4))) {
+    printf("[-----ERROR-----]%s is an invalid input file. (1)\n", fileName);
     return false;
   }
-  memcpy(&waveData.m_subChunk1ID, &fileData[fileIndex], 24);
-  fileIndex += 24;
+  bool rf64 = memcmp(&fileData[0], "RIFF", 4) != 0;
 
-  // load the data part if we can
-  fileIndex = chunkPosData;
-  if (fileData.size() < fileIndex + 8) {
-    printf("[-----ERROR-----]%s is an invalid input file. (6)\n", fileName);
+  // get the main chunk size
+  if (fileData.size() < 8) {
+    printf("[-----ERROR-----]%s is an invalid input file. (2)\n", fileName);
     return false;
   }
-  memcpy(&waveData.m_subChunk2ID, &fileData[fileIndex], 8);
-  fileIndex += 8;
 
-  // verify a couple things about the file data
-  if (waveData.m_audioFormat != 1 ||        // only pcm data
-      waveData.m_numChannels < 1 ||         // must have a channel
-      waveData.m_numChannels > 2 ||         // must not have more than 2
-      waveData.m_bitsPerSample > 32 ||      // 32 bits per sample max
-      waveData.m_bitsPerSample % 8 != 0 ||  // must be a multiple of 8 bites
-      waveData.m_blockAlign > 8) {          // blocks must be 8 bytes or lower
-    printf("[-----ERROR-----]%s is an invalid input file. (7)\n", fileName);
+  // make sure the format is "WAVE"
+  if ((fileData.size() < 12) || memcmp(&fileData[8], "WAVE", 4)) {
+    printf("[-----ERROR-----]%s is an invalid input file. (3)\n", fileName);
     return false;
   }
 
-  // figure out how many samples and blocks there are total in the source data
-  size_t bytesPerSample = waveData.m_blockAlign / waveData.m_numChannels;
-  size_t numSourceSamples = waveData.m_subChunk2Size / bytesPerSample;
+  chunks->clear();
+  uint64_t ds64DataSize = 0;
+  std::vector<SWaveChunk> ds64Table;
+  size_t fileIndex = 12;
+  while (fileData.size() >= fileIndex + 8) {
+    SRiffChunk chunk;
+    memcpy(chunk.m_id, &fileData[fileIndex], 4);
+    uint32 chunkSize;
+    memcpy(&chunkSize, &fileData[fileIndex + 4], 4);
+    chunk.m_offset = fileIndex + 8;
+    chunk.m_size = chunkSize;
 
-  // allocate space for the source samples
-  data->resize(numSourceSamples);
+    // RF64 keeps the real sizes of big chunks in ds64, which comes first
+    if (rf64 && !memcmp(chunk.m_id, "ds64", 4) && chunkSize >= 28 &&
+        fileData.size() >= chunk.m_offset + chunkSize) {
+      const unsigned char* ds64 = &fileData[chunk.m_offset];
+      memcpy(&ds64DataSize, &ds64[8], 8);
+      uint32 tableLength;
+      memcpy(&tableLength, &ds64[24], 4);
+      for (uint32 i = 0; i < tableLength && 28 + (i + 1) * 12 <= chunkSize;
+           ++i) {
+        SWaveChunk entry;
+        memcpy(entry.m_id, &ds64[28 + i * 12], 4);
+        entry.m_data.assign(&ds64[28 + i * 12 + 4], &ds64[28 + i * 12 + 12]);
+        ds64Table.push_back(entry);
+      }
+    } else if (rf64 && chunkSize == 0xFFFFFFFF) {
+      if (!memcmp(chunk.m_id, "data", 4)) chunk.m_size = ds64DataSize;
+      for (const SWaveChunk& entry : ds64Table) {
+        if (!memcmp(entry.m_id, chunk.m_id, 4))
+          memcpy(&chunk.m_size, &entry.m_data[0], 8);
+      }
+    }
 
-  // read in the source samples at whatever sample rate / number of channels it
-  // might be in
-  if (fileData.size() < fileIndex + numSourceSamples * bytesPerSample) {
-    printf("[-----ERROR-----]%s is an invalid input file. (8)\n", fileName);
-    return false;
-  }
+    uint64_t available = fileData.size() - chunk.m_offset;
+    bool truncated = chunk.m_size > available;
+    if (truncated) chunk.m_size = available;
+    chunks->push_back(chunk);
+    if (truncated) break;
 
-  for (size_t nIndex = 0; nIndex < numSourceSamples; ++nIndex) {
-    PCMToFloat(&((*data)[nIndex]), &fileData[fileIndex], bytesPerSample);
-    fileIndex += bytesPerSample;
+    // skip to the next chunk, and its pad byte if the size is odd
+    fileIndex = size_t(chunk.m_offset + chunk.m_size + (chunk.m_size & 1));
   }
-
-  // return our data
-  *numChannels = waveData.m_numChannels;
-  *sampleRate = waveData.m_sampleRate;
-  *numBytes = waveData.m_bitsPerSample / 8;
-
-  printf("%s loaded.\n", fileName);
   return true;
 }
 
-// Cubic hermite interpolation. More information available here:
-// https://blog.demofox.org/2015/08/08/cubic-hermite-interpolation/
-// t is a value that goes from 0 to 1 to interpolate in a C1 continuous way
-// across uniformly sampled data points.
-// when t is 0, this will return B. When t is 1, this will return C.
-static float CubicHermite(float A, float B, float C, float D, float t) {
-  float a = -A / 2.0f + (3.0f * B) / 2.0f - (3.0f * C) / 2.0f + D / 2.0f;
-  float b = A - (5.0f * B) / 2.0f + 2.0f * C - D / 2.0f;
-  float c = -A / 2.0f + C / 2.0f;
-  float d = B;
-
-  return a * t * t * t + b * t * t + c * t + d;
+// file names ending in ".flac" are written as FLAC instead of wave
+inline bool IsFlacFileName(const char* fileName) {
+  size_t length = strlen(fileName);
+  return length >= 5 && !strcmp(&fileName[length - 5], ".flac");
 }
 
-inline float SampleChannelFractional(const std::vector<float>& input,
-                                     float sampleFloat, uint16 channel,
-                                     uint16 numChannels) {
-// change this to #if 0 to use linear interpolation instead, which is faster but
-// lower quality
-#if 1
-
-  // This uses cubic hermite interpolation to get values between samples
-
-  size_t sample = size_t(sampleFloat);
-  float sampleFraction = sampleFloat - std::floor(sampleFloat);
-
-  size_t sampleIndexNeg1 = (sample > 0) ? sample - 1 : sample;
-  size_t sampleIndex0 = sample;
-  size_t sampleIndex1 = sample + 1;
-  size_t sampleIndex2 = sample + 2;
+// defined with the FLAC encoder further down
+class CThreadPool;
+bool WriteFlacFile(const char* fileName, std::vector<float>* dataFloat,
+                   uint16 numChannels, uint32 sampleRate, uint16 numBytes,
+                   const std::vector<SWaveChunk>* metadata = nullptr,
+                   CThreadPool* threadPool = nullptr);
 
-  sampleIndexNeg1 = sampleIndexNeg1 * numChannels + channel;
-  sampleIndex0 = sampleIndex0 * numChannels + channel;
-  sampleIndex1 = sampleIndex1 * numChannels + channel;
-  sampleIndex2 = sampleIndex2 * numChannels + channel;
-
-  sampleIndexNeg1 = std::min(sampleIndexNeg1, input.size() - 1);
-  sampleIndex0 = std::min(sampleIndex0, input.size() - 1);
-  sampleIndex1 = std::min(sampleIndex1, input.size() - 1);
-  sampleIndex2 = std::min(sampleIndex2, input.size() - 1);
+// encodes a whole wave file into memory
+void EncodeWaveFile(std::vector<unsigned char>* file,
+                    const std::vector<float>& dataFloat, uint16 numChannels,
+                    uint32 sampleRate, uint16 numBytes,
+                    const std::vector<SWaveChunk>* metadata = nullptr) {
+  uint64_t dataSize = uint64_t(dataFloat.size()) * numBytes;
+  MakeWaveHeader(file, dataSize, numChannels, sampleRate, numBytes, metadata,
+                 false);
+  size_t headerSize = file->size();
+  file->resize(headerSize + size_t(dataSize));
+  CPCMEncoder encoder(numChannels, numBytes, EDither::None);
+  encoder.Encode(dataFloat.data(), dataFloat.size(), file->data() + headerSize);
+}
 
-  return CubicHermite(input[sampleIndexNeg1], input[sampleIndex0],
-                      input[sampleIndex1], input[sampleIndex2], sampleFraction);
-#else
+// numBytes can be 1, 2, 3, or 4.
+// Coresponding to 8 bit, 16 bit, 24 bit, and 32 bit audio.
+// Chunks in metadata (from ReadWaveFile(), say) are written along with the
+// audio, in FLAC files as APPLICATION blocks, see WriteFlacFileStreaming().
+// FLAC files are encoded across threadPool if one is given.
+bool WriteWaveFile(const char* fileName, std::vector<float>* dataFloat,
+                   uint16 numChannels, uint32 sampleRate, uint16 numBytes,
+                   const std::vector<SWaveChunk>* metadata = nullptr,
+                   CThreadPool* threadPool = nullptr) {
+  if (IsFlacFileName(fileName))
+    return WriteFlacFile(fileName, dataFloat, numChannels, sampleRate,
+                         numBytes, metadata, threadPool);
 
-  // This uses linear interpolation to get values between samples.
+  GRANULAR_TIMER(WriteWaveFile);
 
-  size_t sample = size_t(sampleFloat);
-  float sampleFraction = sampleFloat - std::floor(sampleFloat);
+  std::vector<unsigned char> data;
+  EncodeWaveFile(&data, *dataFloat, numChannels, sampleRate, numBytes,
+                 metadata);
 
-  size_t sample1Index = sample * numChannels + channel;
-  sample1Index = std::min(sample1Index, input.size() - 1);
-  float value1 = input[sample1Index];
+  // open the file if we can
+  FILE* File = nullptr;
+  fopen_s(&File, fileName, "w+b");
+  if (!File) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
 
-  size_t sample2Index = (sample + 1) * numChannels + channel;
-  sample2Index = std::min(sample2Index, input.size() - 1);
-  float value2 = input[sample1Index];
+  // write the header and the wave data itself
+  bool written = fwrite(&data[0], data.size(), 1, File) == 1;
+  GRANULAR_COUNT(BytesWritten, data.size());
 
-  return value1 * (1.0f - sampleFraction) + value2 * sampleFraction;
-#endif
+  // close the file and return success, unless something didn't make it to
+  // the disk (it's full, say)
+  written = fclose(File) == 0 && written;
+  if (!written) {
+    printf("[-----ERROR-----] Could not write %s.\n", fileName);
+    return false;
+  }
+  printf("%s saved.\n", fileName);
+  return true;
 }
 
-// Resample
-void TimeAdjust(const std::vector<float>& input, std::vector<float>* output,
-                uint16 numChannels, float timeMultiplier) {
-  size_t numSrcSamples = input.size() / numChannels;
-  size_t numOutSamples =
-      (size_t)(static_cast<float>(numSrcSamples) * timeMultiplier);
-  output->resize(numOutSamples * numChannels);
+bool ReadFileIntoMemory(const char* fileName,
+                        std::vector<unsigned char>* data) {
+  // open the file if we can
+  FILE* file = OpenFile(fileName, "rb");
+  if (!file) {
+    printf("[-----ERROR-----]Could not open %s for reading.\n", fileName);
+    return false;
+  }
 
-  for (size_t outSample = 0; outSample < numOutSamples; ++outSample) {
-    float percent =
-        static_cast<float>(outSample) / static_cast<float>(numOutSamples - 1);
+  // get the file size and resize the vector to hold the data
+  long fileSize = -1;
+  if (fseek(file, 0, SEEK_END) == 0) fileSize = ftell(file);
 
-    float srcSampleFloat = static_cast<float>(numSrcSamples) * percent;
+  if (fileSize >= 0) {
+    // read the file into the vector
+    data->resize(fileSize);
+    fseek(file, 0, SEEK_SET);
+    if (fileSize > 0) fread(&(*data)[0], 1, data->size(), file);
+  } else {
+    // pipes can't tell how big they are, so read chunks until the end
+    const size_t c_chunkSize = 1 << 16;
+    data->clear();
+    size_t count;
+    do {
+      size_t oldSize = data->size();
+      data->resize(oldSize + c_chunkSize);
+      count = fread(&(*data)[oldSize], 1, c_chunkSize, file);
+      data->resize(oldSize + count);
+    } while (count == c_chunkSize);
+  }
+  GRANULAR_COUNT(BytesRead, data->size());
 
-    for (uint16 channel = 0; channel < numChannels; ++channel)
-      (*output)[outSample * numChannels + channel] =
-          SampleChannelFractional(input, srcSampleFloat, channel, numChannels);
+  // return success
+  CloseFile(file);
+  return true;
+}
+
+// FLAC decoding. The decoder reads from a callback so the same code decodes
+// files already in memory and streams coming in through CReadAheadFile.
+// Supports everything the reference encoder writes up to 24 bits per sample.
+// Frames with a bad header CRC-8 or a bad frame CRC-16 are rejected.
+
+// counts the zero bits above the highest set bit. value must not be 0.
+inline uint32 CountLeadingZeros(uint64_t value) {
+#if defined(__GNUC__)
+  return uint32(__builtin_clzll(value));
+#else
+  uint32 count = 0;
+  while (!(value & (uint64_t(1) << 63))) {
+    value <<= 1;
+    ++count;
   }
+  return count;
+#endif
 }
 
-// writes a grain to the output buffer, applying a fade in or fade out at the
-// beginning if it should, as well as a pitch multiplier (playback speed
-// multiplier) for the grain
-size_t SplatGrainToOutput(const std::vector<float>& input,
-                          std::vector<float>* output, uint16 numChannels,
-                          size_t grainStart, size_t grainSize,
-                          size_t outputSampleIndex, ECrossFade crossFade,
-                          size_t crossFadeSize, float pitchMultiplier,
-                          bool isFinalGrain) {
-  // calculate starting indices
-  size_t outputIndex = outputSampleIndex * numChannels;
+// CRC-8 of FLAC frame headers, polynomial x^8 + x^2 + x + 1
+inline unsigned char FlacCRC8(unsigned char crc, unsigned char byte) {
+  crc ^= byte;
+  for (int bit = 0; bit < 8; ++bit)
+    crc = (crc & 0x80) ? (unsigned char)((crc << 1) ^ 0x07)
+                       : (unsigned char)(crc << 1);
+  return crc;
+}
 
-  // write the samples
-  size_t numSamplesWritten = 0;
-  for (float sample = 0; sample < static_cast<float>(grainSize);
-       sample += pitchMultiplier) {
-    // break out of the loop if we are out of bounds on the input or output
-    if (outputIndex + numChannels > output->size()) break;
+// CRC-16 of FLAC frames, polynomial x^16 + x^15 + x^2 + 1
+inline uint16 FlacCRC16(uint16 crc, const unsigned char* data, size_t size) {
+  static const std::vector<uint16> c_table = [] {
+    std::vector<uint16> table(256);
+    for (uint32 i = 0; i < 256; ++i) {
+      uint32 value = i << 8;
+      for (int bit = 0; bit < 8; ++bit)
+        value = (value & 0x8000) ? (value << 1) ^ 0x8005 : value << 1;
+      table[i] = uint16(value);
+    }
+    return table;
+  }();
+  for (size_t i = 0; i < size; ++i)
+    crc = uint16((crc << 8) ^ c_table[(crc >> 8) ^ data[i]]);
+  return crc;
+}
 
-    float inputIndexSamples = static_cast<float>(grainStart) + sample;
-    if (size_t(inputIndexSamples) * numChannels + numChannels > input.size())
-      break;
+// reads a byte stream most significant bit first, through a 64 bit cache.
+// The bytes read since StartCRC16() can be checked with CRC16().
+class CFlacBitReader {
+ public:
+  typedef std::function<size_t(unsigned char*, size_t)> ReadFunction;
+
+  explicit CFlacBitReader(ReadFunction read)
+      : m_read(read), m_buffer(c_history + (1 << 16)) {}
 
-    // calculate envelope for this sample
-    float envelope = 1.0f;
-    if (crossFade != ECrossFade::None) {
-      if (sample <= static_cast<float>(crossFadeSize))
-        envelope = sample / static_cast<float>(crossFadeSize);
-      if (crossFade == ECrossFade::Out) envelope = 1.0f - envelope;
+  // count can be 0 to 32
+  uint32 ReadBits(uint32 count) {
+    if (count == 0) return 0;
+    if (m_numBits < count) Fill();
+    if (m_numBits < count) {
+      m_overrun = true;
+      m_numBits = 0;
+      m_cache = 0;
+      return 0;
     }
+    uint32 value = uint32(m_cache >> (64 - count));
+    m_cache <<= count;
+    m_numBits -= count;
+    return value;
+  }
 
-    // write the enveloped sample
-    for (uint16 channel = 0; channel < numChannels; ++channel)
-      (*output)[outputIndex + channel] +=
-          SampleChannelFractional(input, inputIndexSamples, channel,
-                                  numChannels) *
-          envelope;
+  int32 ReadSignedBits(uint32 count) {
+    if (count == 0) return 0;
+    uint32 value = ReadBits(count) << (32 - count);
+    return int32(value) >> (32 - count);
+  }
 
-    // move to the next samples
-    outputIndex += numChannels;
-    ++numSamplesWritten;
+  // counts zero bits up to and including the next one bit
+  uint32 ReadUnary() {
+    uint32 count = 0;
+    while (true) {
+      if (m_numBits == 0) Fill();
+      if (m_numBits == 0) {
+        m_overrun = true;
+        return count;
+      }
+      // bits below m_numBits are always zero
+      if (m_cache == 0) {
+        count += m_numBits;
+        m_numBits = 0;
+        continue;
+      }
+      uint32 zeros = CountLeadingZeros(m_cache);
+      count += zeros;
+      m_cache = (zeros == 63) ? 0 : m_cache << (zeros + 1);
+      m_numBits -= zeros + 1;
+      return count;
+    }
   }
 
-  // report an error if ever the cross fade size was bigger than the actual
-  // grain size, since this causes popping and would be hard to find the cause
-  // of.
-  // suppress error on final grain since there can be false positives due to
-  // sound ending. That makes false negatives but calling this good enough.
-  if (!isFinalGrain && crossFadeSize > numSamplesWritten) {
-    static bool reportedError = false;
-    if (!reportedError) {
-      printf(
-          "[-----ERROR-----] cross fade is longer than a grain size! (error "
-          "only reported once)\n");
-      reportedError = true;
+  // skips the rest of the current byte
+  void AlignToByte() {
+    uint32 count = m_numBits & 7;
+    m_cache <<= count;
+    m_numBits -= count;
+  }
+
+  // skips whole bytes. Only valid when aligned to a byte.
+  void SkipBytes(size_t count) {
+    while (count > 0 && m_numBits > 0) {
+      ReadBits(8);
+      --count;
+    }
+    while (count > 0) {
+      if (m_position == m_end && !FillBuffer()) {
+        m_overrun = true;
+        return;
+      }
+      size_t skip = std::min(count, m_end - m_position);
+      m_position += skip;
+      count -= skip;
     }
   }
 
-  // return how many samples we wrote
-  return numSamplesWritten;
-}
+  // starts a CRC-16 over the bytes read from here on. Only valid when aligned
+  // to a byte, and SkipBytes() mustn't be used until CRC16().
+  void StartCRC16() {
+    m_crcPosition = m_position - m_numBits / 8;
+    m_crc = 0;
+  }
 
-void GranularTimePitchAdjust(const std::vector<float>& input,
-                             std::vector<float>* output, uint16 numChannels,
-                             uint32 sampleRate, float timeMultiplier,
-                             float pitchMultiplier, float grainSizeSeconds,
-                             float crossFadeSeconds) {
-  // calculate size of output buffer and resize it
-  size_t numInputSamples = input.size() / numChannels;
-  size_t numOutputSamples =
-      (size_t)(static_cast<float>(numInputSamples) * timeMultiplier);
-  output->clear();
-  output->resize(numOutputSamples * numChannels, 0.0f);
+  // the CRC-16 of the bytes read since StartCRC16(). Only valid when aligned
+  // to a byte.
+  uint16 CRC16() {
+    size_t position = m_position - m_numBits / 8;
+    m_crc =
+        FlacCRC16(m_crc, &m_buffer[m_crcPosition], position - m_crcPosition);
+    m_crcPosition = position;
+    return m_crc;
+  }
 
-  // calculate how many grains are in the input data
-  size_t grainSizeSamples =
-      size_t(static_cast<float>(sampleRate) * grainSizeSeconds);
-  size_t numGrains = numInputSamples / grainSizeSamples;
-  if (numInputSamples % grainSizeSamples) numGrains++;
+  // true when every bit has been read
+  bool AtEnd() {
+    if (m_numBits == 0) Fill();
+    return m_numBits == 0;
+  }
 
-  // calculate the cross fade size
-  size_t crossFadeSizeSamples =
-      size_t(static_cast<float>(sampleRate) * crossFadeSeconds);
+  // true if a read went past the end of the input
+  bool Overrun() const { return m_overrun; }
 
-  // Repeat each grain 0 or more times to make the output be the correct size
-  size_t outputSampleIndex = 0;
-  size_t lastGrainWritten = -1;
-  for (size_t grain = 0; grain < numGrains; ++grain) {
-    // calculate the boundaries of the grain
-    size_t inputGrainStart = grain * grainSizeSamples;
+ private:
+  // the last c_history bytes of the buffer are kept in front of the new ones,
+  // since the cache can still hold some of them and the CRC needs them
+  bool FillBuffer() {
+    size_t kept = m_end - c_history;
+    if (m_crcPosition < kept) {
+      m_crc = FlacCRC16(m_crc, &m_buffer[m_crcPosition], kept - m_crcPosition);
+      m_crcPosition = kept;
+    }
+    m_crcPosition -= kept;
+    memmove(&m_buffer[0], &m_buffer[kept], c_history);
+    m_position = c_history;
+    m_end = c_history +
+            m_read(&m_buffer[c_history], m_buffer.size() - c_history);
+    return m_end > c_history;
+  }
 
-    // calculate the end of where this grain should go in the output buffer
-    size_t outputSampleWindowEnd = static_cast<size_t>(
-        static_cast<float>(inputGrainStart + grainSizeSamples) *
-        timeMultiplier);
+  void Fill() {
+    while (m_numBits <= 56) {
+      if (m_position == m_end && !FillBuffer()) return;
+      m_cache |= uint64_t(m_buffer[m_position++]) << (56 - m_numBits);
+      m_numBits += 8;
+    }
+  }
 
-    // Splat out zero or more copies of the grain to get our output to be at
-    // least as far as we want it to be.
-    // Zero copies happens when we shorten time and need to cut pieces (grains)
-    // out of the original sound
-    while (outputSampleIndex < outputSampleWindowEnd) {
-      bool isFinalGrain = (grain == numGrains - 1);
+  static const size_t c_history = 8;
 
-      // if we are writing our first grain, or the last grain we wrote was the
-      // previous grain, then we don't need to do a cross fade`
-      if ((lastGrainWritten == -1) || (lastGrainWritten == grain - 1)) {
-        outputSampleIndex += SplatGrainToOutput(
-            input, output, numChannels, inputGrainStart, grainSizeSamples,
-            outputSampleIndex, ECrossFade::None, crossFadeSizeSamples,
-            pitchMultiplier, isFinalGrain);
-        lastGrainWritten = grain;
+  ReadFunction m_read;
+  std::vector<unsigned char> m_buffer;
+  size_t m_position = c_history;
+  size_t m_end = c_history;
+  uint64_t m_cache = 0;
+  uint32 m_numBits = 0;
+  bool m_overrun = false;
+  size_t m_crcPosition = c_history;
+  uint16 m_crc = 0;
+};
+
+// converts a decoded integer sample to float the same way PCMToFloat() does
+// for a wave file holding the same sample, so FLAC and wave inputs render
+// identically
+inline void IntSampleToFloat(float* out, int32 sample, uint16 bitsPerSample) {
+  size_t numBytes = (bitsPerSample + 7) / 8;
+  uint32 value = uint32(sample) << (numBytes * 8 - bitsPerSample);
+  if (numBytes == 1) value ^= 0x80;  // 8 bit wave data is unsigned
+  unsigned char PCM[4];
+  for (size_t i = 0; i < numBytes; ++i)
+    PCM[i] = static_cast<unsigned char>(value >> (i * 8));
+  PCMToFloat(out, PCM, numBytes);
+}
+
+class CFlacDecoder {
+ public:
+  explicit CFlacDecoder(CFlacBitReader::ReadFunction read) : m_bits(read) {}
+
+  // reads the "fLaC" marker and the metadata blocks before the audio
+  bool ReadHeader(const char* fileName) {
+    unsigned char marker[4];
+    for (unsigned char& byte : marker) byte = (unsigned char)m_bits.ReadBits(8);
+    if (memcmp(marker, "fLaC", 4)) {
+      printf("[-----ERROR-----]%s is not a FLAC file.\n", fileName);
+      return false;
+    }
+
+    bool foundStreamInfo = false;
+    bool lastBlock = false;
+    while (!lastBlock) {
+      lastBlock = m_bits.ReadBits(1) != 0;
+      uint32 type = m_bits.ReadBits(7);
+      uint32 length = m_bits.ReadBits(24);
+      if (m_bits.Overrun()) break;
+
+      // wave chunks kept by WriteFlacFileStreaming()
+      if (type == 2 && length >= 12) {
+        unsigned char id[4];
+        for (unsigned char& byte : id) byte = (unsigned char)m_bits.ReadBits(8);
+        if (memcmp(id, "riff", 4)) {
+          m_bits.SkipBytes(length - 4);
+          continue;
+        }
+        SWaveChunk chunk;
+        for (unsigned char& byte : chunk.m_id)
+          byte = (unsigned char)m_bits.ReadBits(8);
+        uint32 size = 0;
+        for (int i = 0; i < 4; ++i) size |= m_bits.ReadBits(8) << (i * 8);
+        if (size > length - 12) {
+          printf("[-----ERROR-----]%s is an invalid FLAC file. (1)\n",
+                 fileName);
+          return false;
+        }
+        chunk.m_data.resize(size);
+        for (unsigned char& byte : chunk.m_data)
+          byte = (unsigned char)m_bits.ReadBits(8);
+        m_bits.SkipBytes(length - 12 - size);
+        m_metadata.push_back(chunk);
         continue;
       }
 
-      // else we need to fade out the old grain and then fade in the new one.
-      // NOTE: fading out the old grain means starting to play the grain after
-      // the last one and bringing it's volume down to zero.
-      SplatGrainToOutput(input, output, numChannels,
-                         (lastGrainWritten + 1) * grainSizeSamples,
-                         grainSizeSamples, outputSampleIndex, ECrossFade::Out,
-                         crossFadeSizeSamples, pitchMultiplier, isFinalGrain);
-      outputSampleIndex += SplatGrainToOutput(
-          input, output, numChannels, inputGrainStart, grainSizeSamples,
-          outputSampleIndex, ECrossFade::In, crossFadeSizeSamples,
-          pitchMultiplier, isFinalGrain);
-      lastGrainWritten = grain;
+      // only STREAMINFO matters for decoding, skip the tags, seek tables,
+      // pictures and so on
+      if (type != 0 || length < 34) {
+        m_bits.SkipBytes(length);
+        continue;
+      }
+      m_bits.ReadBits(16);  // min block size
+      m_maxBlockSize = m_bits.ReadBits(16);
+      m_bits.ReadBits(24);  // min frame size
+      m_bits.ReadBits(24);  // max frame size
+      m_sampleRate = m_bits.ReadBits(20);
+      m_numChannels = uint16(m_bits.ReadBits(3) + 1);
+      m_bitsPerSample = uint16(m_bits.ReadBits(5) + 1);
+      m_numSamples = uint64_t(m_bits.ReadBits(4)) << 32;
+      m_numSamples |= m_bits.ReadBits(32);
+      m_bits.SkipBytes(16 + length - 34);  // md5 and anything newer
+      foundStreamInfo = true;
+    }
+
+    if (!foundStreamInfo || m_bits.Overrun()) {
+      printf("[-----ERROR-----]%s is an invalid FLAC file. (1)\n", fileName);
+      return false;
+    }
+    if (m_numChannels > 2 || m_bitsPerSample < 8 || m_bitsPerSample > 24) {
+      printf(
+          "[-----ERROR-----]%s has %u channels of %u bit audio, only mono or "
+          "stereo FLAC of 8 to 24 bits is supported.\n",
+          fileName, m_numChannels, m_bitsPerSample);
+      return false;
     }
+    m_fileName = fileName;
+    return true;
   }
-}
 
-template <typename LAMBDA>
-void GranularTimePitchAdjustDynamic(const std::vector<float>& input,
-                                    std::vector<float>* output,
-                                    uint16 numChannels, uint32 sampleRate,
-                                    float grainSizeSeconds,
-                                    float crossFadeSeconds,
-                                    const LAMBDA& settingsCallback) {
-  // calculate how many grains are in the input data
-  size_t numInputSamples = input.size() / numChannels;
-  size_t grainSizeSamples =
-      static_cast<size_t>(static_cast<float>(sampleRate) * grainSizeSeconds);
-  size_t numGrains = numInputSamples / grainSizeSamples;
-  if (numInputSamples % grainSizeSamples) numGrains++;
+  uint16 NumChannels() const { return m_numChannels; }
+  uint32 SampleRate() const { return m_sampleRate; }
+  uint16 BitsPerSample() const { return m_bitsPerSample; }
+  uint16 NumBytes() const { return (m_bitsPerSample + 7) / 8; }
 
-  // calculate size of output buffer and resize it
-  size_t numOutputSamples = 0;
-  for (size_t i = 0; i < numGrains; ++i) {
-    size_t grainStart = i * grainSizeSamples;
-    size_t grainEnd = grainStart + grainSizeSamples;
-    grainEnd = std::min(grainEnd, input.size());
-    size_t grainSize = grainEnd - grainStart;
+  // wave chunks that were stored in the header, see WriteFlacFileStreaming()
+  const std::vector<SWaveChunk>& Metadata() const { return m_metadata; }
 
-    float percent = static_cast<float>(i) / static_cast<float>(numGrains);
-    float timeMultiplier = 1.0f;
-    float pitchMultiplier = 1.0f;
-    settingsCallback(percent, timeMultiplier, pitchMultiplier);
+  // samples (frames) in the stream, 0 if the encoder didn't know
+  uint64_t NumSamples() const { return m_numSamples; }
 
-    numOutputSamples +=
-        static_cast<size_t>(static_cast<float>(grainSize) * timeMultiplier);
+  // the largest frame in the stream, 0 if the encoder didn't say
+  uint32 MaxBlockSize() const { return m_maxBlockSize; }
+
+  // decodes the next frame and appends it to output as interleaved floats.
+  // Returns how many samples (frames) it had, 0 at the end of the stream or
+  // if the stream is broken, see Failed().
+  size_t DecodeFrame(std::vector<float>* output) {
+    if (m_failed) return 0;
+    if (m_numSamples && m_samplesDecoded >= m_numSamples) return 0;
+    if (m_bits.AtEnd()) return 0;
+
+    uint32 blockSize = 0;
+    uint32 bitsPerSample = 0;
+    uint32 channelAssignment = 0;
+    m_bits.StartCRC16();
+    if (!DecodeFrameHeader(&blockSize, &bitsPerSample, &channelAssignment))
+      return Fail(2);
+
+    uint16 numChannels =
+        channelAssignment < 8 ? uint16(channelAssignment + 1) : 2;
+    if (numChannels != m_numChannels || channelAssignment > 10)
+      return Fail(3);
+
+    // the side channel needs one extra bit
+    for (uint16 channel = 0; channel < numChannels; ++channel) {
+      bool side = (channelAssignment == 8 && channel == 1) ||
+                  (channelAssignment == 9 && channel == 0) ||
+                  (channelAssignment == 10 && channel == 1);
+      m_channels[channel].resize(blockSize);
+      if (!DecodeSubframe(&m_channels[channel][0], blockSize,
+                          bitsPerSample + (side ? 1 : 0)))
+        return Fail(4);
+    }
+
+    // undo the stereo decorrelation
+    int32* left = &m_channels[0][0];
+    int32* right = numChannels > 1 ? &m_channels[1][0] : nullptr;
+    switch (channelAssignment) {
+      case 8:  // left, side
+        for (uint32 i = 0; i < blockSize; ++i) right[i] = left[i] - right[i];
+        break;
+      case 9:  // side, right
+        for (uint32 i = 0; i < blockSize; ++i) left[i] += right[i];
+        break;
+      case 10:  // mid, side
+        for (uint32 i = 0; i < blockSize; ++i) {
+          int32 side = right[i];
+          int32 mid = int32(uint32(left[i]) << 1) | (side & 1);
+          left[i] = (mid + side) >> 1;
+          right[i] = (mid - side) >> 1;
+        }
+        break;
+    }
+
+    // the footer CRC, over everything from the sync code on
+    m_bits.AlignToByte();
+    uint16 expectedCRC = m_bits.CRC16();
+    if (m_bits.ReadBits(16) != expectedCRC || m_bits.Overrun()) return Fail(5);
+
+    // interleave and convert to float
+    size_t outputIndex = output->size();
+    output->resize(outputIndex + size_t(blockSize) * numChannels);
+    float* out = &(*output)[outputIndex];
+    for (uint32 i = 0; i < blockSize; ++i)
+      for (uint16 channel = 0; channel < numChannels; ++channel)
+        IntSampleToFloat(out++, m_channels[channel][i], bitsPerSample);
+
+    m_samplesDecoded += blockSize;
+    return blockSize;
   }
-  output->clear();
-  output->resize(numOutputSamples * numChannels, 0.0f);
 
-  // calculate the cross fade size
-  size_t crossFadeSizeSamples =
-      static_cast<size_t>(static_cast<float>(sampleRate) * crossFadeSeconds);
+  bool Failed() const { return m_failed; }
 
-  // Repeat each grain 0 or more times to make the output be the correct size
-  size_t outputSampleIndex = 0;
-  size_t lastGrainWritten = -1;
-  float lastGrainPitchMultiplier = 1.0f;
-  size_t outputSampleWindowEnd = 0;
-  for (size_t grain = 0; grain < numGrains; ++grain) {
-    // calculate the boundaries of the grain
-    size_t inputGrainStart = grain * grainSizeSamples;
+ private:
+  size_t Fail(int code) {
+    printf("[-----ERROR-----]%s is an invalid FLAC file. (%i)\n",
+           m_fileName.c_str(), code);
+    m_failed = true;
+    return 0;
+  }
 
-    // calculate the end of where this grain should go in the output buffer
-    float percent = static_cast<float>(grain) / static_cast<float>(numGrains);
-    float timeMultiplier = 1.0f;
-    float pitchMultiplier = 1.0f;
-    settingsCallback(percent, timeMultiplier, pitchMultiplier);
-    outputSampleWindowEnd += static_cast<size_t>(
-        static_cast<float>(grainSizeSamples) * timeMultiplier);
+  bool DecodeFrameHeader(uint32* blockSize, uint32* bitsPerSample,
+                         uint32* channelAssignment) {
+    unsigned char crc = 0;
+    auto readByte = [this, &crc]() {
+      uint32 byte = m_bits.ReadBits(8);
+      crc = FlacCRC8(crc, (unsigned char)byte);
+      return byte;
+    };
 
-    // Splat out zero or more copies of the grain to get our output to be at
-    // least as far as we want it to be.
-    // Zero copies happens when we shorten time and need to cut pieces (grains)
-    // out of the original sound
-    while (outputSampleIndex < outputSampleWindowEnd) {
-      bool isFinalGrain = (grain == numGrains - 1);
+    // sync code, reserved bit and blocking strategy
+    uint32 sync = readByte() << 8;
+    sync |= readByte();
+    if ((sync & 0xFFFE) != 0xFFF8) return false;
 
-      // if we are writing our first grain, or the last grain we wrote was the
-      // previous grain, then we don't need to do a cross fade`
-      if ((lastGrainWritten == -1) || (lastGrainWritten == grain - 1)) {
-        outputSampleIndex += SplatGrainToOutput(
-            input, output, numChannels, inputGrainStart, grainSizeSamples,
-            outputSampleIndex, ECrossFade::None, crossFadeSizeSamples,
-            pitchMultiplier, isFinalGrain);
-        lastGrainWritten = grain;
-        lastGrainPitchMultiplier = pitchMultiplier;
-        continue;
-      }
+    uint32 byte = readByte();
+    uint32 blockSizeCode = byte >> 4;
+    uint32 sampleRateCode = byte & 15;
+    byte = readByte();
+    *channelAssignment = byte >> 4;
+    uint32 sampleSizeCode = (byte >> 1) & 7;
 
-      // else we need to fade out the old grain and then fade in the new one.
-      // NOTE: fading out the old grain means starting to play the grain after
-      // the last one and bringing it's volume down to zero, using the previous
-      // grain's pitch multiplier.
-      SplatGrainToOutput(
-          input, output, numChannels, (lastGrainWritten + 1) * grainSizeSamples,
-          grainSizeSamples, outputSampleIndex, ECrossFade::Out,
-          crossFadeSizeSamples, lastGrainPitchMultiplier, isFinalGrain);
-      outputSampleIndex += SplatGrainToOutput(
-          input, output, numChannels, inputGrainStart, grainSizeSamples,
-          outputSampleIndex, ECrossFade::In, crossFadeSizeSamples,
-          pitchMultiplier, isFinalGrain);
-      lastGrainWritten = grain;
-      lastGrainPitchMultiplier = pitchMultiplier;
+    // frame or sample number, UTF-8 style. Not needed to decode in order.
+    byte = readByte();
+    uint32 extraBytes = 0;
+    if (byte & 0x80) {
+      while (extraBytes < 6 && (byte & (0x40 >> extraBytes))) ++extraBytes;
+      if (extraBytes == 0) return false;
     }
+    for (uint32 i = 0; i < extraBytes; ++i) readByte();
+
+    if (blockSizeCode == 0) return false;
+    if (blockSizeCode == 1)
+      *blockSize = 192;
+    else if (blockSizeCode <= 5)
+      *blockSize = 576 << (blockSizeCode - 2);
+    else if (blockSizeCode == 6)
+      *blockSize = readByte() + 1;
+    else if (blockSizeCode == 7) {
+      *blockSize = readByte() << 8;
+      *blockSize = (*blockSize | readByte()) + 1;
+    } else
+      *blockSize = 256 << (blockSizeCode - 8);
+
+    // the frame's sample rate has to match the stream, so just skip it
+    if (sampleRateCode == 12)
+      readByte();
+    else if (sampleRateCode == 13 || sampleRateCode == 14) {
+      readByte();
+      readByte();
+    } else if (sampleRateCode == 15)
+      return false;
+
+    static const uint32 c_sampleSizes[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+    *bitsPerSample =
+        sampleSizeCode ? c_sampleSizes[sampleSizeCode] : m_bitsPerSample;
+    if (*bitsPerSample != m_bitsPerSample) return false;
+
+    unsigned char expectedCRC = crc;
+    return readByte() == expectedCRC && !m_bits.Overrun();
   }
-}
 
-// the entry point of our application
-int main(int argc, char** argv) {
-  // load the wave file
-  uint16 numChannels;
-  uint32 sampleRate;
-  uint16 numBytes;
-  std::vector<float> source, out, sourceLeft, sourceRight;
-  ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
-               &numBytes);
+  bool DecodeSubframe(int32* samples, uint32 blockSize, uint32 bitsPerSample) {
+    m_bits.ReadBits(1);  // zero padding
+    uint32 type = m_bits.ReadBits(6);
+    uint32 wastedBits = 0;
+    if (m_bits.ReadBits(1)) wastedBits = m_bits.ReadUnary() + 1;
+    if (wastedBits >= bitsPerSample) return false;
+    bitsPerSample -= wastedBits;
 
-  // speed up the audio and increase pitch
-  {
-    TimeAdjust(source, &out, numChannels, 0.7f);
-    WriteWaveFile("data/out_A_FastHigh.wav", &out, numChannels, sampleRate,
-                  numBytes);
+    if (type == 0) {
+      // constant
+      int32 value = m_bits.ReadSignedBits(bitsPerSample);
+      std::fill(samples, samples + blockSize, value);
+    } else if (type == 1) {
+      // verbatim
+      for (uint32 i = 0; i < blockSize; ++i)
+        samples[i] = m_bits.ReadSignedBits(bitsPerSample);
+    } else if (type >= 8 && type <= 12) {
+      // fixed polynomial predictor
+      uint32 order = type - 8;
+      if (order > blockSize) return false;
+      for (uint32 i = 0; i < order; ++i)
+        samples[i] = m_bits.ReadSignedBits(bitsPerSample);
+      if (!DecodeResidual(samples, blockSize, order)) return false;
+      RestoreFixed(samples, blockSize, order);
+    } else if (type >= 32) {
+      // linear prediction
+      uint32 order = type - 31;
+      if (order > blockSize) return false;
+      for (uint32 i = 0; i < order; ++i)
+        samples[i] = m_bits.ReadSignedBits(bitsPerSample);
+      uint32 precision = m_bits.ReadBits(4) + 1;
+      int32 shift = m_bits.ReadSignedBits(5);
+      if (precision == 16 || shift < 0) return false;
+      int32 coefficients[32];
+      for (uint32 i = 0; i < order; ++i)
+        coefficients[i] = m_bits.ReadSignedBits(precision);
+      if (!DecodeResidual(samples, blockSize, order)) return false;
+      RestoreLPC(samples, blockSize, coefficients, order, shift);
+    } else {
+      return false;
+    }
 
-    TimeAdjust(source, &out, numChannels, 0.4f);
-    WriteWaveFile("data/out_A_FasterHigher.wav", &out, numChannels, sampleRate,
-                  numBytes);
+    if (wastedBits)
+      for (uint32 i = 0; i < blockSize; ++i) samples[i] <<= wastedBits;
+    return !m_bits.Overrun();
   }
 
-  // slow down the audio and decrease pitch
-  {
-    TimeAdjust(source, &out, numChannels, 1.3f);
-    WriteWaveFile("data/out_A_SlowLow.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // reads the rice coded prediction errors into samples[order...]
+  bool DecodeResidual(int32* samples, uint32 blockSize, uint32 order) {
+    uint32 method = m_bits.ReadBits(2);
+    if (method > 1) return false;
+    uint32 parameterBits = method ? 5 : 4;
+    uint32 escapeCode = method ? 31 : 15;
+
+    uint32 partitionOrder = m_bits.ReadBits(4);
+    uint32 partitionSize = blockSize >> partitionOrder;
+    if ((partitionSize << partitionOrder) != blockSize || partitionSize < order)
+      return false;
 
-    TimeAdjust(source, &out, numChannels, 2.1f);
-    WriteWaveFile("data/out_A_SlowerLower.wav", &out, numChannels, sampleRate,
-                  numBytes);
+    int32* out = samples + order;
+    for (uint32 partition = 0; partition < (1u << partitionOrder);
+         ++partition) {
+      uint32 count = partition ? partitionSize : partitionSize - order;
+      uint32 parameter = m_bits.ReadBits(parameterBits);
+      if (parameter == escapeCode) {
+        uint32 bits = m_bits.ReadBits(5);
+        for (uint32 i = 0; i < count; ++i) *out++ = m_bits.ReadSignedBits(bits);
+        continue;
+      }
+      for (uint32 i = 0; i < count; ++i) {
+        uint32 value = (m_bits.ReadUnary() << parameter);
+        value |= m_bits.ReadBits(parameter);
+        *out++ = int32(value >> 1) ^ -int32(value & 1);
+      }
+      if (m_bits.Overrun()) return false;
+    }
+    return true;
   }
 
-  // speed up audio without affecting pitch
-  {
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 0.7f, 1.0f,
-                            0.02f, 0.002f);
-    WriteWaveFile("data/out_B_Fast.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  static void RestoreFixed(int32* samples, uint32 blockSize, uint32 order) {
+    int32* s = samples;
+    switch (order) {
+      case 1:
+        for (uint32 i = 1; i < blockSize; ++i) s[i] += s[i - 1];
+        break;
+      case 2:
+        for (uint32 i = 2; i < blockSize; ++i)
+          s[i] += 2 * s[i - 1] - s[i - 2];
+        break;
+      case 3:
+        for (uint32 i = 3; i < blockSize; ++i)
+          s[i] += 3 * s[i - 1] - 3 * s[i - 2] + s[i - 3];
+        break;
+      case 4:
+        for (uint32 i = 4; i < blockSize; ++i)
+          s[i] += 4 * s[i - 1] - 6 * s[i - 2] + 4 * s[i - 3] - s[i - 4];
+        break;
+    }
+  }
 
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 0.4f, 1.0f,
-                            0.02f, 0.002f);
-    WriteWaveFile("data/out_B_Faster.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  static void RestoreLPC(int32* samples, uint32 blockSize,
+                         const int32* coefficients, uint32 order,
+                         int32 shift) {
+    for (uint32 i = order; i < blockSize; ++i) {
+      int64_t sum = 0;
+      for (uint32 j = 0; j < order; ++j)
+        sum += int64_t(coefficients[j]) * samples[i - 1 - j];
+      samples[i] += int32(sum >> shift);
+    }
   }
 
-  // slow down audio without affecting pitch
-  {
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.3f, 1.0f,
-                            0.02f, 0.002f);
-    WriteWaveFile("data/out_B_Slow.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  CFlacBitReader m_bits;
+  std::string m_fileName;
+  std::vector<SWaveChunk> m_metadata;
+  std::vector<int32> m_channels[2];
+  uint16 m_numChannels = 0;
+  uint32 m_sampleRate = 0;
+  uint16 m_bitsPerSample = 0;
+  uint32 m_maxBlockSize = 0;
+  uint64_t m_numSamples = 0;
+  uint64_t m_samplesDecoded = 0;
+  bool m_failed = false;
+};
+
+// FLAC files start with "fLaC", MP3 files with an ID3 tag or a frame sync
+inline bool IsFlacData(const unsigned char* data, size_t size) {
+  return size >= 4 && !memcmp(data, "fLaC", 4);
+}
+
+inline bool IsMP3Data(const unsigned char* data, size_t size) {
+  return size >= 3 && (!memcmp(data, "ID3", 3) ||
+                       (data[0] == 0xFF && (data[1] & 0xE0) == 0xE0));
+}
+
+// decodes a whole FLAC file that was read into memory
+bool DecodeFlacFile(const std::vector<unsigned char>& fileData,
+                    const char* fileName, std::vector<float>* data,
+                    uint16* numChannels, uint32* sampleRate, uint16* numBytes,
+                    std::vector<SWaveChunk>* metadata = nullptr) {
+  size_t position = 0;
+  CFlacDecoder decoder([&](unsigned char* dest, size_t size) {
+    size = std::min(size, fileData.size() - position);
+    memcpy(dest, &fileData[position], size);
+    position += size;
+    return size;
+  });
+  if (!decoder.ReadHeader(fileName)) return false;
 
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 2.1f, 1.0f,
-                            0.02f, 0.002f);
-    WriteWaveFile("data/out_B_Slower.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  data->clear();
+  if (decoder.NumSamples())
+    data->reserve(size_t(decoder.NumSamples()) * decoder.NumChannels());
+  while (decoder.DecodeFrame(data) > 0) {
   }
+  if (decoder.Failed()) return false;
 
-  // Make pitch higher without affecting length
-  {
-    // do it in two steps - first as a granular time adjust, and then as a
-    // pitch/time adjust
-    std::vector<float> out2;
-    GranularTimePitchAdjust(source, &out2, numChannels, sampleRate, 1.0f / 0.7f,
-                            1.0f, 0.02f, 0.002f);
-    TimeAdjust(out2, &out, numChannels, 0.7f);
-    WriteWaveFile("data/out_C_HighAlternate.wav", &out, numChannels, sampleRate,
-                  numBytes);
-
-    // do it in one step by changing grain playback speeds
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.0f,
-                            1.0f / 0.7f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_C_High.wav", &out, numChannels, sampleRate,
-                  numBytes);
-
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.0f,
-                            1.0f / 0.4f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_C_Higher.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  *numChannels = decoder.NumChannels();
+  *sampleRate = decoder.SampleRate();
+  *numBytes = decoder.NumBytes();
+  if (metadata) *metadata = decoder.Metadata();
+  return true;
+}
+
+// defined with the streaming input stages further down
+class CInputStage;
+bool DrainInputStage(CInputStage* input, const char* fileName,
+                     std::vector<float>* data, uint16* numChannels,
+                     uint32* sampleRate, uint16* numBytes);
+bool ReadInputStream(const char* fileName, std::vector<float>* data,
+                     uint16* numChannels, uint32* sampleRate,
+                     uint16* numBytes);
+
+bool ReadWaveFile(const char* fileName, std::vector<float>* data,
+                  uint16* numChannels, uint32* sampleRate, uint16* numBytes,
+                  std::vector<SWaveChunk>* metadata = nullptr) {
+  GRANULAR_TIMER(ReadWaveFile);
+
+  // stdin and pipes are decoded as they arrive, by the stages a pipeline
+  // reads its input with, rather than read in full before decoding starts.
+  // Their metadata isn't kept.
+  if (IsStreamInput(fileName)) {
+    if (metadata) metadata->clear();
+    return ReadInputStream(fileName, data, numChannels, sampleRate,
+                           numBytes);
   }
 
-  // make pitch lower without affecting length
-  {
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.0f,
-                            1.0f / 1.3f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_C_Low.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // read the whole file into memory if we can
+  std::vector<unsigned char> fileData;
+  if (!ReadFileIntoMemory(fileName, &fileData)) return false;
 
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.0f,
-                            1.0f / 2.1f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_C_Lower.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // compressed input is decoded straight into the float buffer
+  if (IsFlacData(fileData.data(), fileData.size())) {
+    if (metadata) metadata->clear();
+    if (!DecodeFlacFile(fileData, fileName, data, numChannels, sampleRate,
+                        numBytes, metadata))
+      return false;
+    printf("%s loaded.\n", fileName);
+    return true;
+  }
+  if (IsMP3Data(fileData.data(), fileData.size())) {
+    printf(
+        "[-----ERROR-----]%s is an MP3 file. MP3 input isn't supported, "
+        "convert it to wave or FLAC first.\n",
+        fileName);
+    return false;
   }
 
-  // Make pitch lower but speed higher
-  {
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.3f,
-                            1.0f / 0.7f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_D_SlowHigh.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // find all the chunks
+  std::vector<SRiffChunk> chunks;
+  if (!IndexWaveChunks(fileData, fileName, &chunks)) return false;
 
-    GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 0.7f,
-                            1.0f / 1.3f, 0.02f, 0.002f);
-    WriteWaveFile("data/out_D_FastLow.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  const SRiffChunk* chunkFmt = nullptr;
+  const SRiffChunk* chunkData = nullptr;
+  for (const SRiffChunk& chunk : chunks) {
+    if (!memcmp(chunk.m_id, "fmt ", 4))
+      chunkFmt = &chunk;
+    else if (!memcmp(chunk.m_id, "data", 4))
+      chunkData = &chunk;
+  }
+  if (!chunkFmt || !chunkData) {
+    printf("[-----ERROR-----]%s is an invalid input file. (4)\n", fileName);
+    return false;
   }
 
-  // dynamic tests which change time and pitch multipliers over time (for each
-  // input grain)
-  {
-    // adjust pitch on a sine wave
-    GranularTimePitchAdjustDynamic(
-        source, &out, numChannels, sampleRate, 0.02f, 0.002f,
-        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
-          // time is 1
-          // pitch is 10hz from 0.75 to 1.25
-          timeMultiplier = 1.0f;
-          pitchMultiplier =
-              1.0f /
-              ((std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 0.5f + 0.75f);
-        });
-    WriteWaveFile("data/out_E_Pitch.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // keep whatever else was in there, except padding and the RF64 sizes which
+  // get remade on write
+  if (metadata) {
+    metadata->clear();
+    for (const SRiffChunk& chunk : chunks) {
+      if (&chunk == chunkFmt || &chunk == chunkData ||
+          !memcmp(chunk.m_id, "ds64", 4) || !memcmp(chunk.m_id, "JUNK", 4))
+        continue;
+      SWaveChunk kept;
+      memcpy(kept.m_id, chunk.m_id, 4);
+      kept.m_data.assign(fileData.begin() + chunk.m_offset,
+                         fileData.begin() + chunk.m_offset + chunk.m_size);
+      metadata->push_back(kept);
+    }
+  }
 
-    // adjust speed on a sine wave
-    GranularTimePitchAdjustDynamic(
-        source, &out, numChannels, sampleRate, 0.02f, 0.002f,
-        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
-          // time is 13hz from 0.5 to 2.5
-          // pitch is 1
-          timeMultiplier =
-              (std::sin(percent * c_pi * 13.0f) * 0.5f + 0.5f) * 2.0f + 0.5f;
-          pitchMultiplier = 1.0f;
-        });
-    WriteWaveFile("data/out_E_Time.wav", &out, numChannels, sampleRate,
-                  numBytes);
+  // we'll use this handy struct to load in
+  SMinimalWaveFileHeader waveData;
 
-    // adjust time and speed on a sine wave
-    GranularTimePitchAdjustDynamic(
-        source, &out, numChannels, sampleRate, 0.02f, 0.002f,
-        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
-          // time is 13hz from 0.5 to 2.5
-          // pitch is 10hz from 0.75 to 1.25
-          timeMultiplier =
-              (std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 2.0f + 0.5f;
-          pitchMultiplier =
-              1.0f /
-              ((std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 0.5f + 0.75f);
+  // load the fmt part if we can
+  if (chunkFmt->m_size < 16) {
+    printf("[-----ERROR-----]%s is an invalid input file. (5)\n", fileName);
+    return false;
+  }
+  memcpy(&waveData.m_subChunk1ID, &fileData[chunkFmt->m_offset - 8], 24);
+
+  // verify a couple things about the file data
+  if (waveData.m_audioFormat != 1 ||        // only pcm data
+      waveData.m_numChannels < 1 ||         // must have a channel
+      waveData.m_numChannels > 2 ||         // must not have more than 2
+      waveData.m_bitsPerSample > 32 ||      // 32 bits per sample max
+      waveData.m_bitsPerSample % 8 != 0 ||  // must be a multiple of 8 bites
+      waveData.m_blockAlign > 8) {          // blocks must be 8 bytes or lower
+    printf("[-----ERROR-----]%s is an invalid input file. (7)\n", fileName);
+    return false;
+  }
+
+  // figure out how many samples and blocks there are total in the source data.
+  // Placeholder sizes and truncated files were already cut to what is there.
+  size_t bytesPerSample = waveData.m_blockAlign / waveData.m_numChannels;
+  size_t numSourceSamples = size_t(chunkData->m_size) /
+                            waveData.m_blockAlign * waveData.m_numChannels;
+
+  // allocate space for the source samples
+  data->resize(numSourceSamples);
+
+  // read in the source samples at whatever sample rate / number of channels it
+  // might be in
+  size_t fileIndex = chunkData->m_offset;
+  for (size_t nIndex = 0; nIndex < numSourceSamples; ++nIndex) {
+    PCMToFloat(&((*data)[nIndex]), &fileData[fileIndex], bytesPerSample);
+    fileIndex += bytesPerSample;
+  }
+
+  // return our data
+  *numChannels = waveData.m_numChannels;
+  *sampleRate = waveData.m_sampleRate;
+  *numBytes = waveData.m_bitsPerSample / 8;
+
+  printf("%s loaded.\n", fileName);
+  return true;
+}
+
+// Cubic hermite interpolation. More information available here:
+// https://blog.demofox.org/2015/08/08/cubic-hermite-interpolation/
+// t is a value that goes from 0 to 1 to interpolate in a C1 continuous way
+// across uniformly sampled data points.
+// when t is 0, this will return B. When t is 1, this will return C.
+static float CubicHermite(float A, float B, float C, float D, float t) {
+  float a = -A / 2.0f + (3.0f * B) / 2.0f - (3.0f * C) / 2.0f + D / 2.0f;
+  float b = A - (5.0f * B) / 2.0f + 2.0f * C - D / 2.0f;
+  float c = -A / 2.0f + C / 2.0f;
+  float d = B;
+
+  return a * t * t * t + b * t * t + c * t + d;
+}
+
+// how samples between input samples are worked out, from cheapest to best
+enum class EInterpolation {
+  Nearest,    // the closest sample
+  Linear,     // a straight line between the two closest samples
+  Cubic,      // cubic hermite through the four closest samples
+  Lagrange6,  // a 5th order polynomial through the six closest samples
+  Sinc,       // 16 tap Blackman windowed sinc
+  Count
+};
+
+static const char* c_interpolationNames[] = {"nearest", "linear", "cubic",
+                                             "lagrange6", "sinc"};
+
+// the most frames the block kernels work on at once
+const size_t c_interpolationBlockSize = 64;
+
+// An interpolation kernel reads c_numPoints samples around each position,
+// starting c_firstPoint samples from the one at or before it. Interpolate()
+// works out a block of frames from those points, laid out as one array per
+// point, so the compiler can vectorize across frames. t is how far each frame
+// is past its sample, 0 to 1.
+template <EInterpolation QUALITY>
+struct SInterpolationKernel;
+
+template <>
+struct SInterpolationKernel<EInterpolation::Nearest> {
+  static const int c_firstPoint = 0;
+  static const int c_numPoints = 2;
+
+  static void Interpolate(const float (*points)[c_interpolationBlockSize],
+                          const float* t, float* result, size_t numFrames) {
+    for (size_t i = 0; i < numFrames; ++i)
+      result[i] = (t[i] < 0.5f) ? points[0][i] : points[1][i];
+  }
+};
+
+template <>
+struct SInterpolationKernel<EInterpolation::Linear> {
+  static const int c_firstPoint = 0;
+  static const int c_numPoints = 2;
+
+  static void Interpolate(const float (*points)[c_interpolationBlockSize],
+                          const float* t, float* result, size_t numFrames) {
+    for (size_t i = 0; i < numFrames; ++i)
+      result[i] = points[0][i] * (1.0f - t[i]) + points[1][i] * t[i];
+  }
+};
+
+template <>
+struct SInterpolationKernel<EInterpolation::Cubic> {
+  static const int c_firstPoint = -1;
+  static const int c_numPoints = 4;
+
+  static void Interpolate(const float (*points)[c_interpolationBlockSize],
+                          const float* t, float* result, size_t numFrames) {
+    for (size_t i = 0; i < numFrames; ++i)
+      result[i] = CubicHermite(points[0][i], points[1][i], points[2][i],
+                               points[3][i], t[i]);
+  }
+};
+
+template <>
+struct SInterpolationKernel<EInterpolation::Lagrange6> {
+  static const int c_firstPoint = -2;
+  static const int c_numPoints = 6;
+
+  // the Lagrange basis polynomials for points at -2 to 3
+  static void Interpolate(const float (*points)[c_interpolationBlockSize],
+                          const float* t, float* result, size_t numFrames) {
+    for (size_t i = 0; i < numFrames; ++i) {
+      float x = t[i];
+      float xp2 = x + 2.0f, xp1 = x + 1.0f, xm1 = x - 1.0f, xm2 = x - 2.0f,
+            xm3 = x - 3.0f;
+      float p01 = xp2 * xp1, p23 = x * xm1, p45 = xm2 * xm3;
+      result[i] = points[0][i] * (xp1 * p23 * p45 * (-1.0f / 120.0f)) +
+                  points[1][i] * (xp2 * p23 * p45 * (1.0f / 24.0f)) +
+                  points[2][i] * (p01 * xm1 * p45 * (-1.0f / 12.0f)) +
+                  points[3][i] * (p01 * x * p45 * (1.0f / 12.0f)) +
+                  points[4][i] * (p01 * p23 * xm3 * (-1.0f / 24.0f)) +
+                  points[5][i] * (p01 * p23 * xm2 * (1.0f / 120.0f));
+    }
+  }
+};
+
+template <>
+struct SInterpolationKernel<EInterpolation::Sinc> {
+  static const int c_firstPoint = -7;
+  static const int c_numPoints = 16;
+  static const int c_numPhases = 256;
+
+  // the taps for c_numPhases + 1 fractions from 0 to 1, each normalized to
+  // unity gain. Fractions in between blend the two closest.
+  static const std::vector<float>& Table() {
+    static const std::vector<float> c_table = [] {
+      std::vector<float> table((c_numPhases + 1) * c_numPoints);
+      for (int phase = 0; phase <= c_numPhases; ++phase) {
+        float* taps = &table[phase * c_numPoints];
+        float sum = 0.0f;
+        for (int point = 0; point < c_numPoints; ++point) {
+          double distance = double(point + c_firstPoint) -
+                            double(phase) / double(c_numPhases);
+          double x = distance * 3.14159265358979323846;
+          double sinc = (distance == 0.0) ? 1.0 : std::sin(x) / x;
+          double u = distance / double(c_numPoints / 2);
+          double window = 0.42 + 0.5 * std::cos(3.14159265358979323846 * u) +
+                          0.08 * std::cos(2.0 * 3.14159265358979323846 * u);
+          taps[point] = float(sinc * window);
+          sum += taps[point];
+        }
+        for (int point = 0; point < c_numPoints; ++point) taps[point] /= sum;
+      }
+      return table;
+    }();
+    return c_table;
+  }
+
+  static void Interpolate(const float (*points)[c_interpolationBlockSize],
+                          const float* t, float* result, size_t numFrames) {
+    const float* table = Table().data();
+    for (size_t i = 0; i < numFrames; ++i) {
+      float phase = t[i] * float(c_numPhases);
+      int index = std::min(int(phase), c_numPhases - 1);
+      float fraction = phase - float(index);
+      const float* taps0 = &table[index * c_numPoints];
+      const float* taps1 = taps0 + c_numPoints;
+      float sum = 0.0f;
+      for (int point = 0; point < c_numPoints; ++point)
+        sum += points[point][i] *
+               (taps0[point] + (taps1[point] - taps0[point]) * fraction);
+      result[i] = sum;
+    }
+  }
+};
+
+// Source formats. Sources are decoded to floats, but can be kept as 16 bit
+// integers or half floats instead to take half the memory. They are turned
+// back into floats a block at a time by the interpolation, see
+// InterpolateBlock(). 16 bit integers hold 16 bit input exactly, so it renders
+// the same to the bit. Half floats keep 11 bits of precision at any level.
+enum class ESourceFormat {
+  Float,
+  Int16,
+  Half,
+
+  Count
+};
+
+static const char* c_sourceFormatNames[] = {"float", "int16", "half"};
+
+// IEEE 754 binary16, as stored
+struct SHalf {
+  uint16 m_bits;
+};
+
+// rounds to nearest even, like the hardware does
+inline SHalf FloatToHalf(float value) {
+  uint32 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint16 sign = uint16((bits >> 16) & 0x8000);
+  uint32 magnitude = bits & 0x7FFFFFFF;
+
+  // NaN stays NaN, and anything too big for a half is infinite
+  if (magnitude > 0x7F800000) return {uint16(sign | 0x7E00)};
+  if (magnitude >= 0x477FF000) return {uint16(sign | 0x7C00)};
+
+  // too small to be a normal half. Adding 0.5 lines the subnormal's bits up
+  // at the bottom of the float's mantissa, and the float add rounds them.
+  if (magnitude < 0x38800000) {
+    float absolute, half = 0.5f;
+    memcpy(&absolute, &magnitude, sizeof(absolute));
+    absolute += half;
+    uint32 rounded;
+    memcpy(&rounded, &absolute, sizeof(rounded));
+    return {uint16(sign | (rounded - 0x3F000000))};
+  }
+
+  // rebias the exponent and round the mantissa from 23 bits to 10
+  uint32 oddBit = (magnitude >> 13) & 1;
+  magnitude += 0xC8000FFF + oddBit;
+  return {uint16(sign | (magnitude >> 13))};
+}
+
+// scaling by 2^112 rebiases the exponent, and gets subnormals right too
+inline float HalfToFloat(SHalf half) {
+  uint32 bits = uint32(half.m_bits & 0x7FFF) << 13;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  value *= 5.192296858534828e33f;
+  if ((half.m_bits & 0x7C00) == 0x7C00) {
+    // infinity or NaN
+    bits |= 0x7F800000;
+    memcpy(&value, &bits, sizeof(value));
+  }
+  uint32 result;
+  memcpy(&result, &value, sizeof(result));
+  result |= uint32(half.m_bits & 0x8000) << 16;
+  memcpy(&value, &result, sizeof(value));
+  return value;
+}
+
+#ifdef GRANULAR_F16C
+static const bool g_hasF16C = [] {
+  __builtin_cpu_init();
+  return bool(__builtin_cpu_supports("f16c"));
+}();
+
+__attribute__((target("avx,f16c"))) void HalfToFloatF16C(const SHalf* in,
+                                                         float* out,
+                                                         size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i halves =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in[i]));
+    _mm256_storeu_ps(&out[i], _mm256_cvtph_ps(halves));
+  }
+  for (; i < count; ++i) out[i] = _cvtsh_ss(in[i].m_bits);
+}
+#endif
+
+// how each compact format turns back into floats
+template <typename SAMPLE>
+struct SSourceSample;
+
+template <>
+struct SSourceSample<int16> {
+  static int16 FromFloat(float value) {
+    float scaled = std::round(value * 32768.0f);
+    return int16(std::min(std::max(scaled, -32768.0f), 32767.0f));
+  }
+
+  static void ToFloat(const int16* in, float* out, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+      out[i] = float(in[i]) * (1.0f / 32768.0f);
+  }
+};
+
+template <>
+struct SSourceSample<SHalf> {
+  static SHalf FromFloat(float value) { return FloatToHalf(value); }
+
+  static void ToFloat(const SHalf* in, float* out, size_t count) {
+#ifdef GRANULAR_F16C
+    if (g_hasF16C) {
+      HalfToFloatF16C(in, out, count);
+      return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) out[i] = HalfToFloat(in[i]);
+  }
+};
+
+template <typename SAMPLE>
+void ConvertSource(const std::vector<float>& in, std::vector<SAMPLE>* out) {
+  out->resize(in.size());
+  for (size_t i = 0; i < in.size(); ++i)
+    (*out)[i] = SSourceSample<SAMPLE>::FromFloat(in[i]);
+}
+
+// gathers the points around a block of fractional sample positions, in the
+// format the input is stored in, and the fraction of each position. Points
+// before the start read the first sample, and points past the end the very
+// last value of the input.
+template <EInterpolation QUALITY, typename SAMPLE>
+inline void GatherBlock(const std::vector<SAMPLE>& input,
+                        const float* positions, size_t numFrames,
+                        uint16 channel, uint16 numChannels,
+                        SAMPLE (*points)[c_interpolationBlockSize],
+                        float* t) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+
+  // the loads are scattered, so this part stays scalar
+  size_t lastIndex = input.size() - 1;
+  const SAMPLE* data = input.data();
+  const size_t firstSafe = size_t(-Kernel::c_firstPoint);
+  for (size_t i = 0; i < numFrames; ++i) {
+    size_t sample = size_t(positions[i]);
+    t[i] = positions[i] - std::floor(positions[i]);
+
+    // away from the ends, no clamping is needed
+    size_t firstFrame = sample + Kernel::c_firstPoint;
+    if (sample >= firstSafe &&
+        (firstFrame + Kernel::c_numPoints - 1) * numChannels + channel <=
+            lastIndex) {
+      const SAMPLE* frame = &data[firstFrame * numChannels + channel];
+      for (int point = 0; point < Kernel::c_numPoints; ++point)
+        points[point][i] = frame[point * numChannels];
+      continue;
+    }
+
+    for (int point = 0; point < Kernel::c_numPoints; ++point) {
+      int64_t frame = int64_t(sample) + Kernel::c_firstPoint + point;
+      size_t index =
+          size_t(std::max<int64_t>(frame, 0)) * numChannels + channel;
+      points[point][i] = data[std::min(index, lastIndex)];
+    }
+  }
+}
+
+// GatherBlock() into floats. Float sources gather straight into them (this
+// overload is the more specialized, so it wins for them), the others convert
+// each point's row of the block at once.
+template <EInterpolation QUALITY>
+inline void GatherBlockFloat(const std::vector<float>& input,
+                             const float* positions, size_t numFrames,
+                             uint16 channel, uint16 numChannels,
+                             float (*points)[c_interpolationBlockSize],
+                             float* t) {
+  GatherBlock<QUALITY>(input, positions, numFrames, channel, numChannels,
+                       points, t);
+}
+
+template <EInterpolation QUALITY, typename SAMPLE>
+inline void GatherBlockFloat(const std::vector<SAMPLE>& input,
+                             const float* positions, size_t numFrames,
+                             uint16 channel, uint16 numChannels,
+                             float (*points)[c_interpolationBlockSize],
+                             float* t) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+  SAMPLE stored[Kernel::c_numPoints][c_interpolationBlockSize];
+  GatherBlock<QUALITY>(input, positions, numFrames, channel, numChannels,
+                       stored, t);
+  for (int point = 0; point < Kernel::c_numPoints; ++point)
+    SSourceSample<SAMPLE>::ToFloat(stored[point], points[point], numFrames);
+}
+
+// reads one channel of the input at a block of fractional sample positions.
+// Points before the start read the first sample, and points past the end the
+// very last value of the input.
+template <EInterpolation QUALITY, typename SAMPLE>
+inline void InterpolateBlock(const std::vector<SAMPLE>& input,
+                             const float* positions, size_t numFrames,
+                             uint16 channel, uint16 numChannels,
+                             float* result) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+  float points[Kernel::c_numPoints][c_interpolationBlockSize];
+  float t[c_interpolationBlockSize];
+  GatherBlockFloat<QUALITY>(input, positions, numFrames, channel, numChannels,
+                            points, t);
+  Kernel::Interpolate(points, t, result, numFrames);
+}
+
+// InterpolateBlock() with the quality picked at runtime, for callers that
+// don't pick it once for a whole grain
+template <typename SAMPLE>
+inline void InterpolateBlock(const std::vector<SAMPLE>& input,
+                             const float* positions, size_t numFrames,
+                             uint16 channel, uint16 numChannels, float* result,
+                             EInterpolation quality) {
+  switch (quality) {
+    case EInterpolation::Nearest:
+      InterpolateBlock<EInterpolation::Nearest>(input, positions, numFrames,
+                                                channel, numChannels, result);
+      break;
+    case EInterpolation::Linear:
+      InterpolateBlock<EInterpolation::Linear>(input, positions, numFrames,
+                                               channel, numChannels, result);
+      break;
+    case EInterpolation::Lagrange6:
+      InterpolateBlock<EInterpolation::Lagrange6>(
+          input, positions, numFrames, channel, numChannels, result);
+      break;
+    case EInterpolation::Sinc:
+      InterpolateBlock<EInterpolation::Sinc>(input, positions, numFrames,
+                                             channel, numChannels, result);
+      break;
+    default:
+      InterpolateBlock<EInterpolation::Cubic>(input, positions, numFrames,
+                                              channel, numChannels, result);
+      break;
+  }
+}
+
+// reads one channel of the input at a fractional sample position. The grain
+// and resampling loops interpolate a block of frames at a time instead.
+inline float SampleChannelFractional(
+    const std::vector<float>& input, float sampleFloat, uint16 channel,
+    uint16 numChannels, EInterpolation quality = EInterpolation::Cubic) {
+  float result;
+  InterpolateBlock(input, &sampleFloat, 1, channel, numChannels, &result,
+                   quality);
+  return result;
+}
+
+// A small pool of worker threads for splitting work into chunks. The thread
+// calling ParallelFor() works on chunks too, so a pool with no workers just
+// runs everything inline.
+class CThreadPool {
+ public:
+  // numThreads of 0 means one thread per hardware thread
+  explicit CThreadPool(size_t numThreads = 0) {
+    if (numThreads == 0)
+      numThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    for (size_t i = 1; i < numThreads; ++i)
+      m_workers.push_back(std::thread(&CThreadPool::WorkerThread, this));
+  }
+
+  ~CThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_wake.notify_all();
+    for (std::thread& worker : m_workers) worker.join();
+  }
+
+  size_t NumThreads() const { return m_workers.size() + 1; }
+
+  // calls work(begin, end) for consecutive chunks of [0, count), spread across
+  // the pool, and returns once all of them are done. Only one ParallelFor()
+  // runs on a pool at a time.
+  void ParallelFor(size_t count, size_t chunkSize,
+                   const std::function<void(size_t, size_t)>& work) {
+    if (count == 0) return;
+    chunkSize = std::max<size_t>(chunkSize, 1);
+
+    std::lock_guard<std::mutex> jobLock(m_jobMutex);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_work = &work;
+      m_count = count;
+      m_chunkSize = chunkSize;
+      m_nextChunk = 0;
+      m_busyWorkers = m_workers.size();
+      ++m_generation;
+    }
+    m_wake.notify_all();
+
+    RunChunks();
+
+    // wait for the workers to finish their last chunks
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busyWorkers == 0; });
+    m_work = nullptr;
+  }
+
+ private:
+  void RunChunks() {
+    while (true) {
+      size_t begin = m_nextChunk.fetch_add(m_chunkSize);
+      if (begin >= m_count) return;
+      (*m_work)(begin, std::min(begin + m_chunkSize, m_count));
+    }
+  }
+
+  void WorkerThread() {
+    uint64_t lastGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&] {
+          return m_quit || m_generation != lastGeneration;
         });
-    WriteWaveFile("data/out_E_TimePitch.wav", &out, numChannels, sampleRate,
-                  numBytes);
+        if (m_quit) return;
+        lastGeneration = m_generation;
+      }
+
+      RunChunks();
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_busyWorkers == 0) m_done.notify_one();
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_jobMutex;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  bool m_quit = false;
+  uint64_t m_generation = 0;
+  size_t m_busyWorkers = 0;
+
+  // the current job
+  const std::function<void(size_t, size_t)>* m_work = nullptr;
+  size_t m_count = 0;
+  size_t m_chunkSize = 1;
+  std::atomic<size_t> m_nextChunk;
+};
+
+// Resamples output samples (frames) [firstOutSample, lastOutSample). Every
+// output frame only depends on its own index, so ranges can be done in any
+// order or in parallel. The source positions are worked out once per block of
+// frames and shared by all channels, then each channel is interpolated with
+// the block kernel; NUM_CHANNELS of 0 means numChannels is only known at
+// runtime. Gives exactly what SampleChannelFractional() would.
+template <uint16 NUM_CHANNELS, EInterpolation QUALITY, typename SAMPLE>
+GRANULAR_MULTIVERSION
+void TimeAdjustRange(const std::vector<SAMPLE>& input, float* output,
+                     uint16 numChannels, size_t numSrcSamples,
+                     size_t numOutSamples, size_t firstOutSample,
+                     size_t lastOutSample) {
+  if (NUM_CHANNELS) numChannels = NUM_CHANNELS;
+
+  float positions[c_interpolationBlockSize];
+  float values[c_interpolationBlockSize];
+
+  for (size_t blockStart = firstOutSample; blockStart < lastOutSample;
+       blockStart += c_interpolationBlockSize) {
+    size_t numFrames =
+        std::min(c_interpolationBlockSize, lastOutSample - blockStart);
+    for (size_t i = 0; i < numFrames; ++i) {
+      float percent = static_cast<float>(blockStart + i) /
+                      static_cast<float>(numOutSamples - 1);
+      positions[i] = static_cast<float>(numSrcSamples) * percent;
+    }
+
+    float* outFrames = &output[blockStart * numChannels];
+    for (uint16 channel = 0; channel < numChannels; ++channel) {
+      InterpolateBlock<QUALITY>(input, positions, numFrames, channel,
+                                numChannels, values);
+      for (size_t i = 0; i < numFrames; ++i)
+        outFrames[i * numChannels + channel] = values[i];
+    }
+  }
+}
+
+template <EInterpolation QUALITY, typename SAMPLE>
+void TimeAdjustRangeChannels(const std::vector<SAMPLE>& input, float* output,
+                             uint16 numChannels, size_t numSrcSamples,
+                             size_t numOutSamples, size_t firstOutSample,
+                             size_t lastOutSample) {
+  switch (numChannels) {
+    case 1:
+      TimeAdjustRange<1, QUALITY>(input, output, numChannels, numSrcSamples,
+                                  numOutSamples, firstOutSample,
+                                  lastOutSample);
+      break;
+    case 2:
+      TimeAdjustRange<2, QUALITY>(input, output, numChannels, numSrcSamples,
+                                  numOutSamples, firstOutSample,
+                                  lastOutSample);
+      break;
+    default:
+      TimeAdjustRange<0, QUALITY>(input, output, numChannels, numSrcSamples,
+                                  numOutSamples, firstOutSample,
+                                  lastOutSample);
+      break;
+  }
+}
+
+template <typename SAMPLE>
+void TimeAdjustRangeDispatch(const std::vector<SAMPLE>& input, float* output,
+                             uint16 numChannels, size_t numSrcSamples,
+                             size_t numOutSamples, size_t firstOutSample,
+                             size_t lastOutSample, EInterpolation quality) {
+  switch (quality) {
+    case EInterpolation::Nearest:
+      TimeAdjustRangeChannels<EInterpolation::Nearest>(
+          input, output, numChannels, numSrcSamples, numOutSamples,
+          firstOutSample, lastOutSample);
+      break;
+    case EInterpolation::Linear:
+      TimeAdjustRangeChannels<EInterpolation::Linear>(
+          input, output, numChannels, numSrcSamples, numOutSamples,
+          firstOutSample, lastOutSample);
+      break;
+    case EInterpolation::Lagrange6:
+      TimeAdjustRangeChannels<EInterpolation::Lagrange6>(
+          input, output, numChannels, numSrcSamples, numOutSamples,
+          firstOutSample, lastOutSample);
+      break;
+    case EInterpolation::Sinc:
+      TimeAdjustRangeChannels<EInterpolation::Sinc>(
+          input, output, numChannels, numSrcSamples, numOutSamples,
+          firstOutSample, lastOutSample);
+      break;
+    default:
+      TimeAdjustRangeChannels<EInterpolation::Cubic>(
+          input, output, numChannels, numSrcSamples, numOutSamples,
+          firstOutSample, lastOutSample);
+      break;
+  }
+}
+
+// Resample
+template <typename SAMPLE>
+void TimeAdjust(const std::vector<SAMPLE>& input, std::vector<float>* output,
+                uint16 numChannels, float timeMultiplier,
+                CThreadPool* threadPool = nullptr,
+                EInterpolation quality = EInterpolation::Cubic) {
+  GRANULAR_TIMER(TimeAdjust);
+
+  size_t numSrcSamples = input.size() / numChannels;
+  size_t numOutSamples =
+      (size_t)(static_cast<float>(numSrcSamples) * timeMultiplier);
+  output->resize(numOutSamples * numChannels);
+  GRANULAR_COUNT(FramesInterpolated, numOutSamples);
+  if (numOutSamples == 0) return;
+
+  float* outputData = &(*output)[0];
+  if (!threadPool) {
+    TimeAdjustRangeDispatch(input, outputData, numChannels, numSrcSamples,
+                            numOutSamples, 0, numOutSamples, quality);
+    return;
+  }
+
+  // split the output up into chunks of about 32KB, small enough to stay in
+  // cache while being written
+  size_t chunkSamples = std::max<size_t>(1, 8192 / numChannels);
+  threadPool->ParallelFor(
+      numOutSamples, chunkSamples, [&](size_t begin, size_t end) {
+        TimeAdjustRangeDispatch(input, outputData, numChannels, numSrcSamples,
+                                numOutSamples, begin, end, quality);
+      });
+}
+
+// SplatGrainToBuffer() for one interpolation quality
+template <EInterpolation QUALITY, typename SAMPLE>
+GRANULAR_MULTIVERSION
+size_t SplatGrainToBufferQuality(const std::vector<SAMPLE>& input,
+                                 float* output,
+                                 size_t numOutputSamples, uint16 numChannels,
+                                 size_t grainStart, size_t grainSize,
+                                 ECrossFade crossFade, size_t crossFadeSize,
+                                 float pitchMultiplier) {
+  // The grain is done a block of frames at a time. Where each frame reads from
+  // and its envelope are worked out first, stepping through the grain exactly
+  // as a frame at a time would, then every channel is interpolated for the
+  // whole block at once.
+  float positions[c_interpolationBlockSize];
+  float envelopes[c_interpolationBlockSize];
+  float values[c_interpolationBlockSize];
+
+  size_t numSamplesWritten = 0;
+  float sample = 0;
+  bool done = false;
+  while (!done) {
+    size_t numFrames = 0;
+    for (; numFrames < c_interpolationBlockSize; sample += pitchMultiplier) {
+      if (sample >= static_cast<float>(grainSize)) {
+        done = true;
+        break;
+      }
+
+      // stop if we are out of bounds on the input or output
+      if (numSamplesWritten + numFrames >= numOutputSamples) {
+        done = true;
+        break;
+      }
+      float inputIndexSamples = static_cast<float>(grainStart) + sample;
+      if (size_t(inputIndexSamples) * numChannels + numChannels >
+          input.size()) {
+        done = true;
+        break;
+      }
+
+      // calculate envelope for this sample
+      float envelope = 1.0f;
+      if (crossFade != ECrossFade::None) {
+        if (sample <= static_cast<float>(crossFadeSize))
+          envelope = sample / static_cast<float>(crossFadeSize);
+        if (crossFade == ECrossFade::Out) envelope = 1.0f - envelope;
+      }
+
+      positions[numFrames] = inputIndexSamples;
+      envelopes[numFrames] = envelope;
+      ++numFrames;
+    }
+
+    // write the enveloped samples
+    float* outputFrames = &output[numSamplesWritten * numChannels];
+    for (uint16 channel = 0; channel < numChannels; ++channel) {
+      InterpolateBlock<QUALITY>(input, positions, numFrames, channel,
+                                numChannels, values);
+      for (size_t i = 0; i < numFrames; ++i)
+        outputFrames[i * numChannels + channel] += values[i] * envelopes[i];
+    }
+    numSamplesWritten += numFrames;
+  }
+  return numSamplesWritten;
+}
+
+// writes a grain to the output buffer, applying a fade in or fade out at the
+// beginning if it should, as well as a pitch multiplier (playback speed
+// multiplier) for the grain.
+// output points at where the grain starts, with room for numOutputSamples
+// samples (frames) after it. The interpolation quality is picked here, once
+// for the whole grain.
+template <typename SAMPLE>
+size_t SplatGrainToBuffer(const std::vector<SAMPLE>& input, float* output,
+                          size_t numOutputSamples, uint16 numChannels,
+                          size_t grainStart, size_t grainSize,
+                          ECrossFade crossFade, size_t crossFadeSize,
+                          float pitchMultiplier, bool isFinalGrain,
+                          EInterpolation quality = EInterpolation::Cubic) {
+  GRANULAR_TIMER(SplatGrainToOutput);
+
+  size_t numSamplesWritten = 0;
+  switch (quality) {
+    case EInterpolation::Nearest:
+      numSamplesWritten = SplatGrainToBufferQuality<EInterpolation::Nearest>(
+          input, output, numOutputSamples, numChannels, grainStart, grainSize,
+          crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    case EInterpolation::Linear:
+      numSamplesWritten = SplatGrainToBufferQuality<EInterpolation::Linear>(
+          input, output, numOutputSamples, numChannels, grainStart, grainSize,
+          crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    case EInterpolation::Lagrange6:
+      numSamplesWritten =
+          SplatGrainToBufferQuality<EInterpolation::Lagrange6>(
+              input, output, numOutputSamples, numChannels, grainStart,
+              grainSize, crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    case EInterpolation::Sinc:
+      numSamplesWritten = SplatGrainToBufferQuality<EInterpolation::Sinc>(
+          input, output, numOutputSamples, numChannels, grainStart, grainSize,
+          crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    default:
+      numSamplesWritten = SplatGrainToBufferQuality<EInterpolation::Cubic>(
+          input, output, numOutputSamples, numChannels, grainStart, grainSize,
+          crossFade, crossFadeSize, pitchMultiplier);
+      break;
+  }
+  GRANULAR_COUNT(FramesInterpolated, numSamplesWritten);
+
+  // report an error if ever the cross fade size was bigger than the actual
+  // grain size, since this causes popping and would be hard to find the cause
+  // of.
+  // suppress error on final grain since there can be false positives due to
+  // sound ending. That makes false negatives but calling this good enough.
+  if (!isFinalGrain && crossFadeSize > numSamplesWritten) {
+    static bool reportedError = false;
+    if (!reportedError) {
+      printf(
+          "[-----ERROR-----] cross fade is longer than a grain size! (error "
+          "only reported once)\n");
+      reportedError = true;
+    }
+  }
+
+  // return how many samples we wrote
+  return numSamplesWritten;
+}
+
+// writes a grain to the output buffer at outputSampleIndex, see
+// SplatGrainToBuffer()
+template <typename SAMPLE>
+size_t SplatGrainToOutput(const std::vector<SAMPLE>& input,
+                          std::vector<float>* output, uint16 numChannels,
+                          size_t grainStart, size_t grainSize,
+                          size_t outputSampleIndex, ECrossFade crossFade,
+                          size_t crossFadeSize, float pitchMultiplier,
+                          bool isFinalGrain,
+                          EInterpolation quality = EInterpolation::Cubic) {
+  size_t numOutputSamples = output->size() / numChannels;
+  size_t available = (outputSampleIndex < numOutputSamples)
+                         ? numOutputSamples - outputSampleIndex
+                         : 0;
+  float* outputData =
+      output->data() + (available ? outputSampleIndex * numChannels : 0);
+  return SplatGrainToBuffer(input, outputData, available, numChannels,
+                            grainStart, grainSize, crossFade, crossFadeSize,
+                            pitchMultiplier, isFinalGrain, quality);
+}
+
+// GatherBlock() for a ring buffer of ringMask + 1 samples (frames), a power of
+// two. Positions keep counting up past the end of the ring and are split into
+// the sample at or before each one and the fraction past it. Indices wrap, so
+// the points can straddle the end.
+template <EInterpolation QUALITY>
+inline void GatherBlockRing(const std::vector<float>& ring, size_t ringMask,
+                            const uint64_t* samples, size_t numFrames,
+                            uint16 channel, uint16 numChannels,
+                            float (*points)[c_interpolationBlockSize]) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+  const float* data = ring.data();
+  for (size_t i = 0; i < numFrames; ++i) {
+    uint64_t first = samples[i] + uint64_t(int64_t(Kernel::c_firstPoint));
+    for (int point = 0; point < Kernel::c_numPoints; ++point)
+      points[point][i] =
+          data[size_t((first + point) & ringMask) * numChannels + channel];
   }
+}
+
+// SplatGrainToBufferQuality() reading from a ring buffer, see
+// GatherBlockRing(). The ring has no end, so only the output limits how much
+// of the grain is written.
+template <EInterpolation QUALITY>
+GRANULAR_MULTIVERSION
+size_t SplatGrainToBufferRingQuality(const std::vector<float>& ring,
+                                     size_t ringMask, float* output,
+                                     size_t numOutputSamples,
+                                     uint16 numChannels, uint64_t grainStart,
+                                     size_t grainSize, ECrossFade crossFade,
+                                     size_t crossFadeSize,
+                                     float pitchMultiplier) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+  uint64_t samples[c_interpolationBlockSize];
+  float t[c_interpolationBlockSize];
+  float envelopes[c_interpolationBlockSize];
+  float points[Kernel::c_numPoints][c_interpolationBlockSize];
+  float values[c_interpolationBlockSize];
+
+  size_t numSamplesWritten = 0;
+  float sample = 0;
+  bool done = false;
+  while (!done) {
+    size_t numFrames = 0;
+    for (; numFrames < c_interpolationBlockSize; sample += pitchMultiplier) {
+      if (sample >= static_cast<float>(grainSize) ||
+          numSamplesWritten + numFrames >= numOutputSamples) {
+        done = true;
+        break;
+      }
+
+      float envelope = 1.0f;
+      if (crossFade != ECrossFade::None) {
+        if (sample <= static_cast<float>(crossFadeSize))
+          envelope = sample / static_cast<float>(crossFadeSize);
+        if (crossFade == ECrossFade::Out) envelope = 1.0f - envelope;
+      }
+
+      samples[numFrames] = grainStart + uint64_t(sample);
+      t[numFrames] = sample - std::floor(sample);
+      envelopes[numFrames] = envelope;
+      ++numFrames;
+    }
+
+    float* outputFrames = &output[numSamplesWritten * numChannels];
+    for (uint16 channel = 0; channel < numChannels; ++channel) {
+      GatherBlockRing<QUALITY>(ring, ringMask, samples, numFrames, channel,
+                               numChannels, points);
+      Kernel::Interpolate(points, t, values, numFrames);
+      for (size_t i = 0; i < numFrames; ++i)
+        outputFrames[i * numChannels + channel] += values[i] * envelopes[i];
+    }
+    numSamplesWritten += numFrames;
+  }
+  return numSamplesWritten;
+}
+
+// SplatGrainToBuffer() reading from a ring buffer, with the interpolation
+// quality picked once for the whole grain
+inline size_t SplatGrainToBufferRing(
+    const std::vector<float>& ring, size_t ringMask, float* output,
+    size_t numOutputSamples, uint16 numChannels, uint64_t grainStart,
+    size_t grainSize, ECrossFade crossFade, size_t crossFadeSize,
+    float pitchMultiplier, EInterpolation quality = EInterpolation::Cubic) {
+  GRANULAR_TIMER(SplatGrainToOutput);
+
+  size_t numSamplesWritten = 0;
+  switch (quality) {
+    case EInterpolation::Nearest:
+      numSamplesWritten = SplatGrainToBufferRingQuality<
+          EInterpolation::Nearest>(ring, ringMask, output, numOutputSamples,
+                                   numChannels, grainStart, grainSize,
+                                   crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    case EInterpolation::Linear:
+      numSamplesWritten = SplatGrainToBufferRingQuality<
+          EInterpolation::Linear>(ring, ringMask, output, numOutputSamples,
+                                  numChannels, grainStart, grainSize,
+                                  crossFade, crossFadeSize, pitchMultiplier);
+      break;
+    case EInterpolation::Lagrange6:
+      numSamplesWritten = SplatGrainToBufferRingQuality<
+          EInterpolation::Lagrange6>(ring, ringMask, output, numOutputSamples,
+                                     numChannels, grainStart, grainSize,
+                                     crossFade, crossFadeSize,
+                                     pitchMultiplier);
+      break;
+    case EInterpolation::Sinc:
+      numSamplesWritten = SplatGrainToBufferRingQuality<
+          EInterpolation::Sinc>(ring, ringMask, output, numOutputSamples,
+                                numChannels, grainStart, grainSize, crossFade,
+                                crossFadeSize, pitchMultiplier);
+      break;
+    default:
+      numSamplesWritten = SplatGrainToBufferRingQuality<
+          EInterpolation::Cubic>(ring, ringMask, output, numOutputSamples,
+                                 numChannels, grainStart, grainSize,
+                                 crossFade, crossFadeSize, pitchMultiplier);
+      break;
+  }
+  GRANULAR_COUNT(FramesInterpolated, numSamplesWritten);
+  return numSamplesWritten;
+}
+
+// A render plan is the list of grain splats a granular time/pitch adjust
+// makes, worked out up front without touching any samples. Planning decides
+// which grains get repeated or skipped and where cross fades go; executing
+// the plan does the sample work. Plans only depend on the input length and
+// the settings, so one plan can be reused for every output rendered from the
+// same input and settings, handed to other threads or processes, and rendered
+// in pieces.
+struct SGrainSplat {
+  uint64_t m_inputStart;   // in samples (frames)
+  uint64_t m_outputStart;  // in samples (frames)
+  float m_pitchMultiplier;
+  ECrossFade m_crossFade;
+  bool m_isFinalGrain;
+};
+
+struct SRenderPlan {
+  uint16 m_numChannels = 0;
+  uint64_t m_numInputSamples = 0;
+  uint64_t m_numOutputSamples = 0;
+  uint64_t m_grainSizeSamples = 0;
+  uint64_t m_crossFadeSizeSamples = 0;
+  std::vector<SGrainSplat> m_splats;
+
+  size_t MemoryBytes() const {
+    return sizeof(SRenderPlan) + m_splats.capacity() * sizeof(SGrainSplat);
+  }
+};
+
+// how many samples SplatGrainToOutput() will write for a grain, without doing
+// any of the work. This has to mirror the loop there exactly, including the
+// float accumulation of the sample position, so plans match the real thing.
+size_t GrainSamplesWritten(size_t inputSize, size_t outputSize,
+                           uint16 numChannels, size_t grainStart,
+                           size_t grainSize, size_t outputSampleIndex,
+                           float pitchMultiplier) {
+  size_t outputIndex = outputSampleIndex * numChannels;
+  size_t numSamplesWritten = 0;
+  for (float sample = 0; sample < static_cast<float>(grainSize);
+       sample += pitchMultiplier) {
+    if (outputIndex + numChannels > outputSize) break;
+
+    float inputIndexSamples = static_cast<float>(grainStart) + sample;
+    if (size_t(inputIndexSamples) * numChannels + numChannels > inputSize)
+      break;
+
+    outputIndex += numChannels;
+    ++numSamplesWritten;
+  }
+  return numSamplesWritten;
+}
+
+// Walks the grains of the input, adding splats to the plan until the output
+// reaches outputSampleWindowEnd. Shared by the static and dynamic planners.
+struct SGrainPlanner {
+  SRenderPlan* m_plan;
+  size_t m_outputSampleIndex = 0;
+  size_t m_lastGrainWritten = -1;
+  float m_lastGrainPitchMultiplier = 1.0f;
+
+  void AddSplat(size_t grain, ECrossFade crossFade, float pitchMultiplier,
+                bool isFinalGrain) {
+    SGrainSplat splat;
+    splat.m_inputStart = grain * m_plan->m_grainSizeSamples;
+    splat.m_outputStart = m_outputSampleIndex;
+    splat.m_pitchMultiplier = pitchMultiplier;
+    splat.m_crossFade = crossFade;
+    splat.m_isFinalGrain = isFinalGrain;
+    m_plan->m_splats.push_back(splat);
+  }
+
+  size_t SamplesWritten(size_t grain, float pitchMultiplier) const {
+    return GrainSamplesWritten(
+        m_plan->m_numInputSamples * m_plan->m_numChannels,
+        m_plan->m_numOutputSamples * m_plan->m_numChannels,
+        m_plan->m_numChannels, grain * m_plan->m_grainSizeSamples,
+        m_plan->m_grainSizeSamples, m_outputSampleIndex, pitchMultiplier);
+  }
+
+  void PlanGrain(size_t grain, size_t numGrains, size_t outputSampleWindowEnd,
+                 float pitchMultiplier) {
+    // Splat out zero or more copies of the grain to get our output to be at
+    // least as far as we want it to be.
+    // Zero copies happens when we shorten time and need to cut pieces (grains)
+    // out of the original sound. The window of the last grains can end past
+    // the output when the input isn't a whole number of grains long, so stop
+    // once the output is full too.
+    while (m_outputSampleIndex < outputSampleWindowEnd &&
+           m_outputSampleIndex < size_t(m_plan->m_numOutputSamples)) {
+      bool isFinalGrain = (grain == numGrains - 1);
+
+      // if we are writing our first grain, or the last grain we wrote was the
+      // previous grain, then we don't need to do a cross fade
+      if ((m_lastGrainWritten == size_t(-1)) ||
+          (m_lastGrainWritten == grain - 1)) {
+        AddSplat(grain, ECrossFade::None, pitchMultiplier, isFinalGrain);
+        m_outputSampleIndex += SamplesWritten(grain, pitchMultiplier);
+        m_lastGrainWritten = grain;
+        m_lastGrainPitchMultiplier = pitchMultiplier;
+        continue;
+      }
+
+      // else we need to fade out the old grain and then fade in the new one.
+      // NOTE: fading out the old grain means starting to play the grain after
+      // the last one and bringing it's volume down to zero, using the previous
+      // grain's pitch multiplier.
+      AddSplat(m_lastGrainWritten + 1, ECrossFade::Out,
+               m_lastGrainPitchMultiplier, isFinalGrain);
+      AddSplat(grain, ECrossFade::In, pitchMultiplier, isFinalGrain);
+      m_outputSampleIndex += SamplesWritten(grain, pitchMultiplier);
+      m_lastGrainWritten = grain;
+      m_lastGrainPitchMultiplier = pitchMultiplier;
+    }
+  }
+};
+
+void PlanGranularTimePitchAdjust(size_t numInputSamples, uint16 numChannels,
+                                 uint32 sampleRate, float timeMultiplier,
+                                 float pitchMultiplier, float grainSizeSeconds,
+                                 float crossFadeSeconds, SRenderPlan* plan) {
+  GRANULAR_TIMER(PlanGrains);
+
+  // calculate size of output buffer
+  plan->m_numChannels = numChannels;
+  plan->m_numInputSamples = numInputSamples;
+  plan->m_numOutputSamples =
+      (size_t)(static_cast<float>(numInputSamples) * timeMultiplier);
+  plan->m_splats.clear();
+
+  // calculate how many grains are in the input data
+  size_t grainSizeSamples =
+      size_t(static_cast<float>(sampleRate) * grainSizeSeconds);
+  size_t numGrains = numInputSamples / grainSizeSamples;
+  if (numInputSamples % grainSizeSamples) numGrains++;
+  plan->m_grainSizeSamples = grainSizeSamples;
+
+  // calculate the cross fade size
+  plan->m_crossFadeSizeSamples =
+      size_t(static_cast<float>(sampleRate) * crossFadeSeconds);
+
+  // Repeat each grain 0 or more times to make the output be the correct size
+  SGrainPlanner planner;
+  planner.m_plan = plan;
+  for (size_t grain = 0; grain < numGrains; ++grain) {
+    // calculate the boundaries of the grain
+    size_t inputGrainStart = grain * grainSizeSamples;
+
+    // calculate the end of where this grain should go in the output buffer
+    size_t outputSampleWindowEnd = static_cast<size_t>(
+        static_cast<float>(inputGrainStart + grainSizeSamples) *
+        timeMultiplier);
+
+    planner.PlanGrain(grain, numGrains, outputSampleWindowEnd,
+                      pitchMultiplier);
+  }
+}
+
+// Turns values into their running totals. Big arrays are summed a chunk per
+// thread: each chunk's own running totals first, then each chunk again, adding
+// the total of the chunks before it.
+void PrefixSum(std::vector<size_t>* values, CThreadPool* threadPool) {
+  const size_t c_minParallelValues = 1 << 16;
+  size_t count = values->size();
+  size_t* data = values->data();
+  if (!threadPool || threadPool->NumThreads() == 1 ||
+      count < c_minParallelValues) {
+    for (size_t i = 1; i < count; ++i) data[i] += data[i - 1];
+    return;
+  }
+
+  size_t numChunks = threadPool->NumThreads();
+  size_t chunkSize = (count + numChunks - 1) / numChunks;
+  std::vector<size_t> chunkOffsets(numChunks, 0);
+  threadPool->ParallelFor(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      size_t last = std::min(count, (chunk + 1) * chunkSize);
+      size_t total = 0;
+      for (size_t i = chunk * chunkSize; i < last; ++i) {
+        total += data[i];
+        data[i] = total;
+      }
+      chunkOffsets[chunk] = total;
+    }
+  });
+
+  size_t offset = 0;
+  for (size_t& chunkOffset : chunkOffsets) {
+    size_t total = chunkOffset;
+    chunkOffset = offset;
+    offset += total;
+  }
+
+  threadPool->ParallelFor(numChunks, 1, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      size_t last = std::min(count, (chunk + 1) * chunkSize);
+      for (size_t i = chunk * chunkSize; i < last; ++i)
+        data[i] += chunkOffsets[chunk];
+    }
+  });
+}
+
+// The settings of every grain are asked for up front, once each, and where
+// each grain's output window ends is the running total of the window sizes,
+// summed on threadPool if there is one. Placing the splats is still one grain
+// after another, since each depends on where the one before it ended.
+template <typename LAMBDA>
+void PlanGranularTimePitchAdjustDynamic(size_t numInputSamples,
+                                        uint16 numChannels, uint32 sampleRate,
+                                        float grainSizeSeconds,
+                                        float crossFadeSeconds,
+                                        const LAMBDA& settingsCallback,
+                                        SRenderPlan* plan,
+                                        CThreadPool* threadPool = nullptr) {
+  GRANULAR_TIMER(PlanGrains);
+
+  // calculate how many grains are in the input data
+  size_t grainSizeSamples =
+      static_cast<size_t>(static_cast<float>(sampleRate) * grainSizeSeconds);
+  size_t numGrains = numInputSamples / grainSizeSamples;
+  if (numInputSamples % grainSizeSamples) numGrains++;
+
+  // get the settings of every grain, and the size of its output window
+  std::vector<float> pitchMultipliers(numGrains);
+  std::vector<size_t> outputSampleWindowEnds(numGrains);
+  size_t numOutputSamples = 0;
+  for (size_t i = 0; i < numGrains; ++i) {
+    size_t grainStart = i * grainSizeSamples;
+    size_t grainEnd = grainStart + grainSizeSamples;
+    grainEnd = std::min(grainEnd, numInputSamples * numChannels);
+    size_t grainSize = grainEnd - grainStart;
+
+    float percent = static_cast<float>(i) / static_cast<float>(numGrains);
+    float timeMultiplier = 1.0f;
+    float pitchMultiplier = 1.0f;
+    settingsCallback(percent, timeMultiplier, pitchMultiplier);
+    pitchMultipliers[i] = pitchMultiplier;
+
+    // calculate size of output buffer
+    numOutputSamples +=
+        static_cast<size_t>(static_cast<float>(grainSize) * timeMultiplier);
+    outputSampleWindowEnds[i] = static_cast<size_t>(
+        static_cast<float>(grainSizeSamples) * timeMultiplier);
+  }
+
+  // calculate the end of where each grain should go in the output buffer
+  PrefixSum(&outputSampleWindowEnds, threadPool);
+
+  plan->m_numChannels = numChannels;
+  plan->m_numInputSamples = numInputSamples;
+  plan->m_numOutputSamples = numOutputSamples;
+  plan->m_grainSizeSamples = grainSizeSamples;
+  plan->m_splats.clear();
+
+  // calculate the cross fade size
+  plan->m_crossFadeSizeSamples =
+      static_cast<size_t>(static_cast<float>(sampleRate) * crossFadeSeconds);
+
+  // Repeat each grain 0 or more times to make the output be the correct size
+  SGrainPlanner planner;
+  planner.m_plan = plan;
+  for (size_t grain = 0; grain < numGrains; ++grain) {
+    planner.PlanGrain(grain, numGrains, outputSampleWindowEnds[grain],
+                      pitchMultipliers[grain]);
+  }
+}
+
+// Counts the grains of a plan as it gets rendered, rather than when it's
+// planned, since a cached plan is rendered many times. Every splat but the
+// half of a cross fade fading out renders a grain, a repeat if it's the
+// grain rendered before it, and the grains it jumps over were cut out of the
+// sound.
+void CountPlanGrains(const SRenderPlan& plan) {
+#if GRANULAR_INSTRUMENT
+  size_t grainSize = size_t(plan.m_grainSizeSamples);
+  if (grainSize == 0) return;
+  size_t numGrains =
+      (size_t(plan.m_numInputSamples) + grainSize - 1) / grainSize;
+  size_t lastGrain = size_t(-1);
+  size_t numRendered = 0, numRepeated = 0, numSkipped = 0;
+  size_t numCrossFades = 0;
+  for (const SGrainSplat& splat : plan.m_splats) {
+    if (splat.m_crossFade == ECrossFade::Out) {
+      ++numCrossFades;
+      continue;
+    }
+    size_t grain = size_t(splat.m_inputStart) / grainSize;
+    ++numRendered;
+    if (grain == lastGrain)
+      ++numRepeated;
+    else
+      numSkipped += grain - (lastGrain + 1);
+    lastGrain = grain;
+  }
+  numSkipped += numGrains - (lastGrain + 1);
+
+  GRANULAR_COUNT(GrainsRendered, numRendered);
+  GRANULAR_COUNT(GrainsRepeated, numRepeated);
+  GRANULAR_COUNT(GrainsSkipped, numSkipped);
+  GRANULAR_COUNT(CrossFades, numCrossFades);
+#endif
+}
+
+// renders splats [firstSplat, lastSplat) of a plan into an output buffer that
+// is already sized for the plan. Splats that write to different parts of the
+// output can be rendered concurrently.
+template <typename SAMPLE>
+void ExecuteRenderPlanRange(const std::vector<SAMPLE>& input,
+                            const SRenderPlan& plan, size_t firstSplat,
+                            size_t lastSplat, std::vector<float>* output,
+                            EInterpolation quality = EInterpolation::Cubic) {
+  for (size_t i = firstSplat; i < lastSplat; ++i) {
+    const SGrainSplat& splat = plan.m_splats[i];
+
+    // the two halves of a cross fade show up as one scope in traces
+    GRANULAR_TRACE(splat.m_crossFade == ECrossFade::Out ? "CrossFade"
+                                                        : nullptr);
+    SplatGrainToOutput(input, output, plan.m_numChannels,
+                       size_t(splat.m_inputStart), size_t(plan.m_grainSizeSamples),
+                       size_t(splat.m_outputStart), splat.m_crossFade,
+                       size_t(plan.m_crossFadeSizeSamples),
+                       splat.m_pitchMultiplier, splat.m_isFinalGrain, quality);
+    if (splat.m_crossFade == ECrossFade::Out && i + 1 < lastSplat) {
+      ++i;
+      const SGrainSplat& fadeIn = plan.m_splats[i];
+      SplatGrainToOutput(
+          input, output, plan.m_numChannels, size_t(fadeIn.m_inputStart),
+          size_t(plan.m_grainSizeSamples), size_t(fadeIn.m_outputStart),
+          fadeIn.m_crossFade, size_t(plan.m_crossFadeSizeSamples),
+          fadeIn.m_pitchMultiplier, fadeIn.m_isFinalGrain, quality);
+    }
+  }
+}
+
+// where splat i of a plan stops writing to the output. The planner starts
+// every splat where the grain before it, or the grain fading in, stopped, so
+// that's the start of the next one. Only the grain fading out writes a
+// length of its own.
+size_t SplatOutputEnd(const SRenderPlan& plan, size_t i) {
+  const SGrainSplat& splat = plan.m_splats[i];
+  if (splat.m_crossFade == ECrossFade::Out) {
+    return size_t(splat.m_outputStart) +
+           GrainSamplesWritten(
+               size_t(plan.m_numInputSamples) * plan.m_numChannels,
+               size_t(plan.m_numOutputSamples) * plan.m_numChannels,
+               plan.m_numChannels, size_t(splat.m_inputStart),
+               size_t(plan.m_grainSizeSamples), size_t(splat.m_outputStart),
+               splat.m_pitchMultiplier);
+  }
+  return i + 1 < plan.m_splats.size()
+             ? size_t(plan.m_splats[i + 1].m_outputStart)
+             : size_t(plan.m_numOutputSamples);
+}
+
+// Splits a plan's splats into up to numRanges ranges of about the same output
+// length, given as the first splat of each range plus the end. A range only
+// starts at a splat that none of the splats before it write past, so ranges
+// write to separate parts of the output. Rendered concurrently, they add up
+// every sample in the same order as rendering the whole plan in one go, and
+// both halves of a cross fade always land in the same range.
+void SplitRenderPlan(const SRenderPlan& plan, size_t numRanges,
+                     std::vector<size_t>* rangeStarts) {
+  rangeStarts->assign(1, 0);
+  size_t outputPerRange =
+      size_t(plan.m_numOutputSamples) / std::max<size_t>(numRanges, 1) + 1;
+  size_t nextRangeStart = outputPerRange;
+  size_t writtenEnd = 0;
+  for (size_t i = 0; i < plan.m_splats.size(); ++i) {
+    size_t outputStart = size_t(plan.m_splats[i].m_outputStart);
+    if (i > 0 && outputStart >= nextRangeStart && writtenEnd <= outputStart) {
+      rangeStarts->push_back(i);
+      nextRangeStart = outputStart + outputPerRange;
+    }
+    writtenEnd = std::max(writtenEnd, SplatOutputEnd(plan, i));
+  }
+  rangeStarts->push_back(plan.m_splats.size());
+}
+
+// With a thread pool, the plan is split with SplitRenderPlan() and the ranges
+// rendered concurrently, with exactly the same result.
+template <typename SAMPLE>
+void ExecuteRenderPlan(const std::vector<SAMPLE>& input,
+                       const SRenderPlan& plan, std::vector<float>* output,
+                       EInterpolation quality = EInterpolation::Cubic,
+                       CThreadPool* threadPool = nullptr) {
+  GRANULAR_TIMER(GranularLoop);
+  CountPlanGrains(plan);
+
+  output->clear();
+  output->resize(size_t(plan.m_numOutputSamples) * plan.m_numChannels, 0.0f);
+  if (!threadPool || threadPool->NumThreads() == 1) {
+    ExecuteRenderPlanRange(input, plan, 0, plan.m_splats.size(), output,
+                           quality);
+    return;
+  }
+
+  // a few ranges per thread, so uneven ones even out
+  std::vector<size_t> rangeStarts;
+  SplitRenderPlan(plan, threadPool->NumThreads() * 4, &rangeStarts);
+  threadPool->ParallelFor(
+      rangeStarts.size() - 1, 1, [&](size_t begin, size_t end) {
+        for (size_t range = begin; range < end; ++range)
+          ExecuteRenderPlanRange(input, plan, rangeStarts[range],
+                                 rangeStarts[range + 1], output, quality);
+      });
+}
+
+// Overlap-add. Instead of butting grains end to end and cross fading only
+// where a grain gets repeated or skipped, every grain is windowed and grains
+// overlap by a fixed factor, so there are no seams to hear even at large grain
+// sizes. The output is normalized by the sum of the windows that covered each
+// sample, so any window and overlap sums to unity gain.
+enum class EGrainWindow {
+  None,      // no overlap-add, grains with cross fades
+  Hann,      // raised cosine
+  Tukey,     // flat top with cosine tapers over the outer quarters
+  Gaussian,  // standard deviation of 0.4 of the half width
+};
+
+// windows are drawn from tables of this many points (plus one for the end)
+const size_t c_grainWindowTableSize = 4096;
+
+// the table for a window, made once the first time it is asked for
+const std::vector<float>& GrainWindowTable(EGrainWindow window) {
+  static const std::vector<float> c_tables[4] = {
+      std::vector<float>(c_grainWindowTableSize + 1, 1.0f),
+      [] {
+        std::vector<float> table(c_grainWindowTableSize + 1);
+        for (size_t i = 0; i <= c_grainWindowTableSize; ++i)
+          table[i] = 0.5f - 0.5f * std::cos(2.0f * c_pi * float(i) /
+                                            float(c_grainWindowTableSize));
+        return table;
+      }(),
+      [] {
+        const float alpha = 0.5f;
+        std::vector<float> table(c_grainWindowTableSize + 1);
+        for (size_t i = 0; i <= c_grainWindowTableSize; ++i) {
+          float x = float(i) / float(c_grainWindowTableSize);
+          float edge = std::min(x, 1.0f - x);
+          table[i] = (edge >= alpha * 0.5f)
+                         ? 1.0f
+                         : 0.5f - 0.5f * std::cos(2.0f * c_pi * edge / alpha);
+        }
+        return table;
+      }(),
+      [] {
+        const float sigma = 0.4f;
+        std::vector<float> table(c_grainWindowTableSize + 1);
+        for (size_t i = 0; i <= c_grainWindowTableSize; ++i) {
+          float x = (float(i) / float(c_grainWindowTableSize) - 0.5f) * 2.0f;
+          table[i] = std::exp(-0.5f * (x / sigma) * (x / sigma));
+        }
+        return table;
+      }(),
+  };
+  return c_tables[int(window)];
+}
+
+// adds a grain times its window into the output, and the window into the
+// weights used to normalize it. Simple enough for the compiler to vectorize.
+GRANULAR_MULTIVERSION
+void AccumulateWindowedGrain(const float* grain, const float* window,
+                             size_t numSamples, uint16 numChannels,
+                             float* output, float* weights) {
+  if (numChannels == 1) {
+    for (size_t i = 0; i < numSamples; ++i) {
+      output[i] += grain[i] * window[i];
+      weights[i] += window[i];
+    }
+    return;
+  }
+  if (numChannels == 2) {
+    for (size_t i = 0; i < numSamples; ++i) {
+      output[i * 2 + 0] += grain[i * 2 + 0] * window[i];
+      output[i * 2 + 1] += grain[i * 2 + 1] * window[i];
+      weights[i] += window[i];
+    }
+    return;
+  }
+  for (size_t i = 0; i < numSamples; ++i) {
+    for (uint16 channel = 0; channel < numChannels; ++channel)
+      output[i * numChannels + channel] +=
+          grain[i * numChannels + channel] * window[i];
+    weights[i] += window[i];
+  }
+}
+
+// Time and pitch adjust by overlap-adding windowed grains. Grains are
+// grainSizeSeconds long in the output and start every 1/overlap of that. Each
+// one plays back the input around the matching point in time at
+// pitchMultiplier times the speed.
+template <typename SAMPLE>
+void GranularOverlapAdd(const std::vector<SAMPLE>& input,
+                        std::vector<float>* output, uint16 numChannels,
+                        uint32 sampleRate, float timeMultiplier,
+                        float pitchMultiplier, float grainSizeSeconds,
+                        EGrainWindow window, float overlap,
+                        EInterpolation quality = EInterpolation::Cubic) {
+  GRANULAR_TIMER(GranularLoop);
+
+  size_t numInputSamples = input.size() / numChannels;
+  size_t numOutputSamples =
+      (size_t)(static_cast<float>(numInputSamples) * timeMultiplier);
+  output->clear();
+  output->resize(numOutputSamples * numChannels, 0.0f);
+  if (numOutputSamples == 0) return;
+
+  size_t grainSize = std::max<size_t>(
+      1, size_t(static_cast<float>(sampleRate) * grainSizeSeconds));
+  size_t hopSize =
+      std::max<size_t>(1, size_t(float(grainSize) / std::max(overlap, 1.0f)));
+
+  // the window for this grain size, drawn from its table
+  const std::vector<float>& table = GrainWindowTable(window);
+  std::vector<float> grainWindow(grainSize);
+  for (size_t i = 0; i < grainSize; ++i)
+    grainWindow[i] = table[i * c_grainWindowTableSize / grainSize];
+
+  std::vector<float> weights(numOutputSamples, 0.0f);
+  std::vector<float> grain(grainSize * numChannels);
+  float positions[c_interpolationBlockSize];
+  float values[c_interpolationBlockSize];
+  float inputSpan = float(grainSize) * pitchMultiplier;
+  for (size_t outputStart = 0; outputStart < numOutputSamples;
+       outputStart += hopSize) {
+    // the grain is centered on the input at the same point in time as the
+    // output it goes to
+    float center = (float(outputStart) + float(grainSize) * 0.5f) /
+                   timeMultiplier;
+    float inputStart = std::max(center - inputSpan * 0.5f, 0.0f);
+    size_t numSamples = std::min(grainSize, numOutputSamples - outputStart);
+
+    // interpolate the grain a block at a time, then window and accumulate it
+    // all at once
+    for (size_t blockStart = 0; blockStart < numSamples;
+         blockStart += c_interpolationBlockSize) {
+      size_t numFrames =
+          std::min(c_interpolationBlockSize, numSamples - blockStart);
+      for (size_t i = 0; i < numFrames; ++i)
+        positions[i] =
+            std::min(inputStart + float(blockStart + i) * pitchMultiplier,
+                     float(numInputSamples - 1));
+      for (uint16 channel = 0; channel < numChannels; ++channel) {
+        InterpolateBlock(input, positions, numFrames, channel, numChannels,
+                         values, quality);
+        for (size_t i = 0; i < numFrames; ++i)
+          grain[(blockStart + i) * numChannels + channel] = values[i];
+      }
+    }
+    AccumulateWindowedGrain(grain.data(), grainWindow.data(), numSamples,
+                            numChannels,
+                            &(*output)[outputStart * numChannels],
+                            &weights[outputStart]);
+    GRANULAR_COUNT(GrainsRendered, 1);
+    GRANULAR_COUNT(FramesInterpolated, numSamples);
+  }
+
+  // normalize by how much window covered each sample. Samples no window
+  // reached (the very first of a window that starts at zero) stay silent.
+  float* out = output->data();
+  for (size_t i = 0; i < numOutputSamples; ++i) {
+    float scale = weights[i] > 1e-6f ? 1.0f / weights[i] : 0.0f;
+    for (uint16 channel = 0; channel < numChannels; ++channel)
+      out[i * numChannels + channel] *= scale;
+  }
+}
+
+// window picks overlap-add instead of cross faded grains, see
+// GranularOverlapAdd(). crossFadeSeconds is unused then.
+template <typename SAMPLE>
+void GranularTimePitchAdjust(const std::vector<SAMPLE>& input,
+                             std::vector<float>* output, uint16 numChannels,
+                             uint32 sampleRate, float timeMultiplier,
+                             float pitchMultiplier, float grainSizeSeconds,
+                             float crossFadeSeconds,
+                             EGrainWindow window = EGrainWindow::None,
+                             float overlap = 4.0f,
+                             EInterpolation quality = EInterpolation::Cubic) {
+  if (window != EGrainWindow::None) {
+    GranularOverlapAdd(input, output, numChannels, sampleRate, timeMultiplier,
+                       pitchMultiplier, grainSizeSeconds, window, overlap,
+                       quality);
+    return;
+  }
+
+  SRenderPlan plan;
+  PlanGranularTimePitchAdjust(input.size() / numChannels, numChannels,
+                              sampleRate, timeMultiplier, pitchMultiplier,
+                              grainSizeSeconds, crossFadeSeconds, &plan);
+  ExecuteRenderPlan(input, plan, output, quality);
+}
+
+// threadPool renders grains concurrently, see ExecuteRenderPlan()
+template <typename LAMBDA, typename SAMPLE>
+void GranularTimePitchAdjustDynamic(const std::vector<SAMPLE>& input,
+                                    std::vector<float>* output,
+                                    uint16 numChannels, uint32 sampleRate,
+                                    float grainSizeSeconds,
+                                    float crossFadeSeconds,
+                                    const LAMBDA& settingsCallback,
+                                    EInterpolation quality =
+                                        EInterpolation::Cubic,
+                                    CThreadPool* threadPool = nullptr) {
+  SRenderPlan plan;
+  PlanGranularTimePitchAdjustDynamic(input.size() / numChannels, numChannels,
+                                     sampleRate, grainSizeSeconds,
+                                     crossFadeSeconds, settingsCallback, &plan,
+                                     threadPool);
+  ExecuteRenderPlan(input, plan, output, quality, threadPool);
+}
+
+// Keeps plans around so rendering the same input with the same settings again
+// (to another format or sample rate, say) skips planning. Once the plans add
+// up to more than the budget, the least recently used are dropped. Safe to
+// share between threads; plans handed out are immutable. A plan is worked
+// out outside the lock, and threads asking for one that's being worked out
+// wait for it rather than working it out again.
+class CRenderPlanCache {
+ public:
+  // keeps every plan unless given a budget
+  explicit CRenderPlanCache(size_t budgetBytes = size_t(-1))
+      : m_budgetBytes(budgetBytes) {}
+
+  std::shared_ptr<const SRenderPlan> Get(size_t numInputSamples,
+                                         uint16 numChannels, uint32 sampleRate,
+                                         float timeMultiplier,
+                                         float pitchMultiplier,
+                                         float grainSizeSeconds,
+                                         float crossFadeSeconds) {
+    SKey key = {numInputSamples, numChannels,      sampleRate,
+                timeMultiplier,  pitchMultiplier,  grainSizeSeconds,
+                crossFadeSeconds};
+
+    std::promise<TPlan> promise;
+    std::shared_future<TPlan> cached;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto found = m_entries.find(key);
+      if (found != m_entries.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+        cached = found->second->m_plan;
+      } else {
+        m_lru.push_front({key, promise.get_future().share(), 0});
+        m_entries[key] = m_lru.begin();
+      }
+    }
+    if (cached.valid()) return cached.get();
+
+    std::shared_ptr<SRenderPlan> plan(new SRenderPlan);
+    PlanGranularTimePitchAdjust(numInputSamples, numChannels, sampleRate,
+                                timeMultiplier, pitchMultiplier,
+                                grainSizeSeconds, crossFadeSeconds,
+                                plan.get());
+    promise.set_value(plan);
+
+    // now it's been sized, make room for it. It may have been dropped
+    // already, in which case it isn't kept.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_entries.find(key);
+    if (found == m_entries.end() || found->second->m_size != 0) return plan;
+    size_t size = plan->MemoryBytes();
+    if (size > m_budgetBytes) {
+      Remove(found);
+      return plan;
+    }
+    found->second->m_size = size;
+    m_usedBytes += size;
+    while (m_usedBytes > m_budgetBytes) {
+      Remove(m_entries.find(m_lru.back().m_key));
+      ++m_numEvictions;
+    }
+    return plan;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_lru.clear();
+    m_usedBytes = 0;
+  }
+
+  size_t NumEvictions() const { return m_numEvictions; }
+  size_t UsedBytes() const { return m_usedBytes; }
+
+ private:
+  typedef std::shared_ptr<const SRenderPlan> TPlan;
+
+  struct SKey {
+    size_t m_numInputSamples;
+    uint16 m_numChannels;
+    uint32 m_sampleRate;
+    float m_timeMultiplier;
+    float m_pitchMultiplier;
+    float m_grainSizeSeconds;
+    float m_crossFadeSeconds;
+
+    bool operator<(const SKey& other) const {
+      if (m_numInputSamples != other.m_numInputSamples)
+        return m_numInputSamples < other.m_numInputSamples;
+      if (m_numChannels != other.m_numChannels)
+        return m_numChannels < other.m_numChannels;
+      if (m_sampleRate != other.m_sampleRate)
+        return m_sampleRate < other.m_sampleRate;
+      if (m_timeMultiplier != other.m_timeMultiplier)
+        return m_timeMultiplier < other.m_timeMultiplier;
+      if (m_pitchMultiplier != other.m_pitchMultiplier)
+        return m_pitchMultiplier < other.m_pitchMultiplier;
+      if (m_grainSizeSeconds != other.m_grainSizeSeconds)
+        return m_grainSizeSeconds < other.m_grainSizeSeconds;
+      return m_crossFadeSeconds < other.m_crossFadeSeconds;
+    }
+  };
+
+  struct SEntry {
+    SKey m_key;
+    std::shared_future<TPlan> m_plan;
+    size_t m_size;  // 0 while it's being worked out
+  };
+
+  typedef std::list<SEntry>::iterator TEntryIterator;
+
+  void Remove(std::map<SKey, TEntryIterator>::iterator found) {
+    m_usedBytes -= found->second->m_size;
+    m_lru.erase(found->second);
+    m_entries.erase(found);
+  }
+
+  size_t m_budgetBytes;
+  std::mutex m_mutex;
+  std::list<SEntry> m_lru;  // most recently used first
+  std::map<SKey, TEntryIterator> m_entries;
+  std::atomic<size_t> m_usedBytes{0};
+  std::atomic<size_t> m_numEvictions{0};
+};
+
+// a decoded input file, kept in one of the source formats
+struct SDecodedSource {
+  ESourceFormat m_format = ESourceFormat::Float;
+  std::vector<float> m_data;  // the samples of whichever format it's in
+  std::vector<int16> m_int16;
+  std::vector<SHalf> m_half;
+  uint16 m_numChannels = 0;
+  uint32 m_sampleRate = 0;
+  uint16 m_numBytes = 0;
+
+  size_t MemoryBytes() const {
+    return m_data.size() * sizeof(float) + m_int16.size() * sizeof(int16) +
+           m_half.size() * sizeof(SHalf);
+  }
+};
+
+// reads a file with ReadWaveFile(), or the rest of input if given one, and
+// keeps it in format
+bool DecodeSource(const char* fileName, ESourceFormat format,
+                  SDecodedSource* source, CInputStage* input = nullptr) {
+  source->m_format = format;
+  std::vector<float> decoded;
+  std::vector<float>& data =
+      format == ESourceFormat::Float ? source->m_data : decoded;
+  bool read = input ? DrainInputStage(input, fileName, &data,
+                                      &source->m_numChannels,
+                                      &source->m_sampleRate,
+                                      &source->m_numBytes)
+                    : ReadWaveFile(fileName, &data, &source->m_numChannels,
+                                   &source->m_sampleRate,
+                                   &source->m_numBytes);
+  if (!read) return false;
+
+  if (format != ESourceFormat::Float) std::vector<float>().swap(source->m_data);
+  if (format == ESourceFormat::Int16)
+    ConvertSource(decoded, &source->m_int16);
+  else
+    std::vector<int16>().swap(source->m_int16);
+  if (format == ESourceFormat::Half)
+    ConvertSource(decoded, &source->m_half);
+  else
+    std::vector<SHalf>().swap(source->m_half);
+  return true;
+}
+
+// Keeps decoded input files in memory so jobs on the same file skip reading
+// and decoding it. Entries are found by path and source format, and only
+// used while the file has the same device, inode, size and modification
+// time as when it was read. Once the entries add up to more than the
+// budget, the least recently used are dropped. Safe to share between
+// threads; sources handed out are immutable and stay alive while anyone
+// holds them, evicted or not. Files are decoded outside the lock, and a
+// thread wanting a file another is decoding waits for it instead of decoding
+// it too.
+class CSourceCache {
+ public:
+  explicit CSourceCache(size_t budgetBytes) : m_budgetBytes(budgetBytes) {}
+
+  // nullptr, after saying why, if the file can't be read
+  std::shared_ptr<const SDecodedSource> Get(const char* fileName,
+                                            ESourceFormat format) {
+    SIdentity identity;
+    bool cacheable = strcmp(fileName, "-") && GetIdentity(fileName, &identity);
+    if (!cacheable) {
+      ++m_numMisses;
+      std::shared_ptr<SDecodedSource> source(new SDecodedSource);
+      if (!DecodeSource(fileName, format, source.get())) return nullptr;
+      return source;
+    }
+
+    // find it, or wait for whoever is decoding it, or decode it
+    TKey key(fileName, format);
+    std::promise<TSource> promise;
+    std::shared_future<TSource> decoding;
+    uint64_t decodeId = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto found = m_entries.find(key);
+      if (found != m_entries.end() && found->second->m_identity == identity) {
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+        ++m_numHits;
+        return found->second->m_source;
+      }
+      auto inFlight = m_decoding.find(key);
+      if (inFlight != m_decoding.end() &&
+          inFlight->second.m_identity == identity) {
+        ++m_numHits;
+        decoding = inFlight->second.m_source;
+      } else {
+        ++m_numMisses;
+        decodeId = ++m_lastDecodeId;
+        m_decoding[key] = {identity, decodeId, promise.get_future().share()};
+      }
+    }
+    if (decoding.valid()) return decoding.get();
+
+    // decode outside the lock, so other threads aren't held up
+    std::shared_ptr<SDecodedSource> source(new SDecodedSource);
+    if (!DecodeSource(fileName, format, source.get())) source.reset();
+    promise.set_value(source);
+
+    // don't keep it if the file changed while it was being read
+    SIdentity identityAfter;
+    bool unchanged = source && GetIdentity(fileName, &identityAfter) &&
+                     identityAfter == identity;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto inFlight = m_decoding.find(key);
+    if (inFlight != m_decoding.end() && inFlight->second.m_id == decodeId)
+      m_decoding.erase(inFlight);
+    if (!unchanged) return source;
+
+    auto found = m_entries.find(key);
+    if (found != m_entries.end()) Remove(found);
+    size_t size = source->MemoryBytes();
+    if (size > m_budgetBytes) return source;
+    m_lru.push_front({key, identity, source, size});
+    m_entries[key] = m_lru.begin();
+    m_usedBytes += size;
+    while (m_usedBytes > m_budgetBytes) {
+      Remove(m_entries.find(m_lru.back().m_key));
+      ++m_numEvictions;
+    }
+    return source;
+  }
+
+  size_t NumHits() const { return m_numHits; }
+  size_t NumMisses() const { return m_numMisses; }
+  size_t NumEvictions() const { return m_numEvictions; }
+  size_t UsedBytes() const { return m_usedBytes; }
+
+ private:
+  struct SIdentity {
+    uint64_t m_device = 0;
+    uint64_t m_inode = 0;
+    uint64_t m_size = 0;
+    int64_t m_modifiedSeconds = 0;
+    int64_t m_modifiedNanoseconds = 0;
+
+    bool operator==(const SIdentity& other) const {
+      return m_device == other.m_device && m_inode == other.m_inode &&
+             m_size == other.m_size &&
+             m_modifiedSeconds == other.m_modifiedSeconds &&
+             m_modifiedNanoseconds == other.m_modifiedNanoseconds;
+    }
+  };
+
+  typedef std::pair<std::string, ESourceFormat> TKey;
+  typedef std::shared_ptr<const SDecodedSource> TSource;
+
+  struct SEntry {
+    TKey m_key;
+    SIdentity m_identity;
+    TSource m_source;
+    size_t m_size;
+  };
+
+  // a decode in progress, null if it fails
+  struct SDecoding {
+    SIdentity m_identity;
+    uint64_t m_id;
+    std::shared_future<TSource> m_source;
+  };
+
+  typedef std::list<SEntry>::iterator TEntryIterator;
+
+  static bool GetIdentity(const char* fileName, SIdentity* identity) {
+    struct stat status;
+    if (stat(fileName, &status) != 0) return false;
+    identity->m_device = uint64_t(status.st_dev);
+    identity->m_inode = uint64_t(status.st_ino);
+    identity->m_size = uint64_t(status.st_size);
+    identity->m_modifiedSeconds = int64_t(status.st_mtime);
+#ifdef __linux__
+    identity->m_modifiedNanoseconds = int64_t(status.st_mtim.tv_nsec);
+#endif
+    return true;
+  }
+
+  void Remove(std::map<TKey, TEntryIterator>::iterator found) {
+    m_usedBytes -= found->second->m_size;
+    m_lru.erase(found->second);
+    m_entries.erase(found);
+  }
+
+  size_t m_budgetBytes;
+  std::mutex m_mutex;
+  std::list<SEntry> m_lru;  // most recently used first
+  std::map<TKey, TEntryIterator> m_entries;
+  std::map<TKey, SDecoding> m_decoding;
+  uint64_t m_lastDecodeId = 0;
+  std::atomic<size_t> m_usedBytes{0};
+  std::atomic<size_t> m_numHits{0};
+  std::atomic<size_t> m_numMisses{0};
+  std::atomic<size_t> m_numEvictions{0};
+};
+
+// Plans serialize to a little endian binary blob: a small header followed by
+// the splats, so a coordinator can hand them to workers.
+const unsigned char c_renderPlanMagic[4] = {'G', 'S', 'R', 'P'};
+const uint32 c_renderPlanVersion = 1;
+
+void SerializeRenderPlan(const SRenderPlan& plan,
+                         std::vector<unsigned char>* data) {
+  data->clear();
+  data->insert(data->end(), c_renderPlanMagic, c_renderPlanMagic + 4);
+  AppendBytes(data, c_renderPlanVersion);
+  AppendBytes(data, plan.m_numChannels);
+  AppendBytes(data, plan.m_numInputSamples);
+  AppendBytes(data, plan.m_numOutputSamples);
+  AppendBytes(data, plan.m_grainSizeSamples);
+  AppendBytes(data, plan.m_crossFadeSizeSamples);
+  AppendBytes(data, uint64_t(plan.m_splats.size()));
+  for (const SGrainSplat& splat : plan.m_splats) {
+    AppendBytes(data, splat.m_inputStart);
+    AppendBytes(data, splat.m_outputStart);
+    AppendBytes(data, splat.m_pitchMultiplier);
+    AppendBytes(data, uint8_t(splat.m_crossFade));
+    AppendBytes(data, uint8_t(splat.m_isFinalGrain));
+  }
+}
+
+bool DeserializeRenderPlan(const std::vector<unsigned char>& data,
+                           SRenderPlan* plan) {
+  size_t index = 0;
+  uint32 version = 0;
+  uint64_t numSplats = 0;
+  if (data.size() < 4 || memcmp(&data[0], c_renderPlanMagic, 4)) return false;
+  index += 4;
+  if (!ConsumeBytes(data, &index, &version) ||
+      version != c_renderPlanVersion ||
+      !ConsumeBytes(data, &index, &plan->m_numChannels) ||
+      !ConsumeBytes(data, &index, &plan->m_numInputSamples) ||
+      !ConsumeBytes(data, &index, &plan->m_numOutputSamples) ||
+      !ConsumeBytes(data, &index, &plan->m_grainSizeSamples) ||
+      !ConsumeBytes(data, &index, &plan->m_crossFadeSizeSamples) ||
+      !ConsumeBytes(data, &index, &numSplats))
+    return false;
+
+  // each splat is 22 bytes, don't trust a count the data can't hold
+  if ((data.size() - index) / 22 < numSplats) return false;
+
+  plan->m_splats.resize(size_t(numSplats));
+  for (SGrainSplat& splat : plan->m_splats) {
+    uint8_t crossFade = 0;
+    uint8_t isFinalGrain = 0;
+    if (!ConsumeBytes(data, &index, &splat.m_inputStart) ||
+        !ConsumeBytes(data, &index, &splat.m_outputStart) ||
+        !ConsumeBytes(data, &index, &splat.m_pitchMultiplier) ||
+        !ConsumeBytes(data, &index, &crossFade) ||
+        !ConsumeBytes(data, &index, &isFinalGrain) ||
+        crossFade > uint8_t(ECrossFade::Out))
+      return false;
+    splat.m_crossFade = static_cast<ECrossFade>(crossFade);
+    splat.m_isFinalGrain = isFinalGrain != 0;
+  }
+  return true;
+}
+
+bool WriteRenderPlan(const char* fileName, const SRenderPlan& plan) {
+  std::vector<unsigned char> data;
+  SerializeRenderPlan(plan, &data);
+
+  FILE* file = nullptr;
+  fopen_s(&file, fileName, "w+b");
+  if (!file) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
+  fwrite(&data[0], data.size(), 1, file);
+  fclose(file);
+  return true;
+}
+
+bool ReadRenderPlan(const char* fileName, SRenderPlan* plan) {
+  std::vector<unsigned char> data;
+  if (!ReadFileIntoMemory(fileName, &data)) return false;
+  if (!DeserializeRenderPlan(data, plan)) {
+    printf("[-----ERROR-----]%s is an invalid render plan.\n", fileName);
+    return false;
+  }
+  return true;
+}
+
+// Pipelines chain processing stages that make audio a block at a time, so a
+// multi step job streams each block through every stage while it is still in
+// cache instead of writing out and reading back a whole intermediate buffer.
+// Stages pull from the stage before them; the last one is usually drained
+// into a file by WriteWaveFileStreaming().
+const size_t c_pipelineBlockSamples = 1024;
+
+// NumSamples() of a stage that doesn't know how long it is until it ends
+const size_t c_unknownNumSamples = size_t(-1);
+
+class CAudioStage {
+ public:
+  virtual ~CAudioStage() {}
+
+  virtual uint16 NumChannels() const = 0;
+
+  // how many samples (frames) this stage makes in total, or
+  // c_unknownNumSamples
+  virtual size_t NumSamples() const = 0;
+
+  // writes up to numSamples samples (frames) of interleaved audio to output
+  // and returns how many were written. Returns 0 once the stage is done.
+  virtual size_t Pull(float* output, size_t numSamples) = 0;
+};
+
+// plays back a buffer that is already in memory
+class CBufferStage : public CAudioStage {
+ public:
+  CBufferStage(const std::vector<float>& input, uint16 numChannels)
+      : m_input(input), m_numChannels(numChannels) {}
+
+  uint16 NumChannels() const override { return m_numChannels; }
+  size_t NumSamples() const override { return m_input.size() / m_numChannels; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, NumSamples() - m_position);
+    memcpy(output, &m_input[m_position * m_numChannels],
+           numSamples * m_numChannels * sizeof(float));
+    m_position += numSamples;
+    return numSamples;
+  }
+
+ private:
+  const std::vector<float>& m_input;
+  uint16 m_numChannels;
+  size_t m_position = 0;
+};
+
+// renders a granular render plan. Grains are splatted into a window that is
+// one block plus the longest grain long, in plan order, so the output is the
+// same as ExecuteRenderPlan() to the bit.
+class CGranularStage : public CAudioStage {
+ public:
+  CGranularStage(const std::vector<float>& input,
+                 std::shared_ptr<const SRenderPlan> plan,
+                 EInterpolation quality = EInterpolation::Cubic)
+      : m_input(input), m_plan(plan), m_quality(quality) {
+    // the longest a grain gets is when it plays back the slowest. Pad it a
+    // little for float error in the sample position.
+    float minPitchMultiplier = 1.0f;
+    for (const SGrainSplat& splat : m_plan->m_splats)
+      minPitchMultiplier = std::min(minPitchMultiplier, splat.m_pitchMultiplier);
+    size_t maxSplatSamples =
+        size_t(float(m_plan->m_grainSizeSamples) / minPitchMultiplier) + 16;
+
+    m_windowSamples = c_pipelineBlockSamples + maxSplatSamples;
+    m_window.resize(m_windowSamples * m_plan->m_numChannels, 0.0f);
+  }
+
+  uint16 NumChannels() const override { return m_plan->m_numChannels; }
+  size_t NumSamples() const override {
+    return size_t(m_plan->m_numOutputSamples);
+  }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    uint16 numChannels = m_plan->m_numChannels;
+    numSamples = std::min(numSamples, c_pipelineBlockSamples);
+    numSamples = std::min(numSamples, NumSamples() - m_windowStart);
+    if (numSamples == 0) return 0;
+    if (m_windowStart == 0) CountPlanGrains(*m_plan);
+
+    // every grain that starts in this block gets splatted now. Grains that
+    // started earlier already were, so none start before the window.
+    size_t blockEnd = m_windowStart + numSamples;
+    while (m_nextSplat < m_plan->m_splats.size() &&
+           m_plan->m_splats[m_nextSplat].m_outputStart < blockEnd) {
+      const SGrainSplat& splat = m_plan->m_splats[m_nextSplat];
+      size_t offset = size_t(splat.m_outputStart) - m_windowStart;
+      size_t available = std::min(NumSamples() - size_t(splat.m_outputStart),
+                                  m_windowSamples - offset);
+      SplatGrainToBuffer(m_input, &m_window[offset * numChannels], available,
+                         numChannels, size_t(splat.m_inputStart),
+                         size_t(m_plan->m_grainSizeSamples), splat.m_crossFade,
+                         size_t(m_plan->m_crossFadeSizeSamples),
+                         splat.m_pitchMultiplier, splat.m_isFinalGrain,
+                         m_quality);
+      ++m_nextSplat;
+    }
+
+    // hand out the finished block and slide the window along
+    size_t blockValues = numSamples * numChannels;
+    memcpy(output, &m_window[0], blockValues * sizeof(float));
+    std::copy(m_window.begin() + blockValues, m_window.end(), m_window.begin());
+    std::fill(m_window.end() - blockValues, m_window.end(), 0.0f);
+    m_windowStart += numSamples;
+    return numSamples;
+  }
+
+ private:
+  const std::vector<float>& m_input;
+  std::shared_ptr<const SRenderPlan> m_plan;
+  EInterpolation m_quality;
+  std::vector<float> m_window;
+  size_t m_windowSamples = 0;
+  size_t m_windowStart = 0;
+  size_t m_nextSplat = 0;
+};
+
+// Hands the latest value from one thread to another, without locks, so
+// neither side can be held up by the other. Unlike a queue it can't fill up:
+// a value written over one the reader never got to replaces it, so the
+// reader always gets the newest.
+template <typename T>
+class CTripleBuffer {
+ public:
+  // for the writing thread
+  void Write(const T& value) {
+    m_items[m_writeIndex] = value;
+    m_writeIndex =
+        m_shared.exchange(m_writeIndex | c_fresh, std::memory_order_acq_rel) &
+        c_indexMask;
+  }
+
+  // for the reading thread. Returns false if nothing has been written since
+  // the last read.
+  bool Read(T* value) {
+    if (!(m_shared.load(std::memory_order_relaxed) & c_fresh)) return false;
+    m_readIndex =
+        m_shared.exchange(m_readIndex, std::memory_order_acq_rel) &
+        c_indexMask;
+    *value = m_items[m_readIndex];
+    return true;
+  }
+
+ private:
+  static constexpr int c_indexMask = 3;
+  static constexpr int c_fresh = 4;
+
+  // the writer and the reader each hold an item, and swap theirs with the
+  // shared one, which is flagged fresh when the writer swaps one in
+  T m_items[3];
+  int m_writeIndex = 0;
+  char m_padding[64];
+  std::atomic<int> m_shared{1};
+  char m_padding2[64];
+  int m_readIndex = 2;
+};
+
+// The output of a stage that splats whole grains ahead of the blocks it hands
+// out. It's a ring, so handing out a block leaves the rest where it is.
+// Positions count samples (frames) since the start. A grain is splatted in
+// one piece, running on past the end of the ring into room for a grain that
+// Splatted() then adds back round to the start.
+class CSplatWindow {
+ public:
+  CSplatWindow(uint16 numChannels, size_t numSamples, size_t maxGrainSamples)
+      : m_numChannels(numChannels),
+        m_numSamples(numSamples),
+        m_maxGrainSamples(maxGrainSamples),
+        m_data((numSamples + maxGrainSamples) * numChannels, 0.0f) {}
+
+  // where to splat a grain starting at position, with room for
+  // MaxGrainSamples() after it
+  float* At(size_t position) {
+    return &m_data[(position % m_numSamples) * m_numChannels];
+  }
+  size_t MaxGrainSamples() const { return m_maxGrainSamples; }
+
+  // call after splatting numSamples at position, to wrap them round
+  void Splatted(size_t position, size_t numSamples) {
+    size_t start = position % m_numSamples;
+    if (start + numSamples <= m_numSamples) return;
+    float* spill = &m_data[m_numSamples * m_numChannels];
+    size_t numValues = (start + numSamples - m_numSamples) * m_numChannels;
+    for (size_t i = 0; i < numValues; ++i) {
+      m_data[i] += spill[i];
+      spill[i] = 0.0f;
+    }
+  }
+
+  // hands out numSamples from position on, clearing them for the grains
+  // that come round to them next
+  void Take(size_t position, float* output, size_t numSamples) {
+    while (numSamples > 0) {
+      size_t start = position % m_numSamples;
+      size_t count = std::min(numSamples, m_numSamples - start);
+      float* data = &m_data[start * m_numChannels];
+      memcpy(output, data, count * m_numChannels * sizeof(float));
+      std::fill(data, data + count * m_numChannels, 0.0f);
+      output += count * m_numChannels;
+      position += count;
+      numSamples -= count;
+    }
+  }
+
+ private:
+  uint16 m_numChannels;
+  size_t m_numSamples;
+  size_t m_maxGrainSamples;
+  std::vector<float> m_data;
+};
+
+// settings of a live granular time/pitch adjust. Values outside the ranges
+// below are clamped.
+struct SLiveParams {
+  float m_timeMultiplier = 1.0f;      // 0.1 to 10
+  float m_pitchMultiplier = 1.0f;     // 0.25 to 4
+  float m_grainSizeSeconds = 0.02f;   // 0.005 to 0.25
+  float m_crossFadeSeconds = 0.002f;  // 0 to the grain size
+  EInterpolation m_interpolation = EInterpolation::Cubic;
+};
+
+// how long each setting takes to get most of the way (63%) to a new value,
+// in seconds. 0 jumps straight there.
+struct SLiveSmoothing {
+  float m_timeSeconds = 0.05f;
+  float m_pitchSeconds = 0.05f;
+  float m_grainSizeSeconds = 0.1f;
+  float m_crossFadeSeconds = 0.1f;
+};
+
+// Granular time/pitch adjust whose settings can be changed while it renders.
+// Grains are planned one at a time as the output gets to them, the same way
+// the planner does: grains play on from where the last one ended until the
+// input has drifted half a grain from where the time multiplier says it
+// should be, then it jumps there with a cross fade, repeating or skipping
+// audio. A control thread pushes settings with PushParams(); the render
+// thread picks up the latest at the next grain and eases into it, so neither
+// ever waits on the other.
+// A change is heard one output buffer plus the rest of the grain playing
+// later, not one buffer: grains are splatted whole as they start, and picking
+// settings up every block instead would mean cutting grains short with a
+// cross fade of their own. A grain plays for its size over its pitch, 20ms by
+// default and at most c_maxGrainSeconds / c_minPitch.
+class CLiveGranularStage : public CAudioStage {
+ public:
+  CLiveGranularStage(const std::vector<float>& input, uint16 numChannels,
+                     uint32 sampleRate, const SLiveParams& params,
+                     const SLiveSmoothing& smoothing = SLiveSmoothing())
+      : m_input(input),
+        m_numChannels(numChannels),
+        m_sampleRate(sampleRate),
+        m_smoothing(smoothing),
+        m_window(numChannels, c_pipelineBlockSamples + MaxGrainSamples(),
+                 MaxGrainSamples()) {
+    m_target = Clamp(params);
+    m_current = m_target;
+  }
+
+  // called from the control thread, as often as it likes. Settings pushed
+  // before the next grain starts replace each other; the last are taken.
+  void PushParams(const SLiveParams& params) { m_params.Write(params); }
+
+  // the settings the last grain used, for the render thread
+  const SLiveParams& CurrentParams() const { return m_current; }
+
+  uint16 NumChannels() const override { return m_numChannels; }
+  size_t NumSamples() const override { return c_unknownNumSamples; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, c_pipelineBlockSamples);
+
+    // plan and splat grains until the block is covered
+    size_t blockEnd = m_windowStart + numSamples;
+    while (!m_inputEnded && m_plannedOutput < blockEnd) StartGrain();
+
+    numSamples = std::min(numSamples, m_plannedOutput - m_windowStart);
+    if (numSamples == 0) return 0;
+
+    // hand out the finished block
+    m_window.Take(m_windowStart, output, numSamples);
+    m_windowStart += numSamples;
+    return numSamples;
+  }
+
+ private:
+  static constexpr float c_minTime = 0.1f;
+  static constexpr float c_maxTime = 10.0f;
+  static constexpr float c_minPitch = 0.25f;
+  static constexpr float c_maxPitch = 4.0f;
+  static constexpr float c_minGrainSeconds = 0.005f;
+  static constexpr float c_maxGrainSeconds = 0.25f;
+
+  // the longest grain there can be
+  size_t MaxGrainSamples() const {
+    return size_t(float(m_sampleRate) * c_maxGrainSeconds / c_minPitch) + 16;
+  }
+
+  static SLiveParams Clamp(SLiveParams params) {
+    params.m_timeMultiplier =
+        std::min(std::max(params.m_timeMultiplier, c_minTime), c_maxTime);
+    params.m_pitchMultiplier =
+        std::min(std::max(params.m_pitchMultiplier, c_minPitch), c_maxPitch);
+    params.m_grainSizeSeconds = std::min(
+        std::max(params.m_grainSizeSeconds, c_minGrainSeconds),
+        c_maxGrainSeconds);
+    params.m_crossFadeSeconds =
+        std::min(std::max(params.m_crossFadeSeconds, 0.0f),
+                 params.m_grainSizeSeconds);
+    return params;
+  }
+
+  // moves value toward target over a grain of grainSeconds
+  static float Smooth(float value, float target, float smoothingSeconds,
+                      float grainSeconds) {
+    if (smoothingSeconds <= 0.0f) return target;
+    return value + (target - value) *
+                       (1.0f - std::exp(-grainSeconds / smoothingSeconds));
+  }
+
+  // takes the newest settings pushed and eases the current ones toward them
+  void UpdateParams() {
+    SLiveParams params;
+    if (m_params.Read(&params)) m_target = Clamp(params);
+
+    // time and pitch are multipliers, so ease them in log space to make
+    // halving and doubling take as long as each other
+    float grainSeconds =
+        m_current.m_grainSizeSeconds / m_current.m_pitchMultiplier;
+    m_current.m_timeMultiplier = std::exp(Smooth(
+        std::log(m_current.m_timeMultiplier),
+        std::log(m_target.m_timeMultiplier), m_smoothing.m_timeSeconds,
+        grainSeconds));
+    m_current.m_pitchMultiplier = std::exp(Smooth(
+        std::log(m_current.m_pitchMultiplier),
+        std::log(m_target.m_pitchMultiplier), m_smoothing.m_pitchSeconds,
+        grainSeconds));
+    m_current.m_grainSizeSeconds = Smooth(
+        m_current.m_grainSizeSeconds, m_target.m_grainSizeSeconds,
+        m_smoothing.m_grainSizeSeconds, grainSeconds);
+    m_current.m_crossFadeSeconds = Smooth(
+        m_current.m_crossFadeSeconds, m_target.m_crossFadeSeconds,
+        m_smoothing.m_crossFadeSeconds, grainSeconds);
+    m_current.m_interpolation = m_target.m_interpolation;
+    m_current = Clamp(m_current);
+  }
+
+  void StartGrain() {
+    UpdateParams();
+    float pitchMultiplier = m_current.m_pitchMultiplier;
+    size_t grainSize = std::max<size_t>(
+        1, size_t(float(m_sampleRate) * m_current.m_grainSizeSeconds));
+    size_t crossFadeSize =
+        std::min(size_t(float(m_sampleRate) * m_current.m_crossFadeSeconds),
+                 size_t(float(grainSize) / pitchMultiplier));
+
+    size_t numInputSamples = m_input.size() / m_numChannels;
+    if (m_inputPosition >= double(numInputSamples)) {
+      m_inputEnded = true;
+      return;
+    }
+
+    // carry on from the last grain, or jump to where the input should be.
+    // The block being pulled ends within a block of here, so a grain never
+    // runs round into it.
+    float* window = m_window.At(m_plannedOutput);
+    size_t available = m_window.MaxGrainSamples();
+    // (cross fades are already no longer than a grain, so grains are all
+    // passed as final to keep the length check quiet at the end of the input)
+    size_t grainStart = m_nextInputStart;
+    ECrossFade crossFade = ECrossFade::None;
+    if (std::abs(m_inputPosition - double(m_nextInputStart)) >=
+        double(grainSize) * 0.5) {
+      size_t fadeWritten = SplatGrainToBuffer(
+          m_input, window, available, m_numChannels, m_nextInputStart,
+          grainSize, ECrossFade::Out, crossFadeSize, m_lastPitchMultiplier,
+          true, m_current.m_interpolation);
+      m_window.Splatted(m_plannedOutput, fadeWritten);
+      grainStart = size_t(m_inputPosition);
+      crossFade = ECrossFade::In;
+      GRANULAR_COUNT(CrossFades, 1);
+    }
+    size_t written = SplatGrainToBuffer(
+        m_input, window, available, m_numChannels, grainStart, grainSize,
+        crossFade, crossFadeSize, pitchMultiplier, true,
+        m_current.m_interpolation);
+    m_window.Splatted(m_plannedOutput, written);
+    GRANULAR_COUNT(GrainsRendered, 1);
+    if (written == 0) {
+      m_inputEnded = true;
+      return;
+    }
+
+    m_plannedOutput += written;
+    m_inputPosition += double(written) / double(m_current.m_timeMultiplier);
+    m_nextInputStart = grainStart + grainSize;
+    m_lastPitchMultiplier = pitchMultiplier;
+  }
+
+  const std::vector<float>& m_input;
+  uint16 m_numChannels;
+  uint32 m_sampleRate;
+  SLiveSmoothing m_smoothing;
+
+  CTripleBuffer<SLiveParams> m_params;
+  SLiveParams m_target;
+  SLiveParams m_current;
+
+  // where the input should be at m_plannedOutput, and where it would be if
+  // the next grain carried on from the last
+  double m_inputPosition = 0.0;
+  size_t m_nextInputStart = 0;
+  float m_lastPitchMultiplier = 1.0f;
+  bool m_inputEnded = false;
+
+  CSplatWindow m_window;
+  size_t m_windowStart = 0;
+  size_t m_plannedOutput = 0;
+};
+
+constexpr float CLiveGranularStage::c_minTime;
+constexpr float CLiveGranularStage::c_maxTime;
+constexpr float CLiveGranularStage::c_minPitch;
+constexpr float CLiveGranularStage::c_maxPitch;
+constexpr float CLiveGranularStage::c_minGrainSeconds;
+constexpr float CLiveGranularStage::c_maxGrainSeconds;
+
+// A ring buffer of live input, written by the thread capturing audio and read
+// by a grain engine, without locks. Positions count samples (frames) written
+// since the start and never wrap; the ring keeps the last Capacity() of them.
+// Readers must stay far enough behind the write position that the writer
+// can't come around and overwrite what they're reading. While frozen, input
+// is dropped and the ring keeps what it had, for granulating indefinitely.
+class CCaptureRing {
+ public:
+  CCaptureRing(uint16 numChannels, size_t minSamples)
+      : m_numChannels(numChannels) {
+    size_t capacity = 1;
+    while (capacity < minSamples) capacity *= 2;
+    m_mask = capacity - 1;
+    m_data.resize(capacity * numChannels, 0.0f);
+  }
+
+  // called from the capture thread
+  void Write(const float* input, size_t numSamples) {
+    if (m_frozen.load(std::memory_order_relaxed)) return;
+    uint64_t position = m_writePosition.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < numSamples; ++i) {
+      size_t index = size_t((position + i) & m_mask) * m_numChannels;
+      for (uint16 channel = 0; channel < m_numChannels; ++channel)
+        m_data[index + channel] = input[i * m_numChannels + channel];
+    }
+    m_writePosition.store(position + numSamples, std::memory_order_release);
+  }
+
+  void SetFrozen(bool frozen) { m_frozen = frozen; }
+  bool Frozen() const { return m_frozen; }
+
+  // everything before this has been written
+  uint64_t WritePosition() const {
+    return m_writePosition.load(std::memory_order_acquire);
+  }
+
+  uint16 NumChannels() const { return m_numChannels; }
+  size_t Capacity() const { return m_mask + 1; }
+  size_t Mask() const { return m_mask; }
+  const std::vector<float>& Data() const { return m_data; }
+
+ private:
+  uint16 m_numChannels;
+  size_t m_mask = 0;
+  std::vector<float> m_data;
+  std::atomic<uint64_t> m_writePosition{0};
+  std::atomic<bool> m_frozen{false};
+};
+
+// settings of a CRingGranularStage
+struct SRingParams {
+  float m_delaySeconds = 0.1f;         // 0 to the stage's maximum
+  float m_pitchMultiplier = 1.0f;      // 0.25 to 4
+  float m_grainSizeSeconds = 0.05f;    // 0.005 to 0.25
+  float m_crossFadeSeconds = 0.01f;    // 0 to the grain size
+
+  // grains read up to this much further back, at random, so a freeze doesn't
+  // repeat one grain over and over. Counts toward the maximum delay.
+  float m_spreadSeconds = 0.0f;
+
+  EInterpolation m_interpolation = EInterpolation::Cubic;
+};
+
+// Granulates live input from a CCaptureRing: a delay and pitch shifter, and
+// with the ring frozen, a freeze that keeps playing the last moments
+// captured. Grains are planned one at a time like CLiveGranularStage, chasing
+// a read position that is the delay behind the write position, less a grain
+// so the whole grain has been captured before it is splatted. At a pitch of 1
+// that is a clean delay; otherwise grains jump back with a cross fade to keep
+// up, and while frozen the read position stands still, so grains loop around
+// it. The stage has no end. Settings are pushed from any one thread, as often
+// as it likes, and the latest are taken at the next grain, so like
+// CLiveGranularStage's they are heard a buffer plus the rest of a grain later.
+class CRingGranularStage : public CAudioStage {
+ public:
+  CRingGranularStage(const CCaptureRing& ring, uint32 sampleRate,
+                     const SRingParams& params)
+      : m_ring(ring),
+        m_sampleRate(sampleRate),
+        m_window(ring.NumChannels(),
+                 c_pipelineBlockSamples + MaxGrainSamples(),
+                 MaxGrainSamples()) {
+    m_params = Clamp(params);
+  }
+
+  // the ring needs to hold this much to give a stage this much delay (plus
+  // spread): the delay, the grain being read and a few blocks for the writer
+  static size_t RingSamplesNeeded(uint32 sampleRate, float maxDelaySeconds) {
+    return size_t(float(sampleRate) *
+                  (maxDelaySeconds + c_maxGrainSeconds * c_maxPitch)) +
+           c_pipelineBlockSamples * 4;
+  }
+
+  void PushParams(const SRingParams& params) { m_pushed.Write(params); }
+
+  uint16 NumChannels() const override { return m_ring.NumChannels(); }
+  size_t NumSamples() const override { return c_unknownNumSamples; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, c_pipelineBlockSamples);
+
+    size_t blockEnd = m_windowStart + numSamples;
+    while (m_plannedOutput < blockEnd) StartGrain(blockEnd);
+
+    m_window.Take(m_windowStart, output, numSamples);
+    m_windowStart += numSamples;
+    return numSamples;
+  }
+
+ private:
+  static constexpr float c_minPitch = 0.25f;
+  static constexpr float c_maxPitch = 4.0f;
+  static constexpr float c_minGrainSeconds = 0.005f;
+  static constexpr float c_maxGrainSeconds = 0.25f;
+
+  // the longest grain there can be
+  size_t MaxGrainSamples() const {
+    return size_t(float(m_sampleRate) * c_maxGrainSeconds / c_minPitch) + 16;
+  }
+
+  SRingParams Clamp(SRingParams params) const {
+    params.m_pitchMultiplier =
+        std::min(std::max(params.m_pitchMultiplier, c_minPitch), c_maxPitch);
+    params.m_grainSizeSeconds = std::min(
+        std::max(params.m_grainSizeSeconds, c_minGrainSeconds),
+        c_maxGrainSeconds);
+    params.m_crossFadeSeconds =
+        std::min(std::max(params.m_crossFadeSeconds, 0.0f),
+                 params.m_grainSizeSeconds);
+
+    // keep the grain inside what the ring holds, clear of the writer
+    float maxDelaySeconds =
+        float(m_ring.Capacity() - c_pipelineBlockSamples * 4) /
+            float(m_sampleRate) -
+        c_maxGrainSeconds * c_maxPitch;
+    maxDelaySeconds = std::max(maxDelaySeconds, 0.0f);
+    params.m_delaySeconds =
+        std::min(std::max(params.m_delaySeconds, 0.0f), maxDelaySeconds);
+    params.m_spreadSeconds =
+        std::min(std::max(params.m_spreadSeconds, 0.0f),
+                 maxDelaySeconds - params.m_delaySeconds);
+    return params;
+  }
+
+  // blockEnd is the end of the block being pulled, which is taken to be when
+  // the newest input in the ring was captured
+  void StartGrain(size_t blockEnd) {
+    SRingParams params;
+    if (m_pushed.Read(&params)) m_params = Clamp(params);
+
+    uint16 numChannels = m_ring.NumChannels();
+    float pitchMultiplier = m_params.m_pitchMultiplier;
+    size_t grainSize = std::max<size_t>(
+        1, size_t(float(m_sampleRate) * m_params.m_grainSizeSeconds));
+    size_t numGrainSamples =
+        std::max<size_t>(1, size_t(float(grainSize) / pitchMultiplier));
+    size_t crossFadeSize =
+        std::min(size_t(float(m_sampleRate) * m_params.m_crossFadeSeconds),
+                 numGrainSamples);
+
+    // where this grain should read from: the input captured when the grain
+    // starts playing, less the delay. Nothing before the first sample
+    // captured, which reads as silence from the zeroed ring.
+    std::uniform_real_distribution<double> spread(
+        0.0, double(m_params.m_spreadSeconds) * double(m_sampleRate));
+    double behind = double(m_params.m_delaySeconds) * double(m_sampleRate) +
+                    double(grainSize) + spread(m_random) +
+                    double(blockEnd - m_plannedOutput);
+    double target = std::max(double(m_ring.WritePosition()) - behind, 0.0);
+
+    // carry on from the last grain, or jump to where the input should be
+    float* window = m_window.At(m_plannedOutput);
+    size_t available = m_window.MaxGrainSamples();
+    uint64_t grainStart = m_nextInputStart;
+    ECrossFade crossFade = ECrossFade::None;
+    if (std::abs(target - double(m_nextInputStart)) >=
+        double(grainSize) * 0.5) {
+      size_t fadeWritten = SplatGrainToBufferRing(
+          m_ring.Data(), m_ring.Mask(), window, available, numChannels,
+          m_nextInputStart, grainSize, ECrossFade::Out, crossFadeSize,
+          m_lastPitchMultiplier, m_params.m_interpolation);
+      m_window.Splatted(m_plannedOutput, fadeWritten);
+      grainStart = uint64_t(target);
+      crossFade = ECrossFade::In;
+      GRANULAR_COUNT(CrossFades, 1);
+    }
+    size_t written = SplatGrainToBufferRing(
+        m_ring.Data(), m_ring.Mask(), window, available, numChannels,
+        grainStart, grainSize, crossFade, crossFadeSize, pitchMultiplier,
+        m_params.m_interpolation);
+    m_window.Splatted(m_plannedOutput, written);
+    GRANULAR_COUNT(GrainsRendered, 1);
+
+    m_plannedOutput += std::max<size_t>(written, 1);
+    m_nextInputStart = grainStart + grainSize;
+    m_lastPitchMultiplier = pitchMultiplier;
+  }
+
+  const CCaptureRing& m_ring;
+  uint32 m_sampleRate;
+  CTripleBuffer<SRingParams> m_pushed;
+  SRingParams m_params;
+  std::mt19937 m_random;
+
+  uint64_t m_nextInputStart = 0;
+  float m_lastPitchMultiplier = 1.0f;
+
+  CSplatWindow m_window;
+  size_t m_windowStart = 0;
+  size_t m_plannedOutput = 0;
+};
+
+constexpr float CRingGranularStage::c_minPitch;
+constexpr float CRingGranularStage::c_maxPitch;
+constexpr float CRingGranularStage::c_minGrainSeconds;
+constexpr float CRingGranularStage::c_maxGrainSeconds;
+
+// keeps a sliding window of what the stage before has made, for stages that
+// look at a few neighbouring input samples for every output sample
+class CStageHistory {
+ public:
+  explicit CStageHistory(CAudioStage* upstream)
+      : m_upstream(upstream), m_numChannels(upstream->NumChannels()) {}
+
+  // makes sure samples (frames) [first, last] are in the history, as far as
+  // the stage before has them, dropping ones before first that aren't needed
+  // anymore
+  void Fill(size_t first, size_t last) {
+    if (first > m_start + c_pipelineBlockSamples * 4) {
+      size_t drop =
+          std::min(first - m_start, m_samples.size() / m_numChannels);
+      m_samples.erase(m_samples.begin(),
+                      m_samples.begin() + drop * m_numChannels);
+      m_start += drop;
+    }
+
+    while (!m_exhausted && End() <= last) {
+      size_t oldSize = m_samples.size();
+      m_samples.resize(oldSize + c_pipelineBlockSamples * m_numChannels);
+      size_t pulled =
+          m_upstream->Pull(&m_samples[oldSize], c_pipelineBlockSamples);
+      m_samples.resize(oldSize + pulled * m_numChannels);
+      m_exhausted = (pulled == 0);
+    }
+  }
+
+  // one past the last sample (frame) pulled so far
+  size_t End() const { return m_start + m_samples.size() / m_numChannels; }
+
+  // whether the stage before has ended, so End() is how long it was
+  bool Exhausted() const { return m_exhausted; }
+
+  // sample (frame) must be in the range of the last Fill()
+  const float* Frame(size_t sample) const {
+    return &m_samples[(sample - m_start) * m_numChannels];
+  }
+
+  bool Empty() const { return m_samples.empty(); }
+  float Back() const { return m_samples.back(); }
+
+ private:
+  CAudioStage* m_upstream;
+  uint16 m_numChannels;
+  std::vector<float> m_samples;
+  size_t m_start = 0;
+  bool m_exhausted = false;
+};
+
+// TimeAdjust() as a stage. Keeps just enough of the stage before it around to
+// interpolate from, and gives exactly what TimeAdjust() would with the same
+// quality. Where each output sample comes from depends on the total length,
+// so the stage before has to know how long it is.
+class CResampleStage : public CAudioStage {
+ public:
+  CResampleStage(CAudioStage* upstream, float timeMultiplier,
+                 EInterpolation quality = EInterpolation::Cubic)
+      : m_history(upstream),
+        m_numChannels(upstream->NumChannels()),
+        m_quality(quality) {
+    assert(upstream->NumSamples() != c_unknownNumSamples);
+    m_numSrcSamples = upstream->NumSamples();
+    m_numOutSamples =
+        (size_t)(static_cast<float>(m_numSrcSamples) * timeMultiplier);
+  }
+
+  uint16 NumChannels() const override { return m_numChannels; }
+  size_t NumSamples() const override { return m_numOutSamples; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, m_numOutSamples - m_outSample);
+    GRANULAR_COUNT(FramesInterpolated, numSamples);
+
+    switch (m_quality) {
+      case EInterpolation::Nearest:
+        PullQuality<EInterpolation::Nearest>(output, numSamples);
+        break;
+      case EInterpolation::Linear:
+        PullQuality<EInterpolation::Linear>(output, numSamples);
+        break;
+      case EInterpolation::Lagrange6:
+        PullQuality<EInterpolation::Lagrange6>(output, numSamples);
+        break;
+      case EInterpolation::Sinc:
+        PullQuality<EInterpolation::Sinc>(output, numSamples);
+        break;
+      default:
+        PullQuality<EInterpolation::Cubic>(output, numSamples);
+        break;
+    }
+    m_outSample += numSamples;
+    return numSamples;
+  }
+
+ private:
+  // interpolates a block of frames at a time like TimeAdjustRange(), with the
+  // points gathered from the history
+  template <EInterpolation QUALITY>
+  void PullQuality(float* output, size_t numSamples) {
+    typedef SInterpolationKernel<QUALITY> Kernel;
+    float positions[c_interpolationBlockSize];
+    float t[c_interpolationBlockSize];
+    float points[Kernel::c_numPoints][c_interpolationBlockSize];
+    float values[c_interpolationBlockSize];
+
+    for (size_t blockStart = 0; blockStart < numSamples;
+         blockStart += c_interpolationBlockSize) {
+      size_t numFrames =
+          std::min(c_interpolationBlockSize, numSamples - blockStart);
+      for (size_t i = 0; i < numFrames; ++i) {
+        float percent = static_cast<float>(m_outSample + blockStart + i) /
+                        static_cast<float>(m_numOutSamples - 1);
+        positions[i] = static_cast<float>(m_numSrcSamples) * percent;
+        t[i] = positions[i] - std::floor(positions[i]);
+      }
+
+      // everything the block's points read, clamped to the input
+      int64_t first = int64_t(positions[0]) + Kernel::c_firstPoint;
+      int64_t last = int64_t(positions[numFrames - 1]) +
+                     Kernel::c_firstPoint + Kernel::c_numPoints - 1;
+      m_history.Fill(size_t(std::max<int64_t>(first, 0)),
+                     std::min(size_t(std::max<int64_t>(last, 0)),
+                              m_numSrcSamples - 1));
+
+      float* outFrames = &output[blockStart * m_numChannels];
+      for (uint16 channel = 0; channel < m_numChannels; ++channel) {
+        for (size_t i = 0; i < numFrames; ++i) {
+          int64_t sample = int64_t(positions[i]) + Kernel::c_firstPoint;
+          for (int point = 0; point < Kernel::c_numPoints; ++point)
+            points[point][i] = Value(sample + point, channel);
+        }
+        Kernel::Interpolate(points, t, values, numFrames);
+        for (size_t i = 0; i < numFrames; ++i)
+          outFrames[i * m_numChannels + channel] = values[i];
+      }
+    }
+  }
+
+  // a sample of the stage before this one, clamped the same way GatherBlock()
+  // clamps: before the start is the first sample, past the end is the very
+  // last value.
+  float Value(int64_t sample, uint16 channel) const {
+    if (m_history.Empty()) return 0.0f;
+    if (sample < 0) sample = 0;
+    if (size_t(sample) >= m_numSrcSamples) return m_history.Back();
+    return m_history.Frame(size_t(sample))[channel];
+  }
+
+  CStageHistory m_history;
+  uint16 m_numChannels;
+  EInterpolation m_quality;
+  size_t m_numSrcSamples = 0;
+  size_t m_numOutSamples = 0;
+  size_t m_outSample = 0;
+};
+
+// dot product of a filter with one channel of interleaved samples
+GRANULAR_MULTIVERSION
+float FilterChannel(const float* samples, size_t stride, const float* filter,
+                    size_t numTaps) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < numTaps; ++i) sum += samples[i * stride] * filter[i];
+  return sum;
+}
+
+// Converts from one sample rate to another with a polyphase windowed sinc
+// filter (Kaiser window, 64 taps, about 90dB of stop band rejection). The
+// rates are reduced to a ratio L/M; output sample n is made from the input
+// around n * M / L using the filter phase for the fractional part. Up to
+// c_maxPhases phases are tabulated, which is exact for common rate pairs like
+// 44100 <-> 48000 (L = 160 or 147) and rounds the phase for odd ones. Also
+// works after stages that only find out how long they are when they end.
+class CSampleRateStage : public CAudioStage {
+ public:
+  static const size_t c_halfTaps = 32;
+  static const size_t c_numTaps = c_halfTaps * 2;
+  static const uint64_t c_maxPhases = 4096;
+
+  CSampleRateStage(CAudioStage* upstream, uint32 inputSampleRate,
+                   uint32 outputSampleRate)
+      : m_history(upstream), m_numChannels(upstream->NumChannels()) {
+    uint64_t divisor = inputSampleRate;
+    for (uint64_t b = outputSampleRate; b != 0;) {
+      uint64_t t = divisor % b;
+      divisor = b;
+      b = t;
+    }
+    m_upFactor = outputSampleRate / divisor;
+    m_downFactor = inputSampleRate / divisor;
+    m_numPhases = std::min(m_upFactor, c_maxPhases);
+
+    m_numSrcSamples = upstream->NumSamples();
+    if (m_numSrcSamples != c_unknownNumSamples)
+      m_numOutSamples =
+          size_t(uint64_t(m_numSrcSamples) * m_upFactor / m_downFactor);
+
+    // when going down in rate, the filter has to cut at the new nyquist
+    // instead of the old one. Leave a little room for the transition band.
+    double cutoff = 0.95 * std::min(1.0, double(m_upFactor) / m_downFactor);
+    const double beta = 9.0;
+    m_filters.resize(size_t(m_numPhases) * c_numTaps);
+    for (uint64_t phase = 0; phase < m_numPhases; ++phase) {
+      double fraction = double(phase) / double(m_numPhases);
+      double sum = 0.0;
+      float* filter = &m_filters[size_t(phase) * c_numTaps];
+      for (size_t tap = 0; tap < c_numTaps; ++tap) {
+        // distance from the output position to this input sample
+        double x = double(tap) - double(c_halfTaps - 1) - fraction;
+        double window = x / double(c_halfTaps);
+        window = (std::fabs(window) >= 1.0)
+                     ? 0.0
+                     : BesselI0(beta * std::sqrt(1.0 - window * window)) /
+                           BesselI0(beta);
+        double sinc = (x == 0.0) ? 1.0
+                                 : std::sin(double(c_pi) * cutoff * x) /
+                                       (double(c_pi) * cutoff * x);
+        filter[tap] = float(sinc * window);
+        sum += sinc * window;
+      }
+
+      // normalize each phase to unity gain at DC so there is no ripple from
+      // phase to phase
+      for (size_t tap = 0; tap < c_numTaps; ++tap)
+        filter[tap] = float(filter[tap] / sum);
+    }
+  }
+
+  uint16 NumChannels() const override { return m_numChannels; }
+  size_t NumSamples() const override { return m_numOutSamples; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, m_numOutSamples - m_outSample);
+    GRANULAR_COUNT(FramesInterpolated, numSamples);
+
+    for (size_t i = 0; i < numSamples; ++i, ++m_outSample) {
+      const float* filter =
+          &m_filters[size_t(m_position * m_numPhases / m_upFactor) * c_numTaps];
+
+      // the filter covers input samples [first, first + c_numTaps)
+      int64_t first = int64_t(m_inputSample) - int64_t(c_halfTaps - 1);
+      size_t firstClamped = size_t(std::max<int64_t>(first, 0));
+      size_t last = m_inputSample + c_halfTaps;
+      m_history.Fill(firstClamped, std::min(last, m_numSrcSamples - 1));
+
+      // find out how long the input was once it runs out
+      if (m_numSrcSamples == c_unknownNumSamples && m_history.Exhausted()) {
+        m_numSrcSamples = m_history.End();
+        m_numOutSamples =
+            size_t(uint64_t(m_numSrcSamples) * m_upFactor / m_downFactor);
+      }
+      if (m_outSample >= m_numOutSamples) return i;
+
+      float* outFrame = &output[i * m_numChannels];
+      if (first >= 0 && last < m_numSrcSamples) {
+        const float* samples = m_history.Frame(size_t(first));
+        for (uint16 channel = 0; channel < m_numChannels; ++channel)
+          outFrame[channel] = FilterChannel(samples + channel, m_numChannels,
+                                            filter, c_numTaps);
+      } else {
+        // near the start or end, treat the input past either end as silence
+        for (uint16 channel = 0; channel < m_numChannels; ++channel) {
+          float sum = 0.0f;
+          for (size_t tap = 0; tap < c_numTaps; ++tap) {
+            int64_t sample = first + int64_t(tap);
+            if (sample >= 0 && size_t(sample) < m_numSrcSamples)
+              sum += m_history.Frame(size_t(sample))[channel] * filter[tap];
+          }
+          outFrame[channel] = sum;
+        }
+      }
+
+      // step forward M/L input samples
+      m_position += m_downFactor;
+      m_inputSample += size_t(m_position / m_upFactor);
+      m_position %= m_upFactor;
+    }
+    return numSamples;
+  }
+
+ private:
+  // zeroth order modified bessel function of the first kind, for the window
+  static double BesselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+    }
+    return sum;
+  }
+
+  CStageHistory m_history;
+  uint16 m_numChannels;
+  uint64_t m_upFactor = 1;
+  uint64_t m_downFactor = 1;
+  uint64_t m_numPhases = 1;
+  std::vector<float> m_filters;
+  size_t m_numSrcSamples = 0;
+  size_t m_numOutSamples = c_unknownNumSamples;
+  size_t m_outSample = 0;
+
+  // where the next output sample is in the input: m_inputSample plus
+  // m_position / m_upFactor
+  size_t m_inputSample = 0;
+  uint64_t m_position = 0;
+};
+
+const size_t CSampleRateStage::c_halfTaps;
+const size_t CSampleRateStage::c_numTaps;
+const uint64_t CSampleRateStage::c_maxPhases;
+
+// multiplies the stage before it by a constant
+class CGainStage : public CAudioStage {
+ public:
+  CGainStage(CAudioStage* upstream, float gain)
+      : m_upstream(upstream), m_gain(gain) {}
+
+  uint16 NumChannels() const override { return m_upstream->NumChannels(); }
+  size_t NumSamples() const override { return m_upstream->NumSamples(); }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = m_upstream->Pull(output, numSamples);
+    size_t numValues = numSamples * NumChannels();
+    for (size_t i = 0; i < numValues; ++i) output[i] *= m_gain;
+    return numSamples;
+  }
+
+ private:
+  CAudioStage* m_upstream;
+  float m_gain;
+};
+
+// owns a chain of stages. Each stage added becomes the new end of the chain.
+class CPipeline {
+ public:
+  template <typename T>
+  T* Add(T* stage) {
+    m_stages.push_back(std::unique_ptr<CAudioStage>(stage));
+    return stage;
+  }
+
+  CAudioStage* Last() const {
+    return m_stages.empty() ? nullptr : m_stages.back().get();
+  }
+
+ private:
+  std::vector<std::unique_ptr<CAudioStage>> m_stages;
+};
+
+// pulls everything a stage makes into a buffer
+void DrainStage(CAudioStage* stage, std::vector<float>* out) {
+  uint16 numChannels = stage->NumChannels();
+  out->clear();
+  if (stage->NumSamples() != c_unknownNumSamples)
+    out->reserve(stage->NumSamples() * numChannels);
+  size_t size = 0;
+  while (true) {
+    out->resize(size + c_pipelineBlockSamples * numChannels);
+    size_t numSamples = stage->Pull(&(*out)[size], c_pipelineBlockSamples);
+    size += numSamples * numChannels;
+    if (numSamples == 0) break;
+  }
+  out->resize(size);
+}
+
+// Granular cloud synthesis. Rather than playing the source back in order, a
+// scheduler starts grains at random times (a Poisson process of the given
+// density), each reading from a random place in the source at a random pitch,
+// duration and pan. The parameters are the center and spread of each of those.
+struct SGrainCloudParams {
+  float m_position = 0.5f;          // where grains read, 0 to 1 of the source
+  float m_positionSpread = 0.1f;    // +/- that much of the source
+  float m_pitch = 1.0f;             // playback speed multiplier
+  float m_pitchSpread = 0.0f;       // +/- semitones
+  float m_durationSeconds = 0.1f;   // grain length
+  float m_durationSpread = 0.5f;    // +/- that fraction of the length
+  float m_pan = 0.0f;               // -1 is left, 1 is right
+  float m_panSpread = 1.0f;         // +/- that much
+  float m_density = 100.0f;         // grains started per second, on average
+  float m_gain = 1.0f;
+  EGrainWindow m_window = EGrainWindow::Hann;
+  EInterpolation m_quality = EInterpolation::Cubic;
+};
+
+// the most samples a cloud source is padded with on either side, so kernels
+// can read their points around any position in it without clamping
+const size_t c_cloudSourcePadding = 16;
+
+// interpolates a grain from the source with the QUALITY kernel, a block at a
+// time, and windows it from a table. source must be padded, see
+// c_cloudSourcePadding. Gathering the points is scalar, since the reads are
+// scattered; the kernel and the mixing below are what vectorize.
+template <EInterpolation QUALITY>
+void RenderCloudVoice(const float* source, float offset, float step,
+                      const float* window, float windowPhase,
+                      float windowStep, float* grain, size_t numSamples) {
+  typedef SInterpolationKernel<QUALITY> Kernel;
+  float points[Kernel::c_numPoints][c_interpolationBlockSize];
+  float t[c_interpolationBlockSize];
+  float gain[c_interpolationBlockSize];
+  for (size_t start = 0; start < numSamples;
+       start += c_interpolationBlockSize) {
+    int32 count = int32(std::min(c_interpolationBlockSize, numSamples - start));
+    float first = float(int32(start));
+    for (int32 i = 0; i < count; ++i) {
+      float position = offset + (first + float(i)) * step;
+      int32 index = int32(position);
+      t[i] = position - float(index);
+      gain[i] = window[int32(windowPhase + (first + float(i)) * windowStep)];
+      const float* frame = &source[index + Kernel::c_firstPoint];
+      for (int point = 0; point < Kernel::c_numPoints; ++point)
+        points[point][i] = frame[point];
+    }
+    float* out = &grain[start];
+    Kernel::Interpolate(points, t, out, size_t(count));
+    for (int32 i = 0; i < count; ++i) out[i] *= gain[i];
+  }
+}
+
+// pans a mono grain into interleaved stereo output
+GRANULAR_MULTIVERSION
+void MixCloudVoice(const float* grain, float gainLeft, float gainRight,
+                   float* output, size_t numSamples) {
+  for (size_t i = 0; i < numSamples; ++i) {
+    output[i * 2 + 0] += grain[i] * gainLeft;
+    output[i * 2 + 1] += grain[i] * gainRight;
+  }
+}
+
+// Plays a cloud of grains from a source as a stereo pipeline stage. Voices
+// come from a fixed pool, with their state kept as arrays of each field so
+// that starting, rendering and retiring them touches only what it needs.
+// Grains read a mono mix of the source. When every voice is busy, new grains
+// are dropped. The same seed and parameters make the same output.
+class CGrainCloud : public CAudioStage {
+ public:
+  static const size_t c_maxVoices = 4096;
+
+  // numSamples is how long the cloud plays for, or c_unknownNumSamples to
+  // play until it is no longer pulled
+  CGrainCloud(const std::vector<float>& input, uint16 numChannels,
+              uint32 sampleRate, size_t numSamples, uint32 seed = 0)
+      : m_sampleRate(sampleRate), m_numSamples(numSamples), m_random(seed) {
+    // the mono mix, padded with silence for the interpolation to read around
+    // the ends
+    m_numSourceSamples = input.size() / numChannels;
+    m_source.resize(m_numSourceSamples + 2 * c_cloudSourcePadding, 0.0f);
+    for (size_t i = 0; i < m_numSourceSamples; ++i) {
+      float sum = 0.0f;
+      for (uint16 channel = 0; channel < numChannels; ++channel)
+        sum += input[i * numChannels + channel];
+      m_source[c_cloudSourcePadding + i] = sum / float(numChannels);
+    }
+
+    m_base.resize(c_maxVoices);
+    m_offset.resize(c_maxVoices);
+    m_step.resize(c_maxVoices);
+    m_windowPhase.resize(c_maxVoices);
+    m_windowStep.resize(c_maxVoices);
+    m_remaining.resize(c_maxVoices);
+    m_delay.resize(c_maxVoices);
+    m_gainLeft.resize(c_maxVoices);
+    m_gainRight.resize(c_maxVoices);
+    m_grain.resize(c_pipelineBlockSamples);
+
+    SetParams(SGrainCloudParams());
+  }
+
+  // takes effect for grains started from now on
+  void SetParams(const SGrainCloudParams& params) {
+    m_params = params;
+    m_params.m_density = std::max(params.m_density, 0.0f);
+    m_params.m_durationSpread =
+        std::min(std::max(params.m_durationSpread, 0.0f), 1.0f);
+    m_window = &GrainWindowTable(params.m_window);
+
+    // grains that don't line up add up by power, so scale each one by the
+    // square root of how many overlap on average, to keep the loudness about
+    // the same whatever the density
+    float overlap = m_params.m_density * m_params.m_durationSeconds;
+    m_grainGain = m_params.m_gain / std::sqrt(std::max(overlap, 1.0f));
+  }
+
+  const SGrainCloudParams& Params() const { return m_params; }
+
+  size_t NumActiveVoices() const { return m_numVoices; }
+  size_t NumDroppedGrains() const { return m_numDropped; }
+
+  uint16 NumChannels() const override { return 2; }
+  size_t NumSamples() const override { return m_numSamples; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    numSamples = std::min(numSamples, c_pipelineBlockSamples);
+    if (m_numSamples != c_unknownNumSamples)
+      numSamples = std::min(numSamples, m_numSamples - m_position);
+    if (numSamples == 0) return 0;
+    memset(output, 0, numSamples * 2 * sizeof(float));
+
+    // start the grains due in this block, a few samples into it
+    while (m_nextOnset < double(numSamples)) {
+      StartGrain(size_t(m_nextOnset));
+      m_nextOnset += NextInterval();
+    }
+    m_nextOnset -= double(numSamples);
+
+    // the quality is picked once per block for every voice
+    switch (m_params.m_quality) {
+      case EInterpolation::Nearest:
+        RenderVoices<EInterpolation::Nearest>(output, numSamples);
+        break;
+      case EInterpolation::Linear:
+        RenderVoices<EInterpolation::Linear>(output, numSamples);
+        break;
+      case EInterpolation::Lagrange6:
+        RenderVoices<EInterpolation::Lagrange6>(output, numSamples);
+        break;
+      case EInterpolation::Sinc:
+        RenderVoices<EInterpolation::Sinc>(output, numSamples);
+        break;
+      default:
+        RenderVoices<EInterpolation::Cubic>(output, numSamples);
+        break;
+    }
+
+    m_position += numSamples;
+    return numSamples;
+  }
+
+ private:
+  // renders every voice into a block, retiring the ones that finish by moving
+  // the last voice into their place
+  template <EInterpolation QUALITY>
+  void RenderVoices(float* output, size_t numSamples) {
+    const float* window = m_window->data();
+    for (size_t voice = 0; voice < m_numVoices;) {
+      size_t delay = m_delay[voice];
+      size_t count = std::min(numSamples - delay, m_remaining[voice]);
+      RenderCloudVoice<QUALITY>(&m_source[m_base[voice]], m_offset[voice],
+                                m_step[voice], window, m_windowPhase[voice],
+                                m_windowStep[voice], m_grain.data(), count);
+      MixCloudVoice(m_grain.data(), m_gainLeft[voice], m_gainRight[voice],
+                    &output[delay * 2], count);
+      GRANULAR_COUNT(FramesInterpolated, count);
+      m_remaining[voice] -= count;
+      if (m_remaining[voice] == 0) {
+        RetireVoice(voice);
+        continue;
+      }
+      m_offset[voice] += float(count) * m_step[voice];
+      m_windowPhase[voice] += float(count) * m_windowStep[voice];
+      m_delay[voice] = 0;
+      ++voice;
+    }
+  }
+
+  float Uniform(float center, float spread) {
+    std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    return center + spread * distribution(m_random);
+  }
+
+  // time to the next grain in samples, exponentially distributed
+  double NextInterval() {
+    if (m_params.m_density <= 0.0f) return INFINITY;
+    float meanInterval = float(m_sampleRate) / m_params.m_density;
+    return std::exponential_distribution<double>(1.0 / meanInterval)(m_random);
+  }
+
+  void StartGrain(size_t delay) {
+    if (m_numVoices == c_maxVoices) {
+      ++m_numDropped;
+      GRANULAR_COUNT(GrainsSkipped, 1);
+      return;
+    }
+
+    size_t numSourceSamples = m_numSourceSamples;
+    if (numSourceSamples < 2) return;
+    float pitch = m_params.m_pitch *
+                  std::exp2(Uniform(0.0f, m_params.m_pitchSpread) / 12.0f);
+    float duration =
+        Uniform(m_params.m_durationSeconds,
+                m_params.m_durationSeconds * m_params.m_durationSpread);
+    size_t numSamples =
+        std::max<size_t>(size_t(duration * float(m_sampleRate)), 16);
+
+    // shorten grains that would read past the end of the source
+    float maxSamples = float(numSourceSamples - 1) / pitch;
+    numSamples = std::min(numSamples, size_t(maxSamples));
+    if (numSamples == 0) return;
+    float span = float(numSamples) * pitch;
+
+    // the grain is centered on its position, kept inside the source
+    float center = Uniform(m_params.m_position, m_params.m_positionSpread) *
+                   float(numSourceSamples);
+    float start = std::min(std::max(center - span * 0.5f, 0.0f),
+                           float(numSourceSamples - 1) - span);
+    start = std::max(start, 0.0f);
+
+    // equal power pan
+    float pan = std::min(std::max(Uniform(m_params.m_pan, m_params.m_panSpread),
+                                  -1.0f), 1.0f);
+    float angle = (pan + 1.0f) * c_pi * 0.25f;
+
+    size_t voice = m_numVoices++;
+    m_base[voice] = size_t(start);
+    m_offset[voice] = start - float(m_base[voice]);
+    m_base[voice] += c_cloudSourcePadding;
+    m_step[voice] = pitch;
+    m_windowPhase[voice] = 0.0f;
+    m_windowStep[voice] = float(c_grainWindowTableSize) / float(numSamples);
+    m_remaining[voice] = numSamples;
+    m_delay[voice] = delay;
+    m_gainLeft[voice] = std::cos(angle) * m_grainGain;
+    m_gainRight[voice] = std::sin(angle) * m_grainGain;
+    GRANULAR_COUNT(GrainsRendered, 1);
+  }
+
+  void RetireVoice(size_t voice) {
+    size_t last = --m_numVoices;
+    m_base[voice] = m_base[last];
+    m_offset[voice] = m_offset[last];
+    m_step[voice] = m_step[last];
+    m_windowPhase[voice] = m_windowPhase[last];
+    m_windowStep[voice] = m_windowStep[last];
+    m_remaining[voice] = m_remaining[last];
+    m_delay[voice] = m_delay[last];
+    m_gainLeft[voice] = m_gainLeft[last];
+    m_gainRight[voice] = m_gainRight[last];
+  }
+
+  std::vector<float> m_source;  // with c_cloudSourcePadding on either side
+  size_t m_numSourceSamples;
+  uint32 m_sampleRate;
+  size_t m_numSamples;
+  size_t m_position = 0;
+
+  SGrainCloudParams m_params;
+  const std::vector<float>* m_window = nullptr;
+  float m_grainGain = 1.0f;
+  std::mt19937 m_random;
+  double m_nextOnset = 0.0;
+  size_t m_numDropped = 0;
+
+  // the voice pool. Voices [0, m_numVoices) are playing.
+  size_t m_numVoices = 0;
+  std::vector<size_t> m_base;         // source sample the grain reads from
+  std::vector<float> m_offset;        // read position past m_base
+  std::vector<float> m_step;          // pitch
+  std::vector<float> m_windowPhase;   // position in the window table
+  std::vector<float> m_windowStep;
+  std::vector<size_t> m_remaining;    // samples left to play
+  std::vector<size_t> m_delay;        // samples into the block it starts at
+  std::vector<float> m_gainLeft;
+  std::vector<float> m_gainRight;
+
+  // one voice's samples for the block, before panning
+  std::vector<float> m_grain;
+};
+
+const size_t CGrainCloud::c_maxVoices;
+
+// Reads a file on a background thread, a chunk ahead of whoever is consuming
+// it, so parsing and rendering overlap with waiting on the disk or the pipe.
+// Works on anything fread can read, including stdin and pipes.
+class CReadAheadFile {
+ public:
+  // takes ownership of file
+  explicit CReadAheadFile(FILE* file, size_t chunkSize = 1 << 16,
+                          size_t maxChunks = 16)
+      : m_file(file), m_chunkSize(chunkSize), m_maxChunks(maxChunks) {
+    m_thread = std::thread(&CReadAheadFile::ReadThread, this);
+  }
+
+  // NOTE: if the read thread is blocked on a pipe, this waits for the writer
+  // on the other end to send more data or close it.
+  ~CReadAheadFile() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+    CloseFile(m_file);
+  }
+
+  // reads up to size bytes, waiting for them if needed. Less than size means
+  // the end of the file was reached. dest can be null to skip bytes.
+  size_t Read(void* dest, size_t size) {
+    unsigned char* out = static_cast<unsigned char*>(dest);
+    size_t total = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (total < size) {
+      m_changed.wait(lock, [this] { return !m_chunks.empty() || m_eof; });
+      if (m_chunks.empty()) break;
+
+      std::vector<unsigned char>& chunk = m_chunks.front();
+      size_t count = std::min(size - total, chunk.size() - m_frontOffset);
+      if (out) memcpy(&out[total], &chunk[m_frontOffset], count);
+      total += count;
+      m_frontOffset += count;
+      if (m_frontOffset == chunk.size()) {
+        m_chunks.pop_front();
+        m_frontOffset = 0;
+        m_changed.notify_all();
+      }
+    }
+    return total;
+  }
+
+  // copies up to size bytes from the front without consuming them, waiting
+  // for them if needed
+  size_t Peek(void* dest, size_t size) {
+    unsigned char* out = static_cast<unsigned char*>(dest);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this, size] {
+      size_t available = 0;
+      for (const std::vector<unsigned char>& chunk : m_chunks)
+        available += chunk.size();
+      return available - m_frontOffset >= size || m_eof ||
+             m_chunks.size() >= m_maxChunks;
+    });
+
+    size_t total = 0;
+    size_t offset = m_frontOffset;
+    for (const std::vector<unsigned char>& chunk : m_chunks) {
+      size_t count = std::min(size - total, chunk.size() - offset);
+      memcpy(&out[total], &chunk[offset], count);
+      total += count;
+      offset = 0;
+      if (total == size) break;
+    }
+    return total;
+  }
+
+ private:
+  void ReadThread() {
+    while (true) {
+      std::vector<unsigned char> chunk(m_chunkSize);
+      size_t count = fread(&chunk[0], 1, m_chunkSize, m_file);
+      chunk.resize(count);
+      GRANULAR_COUNT(BytesRead, count);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (count > 0) {
+        m_changed.wait(lock, [this] {
+          return m_quit || m_chunks.size() < m_maxChunks;
+        });
+        m_chunks.push_back(std::move(chunk));
+      }
+      if (count < m_chunkSize || m_quit) {
+        m_eof = true;
+        m_changed.notify_all();
+        return;
+      }
+      m_changed.notify_all();
+    }
+  }
+
+  FILE* m_file;
+  size_t m_chunkSize;
+  size_t m_maxChunks;
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::deque<std::vector<unsigned char>> m_chunks;
+  size_t m_frontOffset = 0;
+  bool m_eof = false;
+  bool m_quit = false;
+};
+
+// the first stage of a pipeline that decodes a file. Knows the format the
+// file was in, to write the output in the same one.
+class CInputStage : public CAudioStage {
+ public:
+  virtual uint32 SampleRate() const = 0;
+  virtual uint16 NumBytes() const = 0;
+
+  // true, once Pull() has returned 0, if the input ended in a broken frame
+  // rather than at its end
+  virtual bool Failed() const { return false; }
+};
+
+// Decodes a wave file as it is read, as the first stage of a pipeline, so
+// output can start before the input has finished arriving. The RIFF chunks
+// are parsed in a single forward pass, so it works on stdin ("-") and pipes.
+// Streaming writers put placeholder sizes in the header because they don't
+// know them up front, so a data chunk with a size of 0 or 0xFFFFFFFF is read
+// until the end of the input, and NumSamples() is c_unknownNumSamples. RF64
+// and BW64 files get their sizes from ds64.
+class CWaveStreamStage : public CInputStage {
+ public:
+  bool Open(const char* fileName) {
+    FILE* file = OpenFile(fileName, "rb");
+    if (!file) {
+      printf("[-----ERROR-----]Could not open %s for reading.\n", fileName);
+      return false;
+    }
+    return Open(std::unique_ptr<CReadAheadFile>(new CReadAheadFile(file)),
+                fileName);
+  }
+
+  bool Open(std::unique_ptr<CReadAheadFile> reader, const char* fileName) {
+    m_reader = std::move(reader);
+
+    // the main chunk
+    unsigned char riff[12];
+    if (m_reader->Read(riff, 12) != 12 ||
+        (memcmp(riff, "RIFF", 4) && memcmp(riff, "RF64", 4) &&
+         memcmp(riff, "BW64", 4)) ||
+        memcmp(&riff[8], "WAVE", 4)) {
+      printf("[-----ERROR-----]%s is an invalid input file. (1)\n", fileName);
+      return false;
+    }
+    bool rf64 = memcmp(riff, "RIFF", 4) != 0;
+
+    // walk the chunks until the data chunk, which has to come after fmt
+    SMinimalWaveFileHeader waveData;
+    bool foundFmt = false;
+    uint64_t ds64DataSize = 0;
+    while (true) {
+      unsigned char chunkHeader[8];
+      if (m_reader->Read(chunkHeader, 8) != 8) {
+        printf("[-----ERROR-----]%s is an invalid input file. (4)\n",
+               fileName);
+        return false;
+      }
+      uint32 chunkSize;
+      memcpy(&chunkSize, &chunkHeader[4], 4);
+
+      if (!memcmp(chunkHeader, "fmt ", 4)) {
+        if (chunkSize < 16) {
+          printf("[-----ERROR-----]%s is an invalid input file. (5)\n",
+                 fileName);
+          return false;
+        }
+        memcpy(&waveData.m_subChunk1ID, chunkHeader, 8);
+        if (m_reader->Read(&waveData.m_audioFormat, 16) != 16) {
+          printf("[-----ERROR-----]%s is an invalid input file. (5)\n",
+                 fileName);
+          return false;
+        }
+        m_reader->Read(nullptr, chunkSize - 16 + (chunkSize & 1));
+        foundFmt = true;
+        continue;
+      }
+
+      if (!memcmp(chunkHeader, "data", 4)) {
+        if (!foundFmt) {
+          printf("[-----ERROR-----]%s is an invalid input file. (6)\n",
+                 fileName);
+          return false;
+        }
+        m_dataSize = chunkSize;
+        if (rf64 && chunkSize == 0xFFFFFFFF) m_dataSize = ds64DataSize;
+        break;
+      }
+
+      // RF64 has the real data size in ds64
+      if (rf64 && !memcmp(chunkHeader, "ds64", 4) && chunkSize >= 28) {
+        unsigned char ds64[16];
+        m_reader->Read(ds64, 16);
+        memcpy(&ds64DataSize, &ds64[8], 8);
+        m_reader->Read(nullptr, size_t(chunkSize) - 16 + (chunkSize & 1));
+        continue;
+      }
+
+      // skip any other chunk, along with its pad byte
+      m_reader->Read(nullptr, size_t(chunkSize) + (chunkSize & 1));
+    }
+
+    // verify a couple things about the file data
+    if (waveData.m_audioFormat != 1 ||        // only pcm data
+        waveData.m_numChannels < 1 ||         // must have a channel
+        waveData.m_numChannels > 2 ||         // must not have more than 2
+        waveData.m_bitsPerSample > 32 ||      // 32 bits per sample max
+        waveData.m_bitsPerSample % 8 != 0 ||  // must be a multiple of 8 bites
+        waveData.m_blockAlign > 8) {          // blocks must be 8 bytes or lower
+      printf("[-----ERROR-----]%s is an invalid input file. (7)\n", fileName);
+      return false;
+    }
+
+    m_numChannels = waveData.m_numChannels;
+    m_sampleRate = waveData.m_sampleRate;
+    m_numBytes = waveData.m_bitsPerSample / 8;
+    if (m_dataSize == 0 || (!rf64 && m_dataSize == 0xFFFFFFFF))
+      m_numSamples = c_unknownNumSamples;
+    else
+      m_numSamples = size_t(m_dataSize / waveData.m_blockAlign);
+    return true;
+  }
+
+  uint16 NumChannels() const override { return m_numChannels; }
+  size_t NumSamples() const override { return m_numSamples; }
+  uint32 SampleRate() const override { return m_sampleRate; }
+  uint16 NumBytes() const override { return m_numBytes; }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    if (m_numSamples != c_unknownNumSamples)
+      numSamples = std::min(numSamples, m_numSamples - m_position);
+
+    size_t frameBytes = size_t(m_numBytes) * m_numChannels;
+    m_buffer.resize(numSamples * frameBytes);
+    size_t numRead =
+        m_reader->Read(m_buffer.data(), m_buffer.size()) / frameBytes;
+
+    for (size_t i = 0; i < numRead * m_numChannels; ++i)
+      PCMToFloat(&output[i], &m_buffer[i * m_numBytes], m_numBytes);
+    m_position += numRead;
+    return numRead;
+  }
+
+ private:
+  std::unique_ptr<CReadAheadFile> m_reader;
+  std::vector<unsigned char> m_buffer;
+  uint16 m_numChannels = 0;
+  uint32 m_sampleRate = 0;
+  uint16 m_numBytes = 0;
+  uint64_t m_dataSize = 0;
+  size_t m_numSamples = 0;
+  size_t m_position = 0;
+};
+
+// decodes a FLAC file as it is read, a frame at a time
+class CFlacStreamStage : public CInputStage {
+ public:
+  bool Open(std::unique_ptr<CReadAheadFile> reader, const char* fileName) {
+    m_reader = std::move(reader);
+    CReadAheadFile* file = m_reader.get();
+    m_decoder.reset(new CFlacDecoder(
+        [file](unsigned char* dest, size_t size) {
+          return file->Read(dest, size);
+        }));
+    return m_decoder->ReadHeader(fileName);
+  }
+
+  uint16 NumChannels() const override { return m_decoder->NumChannels(); }
+  size_t NumSamples() const override {
+    return m_decoder->NumSamples() ? size_t(m_decoder->NumSamples())
+                                   : c_unknownNumSamples;
+  }
+  uint32 SampleRate() const override { return m_decoder->SampleRate(); }
+  uint16 NumBytes() const override { return m_decoder->NumBytes(); }
+  bool Failed() const override { return m_decoder->Failed(); }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    uint16 numChannels = NumChannels();
+    size_t written = 0;
+    while (written < numSamples) {
+      // decode another frame once the last one is used up
+      if (m_frameOffset == m_frame.size()) {
+        m_frame.clear();
+        m_frameOffset = 0;
+        if (m_decoder->DecodeFrame(&m_frame) == 0) break;
+      }
+      size_t count = std::min(numSamples - written,
+                              (m_frame.size() - m_frameOffset) / numChannels);
+      memcpy(&output[written * numChannels], &m_frame[m_frameOffset],
+             count * numChannels * sizeof(float));
+      m_frameOffset += count * numChannels;
+      written += count;
+    }
+    return written;
+  }
+
+ private:
+  std::unique_ptr<CReadAheadFile> m_reader;
+  std::unique_ptr<CFlacDecoder> m_decoder;
+  std::vector<float> m_frame;
+  size_t m_frameOffset = 0;
+};
+
+// Pulls another stage on a background thread, up to maxBlocks blocks ahead
+// of whoever is consuming it. Used to decode compressed input on its own
+// thread while the rest of the pipeline renders.
+class CDecodeAheadStage : public CInputStage {
+ public:
+  explicit CDecodeAheadStage(std::unique_ptr<CInputStage> source,
+                             size_t maxBlocks = 16)
+      : m_source(std::move(source)), m_maxBlocks(maxBlocks) {
+    m_thread = std::thread(&CDecodeAheadStage::DecodeThread, this);
+  }
+
+  ~CDecodeAheadStage() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_changed.notify_all();
+    m_thread.join();
+  }
+
+  uint16 NumChannels() const override { return m_source->NumChannels(); }
+  size_t NumSamples() const override { return m_source->NumSamples(); }
+  uint32 SampleRate() const override { return m_source->SampleRate(); }
+  uint16 NumBytes() const override { return m_source->NumBytes(); }
+  bool Failed() const override {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_done && m_source->Failed();
+  }
+
+  size_t Pull(float* output, size_t numSamples) override {
+    uint16 numChannels = NumChannels();
+    size_t written = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (written < numSamples) {
+      m_changed.wait(lock, [this] { return !m_blocks.empty() || m_done; });
+      if (m_blocks.empty()) break;
+
+      std::vector<float>& block = m_blocks.front();
+      size_t count = std::min(numSamples - written,
+                              (block.size() - m_frontOffset) / numChannels);
+      memcpy(&output[written * numChannels], &block[m_frontOffset],
+             count * numChannels * sizeof(float));
+      written += count;
+      m_frontOffset += count * numChannels;
+      if (m_frontOffset == block.size()) {
+        m_blocks.pop_front();
+        m_frontOffset = 0;
+        m_changed.notify_all();
+      }
+    }
+    return written;
+  }
+
+ private:
+  void DecodeThread() {
+    uint16 numChannels = m_source->NumChannels();
+    while (true) {
+      std::vector<float> block(c_pipelineBlockSamples * numChannels);
+      size_t count = m_source->Pull(&block[0], c_pipelineBlockSamples);
+      block.resize(count * numChannels);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (count > 0) {
+        m_changed.wait(lock, [this] {
+          return m_quit || m_blocks.size() < m_maxBlocks;
+        });
+        m_blocks.push_back(std::move(block));
+      }
+      if (count == 0 || m_quit) {
+        m_done = true;
+        m_changed.notify_all();
+        return;
+      }
+      m_changed.notify_all();
+    }
+  }
+
+  std::unique_ptr<CInputStage> m_source;
+  size_t m_maxBlocks;
+  std::thread m_thread;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::deque<std::vector<float>> m_blocks;
+  size_t m_frontOffset = 0;
+  bool m_done = false;
+  bool m_quit = false;
+};
+
+// opens a wave or FLAC file as the first stage of a pipeline, by looking at
+// the start of the file. FLAC is decoded on its own thread. Takes ownership
+// of file, which can be a pipe; fileName is for messages.
+std::unique_ptr<CInputStage> OpenInputStage(FILE* file, const char* fileName) {
+  std::unique_ptr<CInputStage> result;
+  std::unique_ptr<CReadAheadFile> reader(new CReadAheadFile(file));
+
+  unsigned char magic[4] = {};
+  size_t magicSize = reader->Peek(magic, 4);
+  if (IsFlacData(magic, magicSize)) {
+    std::unique_ptr<CFlacStreamStage> flac(new CFlacStreamStage);
+    if (flac->Open(std::move(reader), fileName))
+      result.reset(new CDecodeAheadStage(std::move(flac)));
+  } else if (IsMP3Data(magic, magicSize)) {
+    printf(
+        "[-----ERROR-----]%s is an MP3 file. MP3 input isn't supported, "
+        "convert it to wave or FLAC first.\n",
+        fileName);
+  } else {
+    std::unique_ptr<CWaveStreamStage> wave(new CWaveStreamStage);
+    if (wave->Open(std::move(reader), fileName)) result = std::move(wave);
+  }
+  return result;
+}
+
+// OpenInputStage() for a file name, "-" being stdin
+std::unique_ptr<CInputStage> OpenInputStage(const char* fileName) {
+  FILE* file = OpenFile(fileName, "rb");
+  if (!file) {
+    printf("[-----ERROR-----]Could not open %s for reading.\n", fileName);
+    return nullptr;
+  }
+  return OpenInputStage(file, fileName);
+}
+
+// decodes the rest of an input stage into data, like ReadWaveFile()
+bool DrainInputStage(CInputStage* input, const char* fileName,
+                     std::vector<float>* data, uint16* numChannels,
+                     uint32* sampleRate, uint16* numBytes) {
+  DrainStage(input, data);
+  if (input->Failed()) return false;
+
+  *numChannels = input->NumChannels();
+  *sampleRate = input->SampleRate();
+  *numBytes = input->NumBytes();
+  printf("%s loaded.\n", fileName);
+  return true;
+}
+
+// decodes all of an input through OpenInputStage(), see ReadWaveFile()
+bool ReadInputStream(const char* fileName, std::vector<float>* data,
+                     uint16* numChannels, uint32* sampleRate,
+                     uint16* numBytes) {
+  std::unique_ptr<CInputStage> input = OpenInputStage(fileName);
+  return input && DrainInputStage(input.get(), fileName, data, numChannels,
+                                  sampleRate, numBytes);
+}
+
+// FLAC encoding. Frames are fixed size and only depend on their own samples,
+// so a batch of frames is encoded in parallel on a thread pool and written
+// out in order. Each channel gets the better of the best fixed predictor and
+// an order 8 linear predictor, and stereo picks the cheapest of left/right,
+// left/side, side/right and mid/side per frame.
+
+// writes bits most significant bit first
+class CFlacBitWriter {
+ public:
+  explicit CFlacBitWriter(std::vector<unsigned char>* bytes) : m_bytes(bytes) {}
+
+  // count can be 0 to 32
+  void WriteBits(uint32 value, uint32 count) {
+    if (count == 0) return;
+    if (count < 32) value &= (1u << count) - 1;
+    m_cache = (m_cache << count) | value;
+    m_numBits += count;
+    if (m_numBits >= 32) {
+      m_numBits -= 32;
+      uint32 word = uint32(m_cache >> m_numBits);
+      unsigned char bytes[4] = {(unsigned char)(word >> 24),
+                                (unsigned char)(word >> 16),
+                                (unsigned char)(word >> 8),
+                                (unsigned char)word};
+      m_bytes->insert(m_bytes->end(), bytes, bytes + 4);
+    }
+  }
+
+  // moves all whole bytes written so far to the output
+  void Flush() {
+    while (m_numBits >= 8) {
+      m_numBits -= 8;
+      m_bytes->push_back((unsigned char)(m_cache >> m_numBits));
+    }
+  }
+
+  void WriteSignedBits(int32 value, uint32 count) {
+    WriteBits(uint32(value), count);
+  }
+
+  // zeros zero bits followed by a one bit
+  void WriteUnary(uint32 zeros) {
+    for (; zeros >= 31; zeros -= 31) WriteBits(0, 31);
+    WriteBits(1, zeros + 1);
+  }
+
+  // pads the current byte with zeros, and flushes
+  void AlignToByte() {
+    if (m_numBits & 7) WriteBits(0, 8 - (m_numBits & 7));
+    Flush();
+  }
+
+ private:
+  std::vector<unsigned char>* m_bytes;
+  uint64_t m_cache = 0;
+  uint32 m_numBits = 0;
+};
+
+class CFlacEncoder {
+ public:
+  static const uint32 c_blockSize = 4096;
+  static const uint32 c_maxLPCOrder = 8;
+
+  // bitsPerSample is 8, 16 or 24. A null thread pool encodes on the calling
+  // thread.
+  CFlacEncoder(uint16 numChannels, uint32 sampleRate, uint16 bitsPerSample,
+               CThreadPool* threadPool = nullptr)
+      : m_numChannels(numChannels),
+        m_sampleRate(sampleRate),
+        m_bitsPerSample(bitsPerSample),
+        m_threadPool(threadPool) {}
+
+  // makes the "fLaC" marker and STREAMINFO block for a stream of numSamples
+  // samples (frames), 0 meaning unknown, followed by an APPLICATION block
+  // with the "riff" id for each metadata chunk, holding the chunk as it would
+  // be in a wave file. That is c_headerSize bytes plus the blocks, the same
+  // for any numSamples, so the header can be rewritten in place at the end.
+  // Chunks have to fit in a block, see FitsInBlock().
+  static const size_t c_headerSize = 42;
+  void MakeHeader(std::vector<unsigned char>* header, uint64_t numSamples,
+                  const std::vector<SWaveChunk>* metadata = nullptr) const {
+    bool lastBlock = !metadata || metadata->empty();
+    header->clear();
+    header->insert(header->end(), {'f', 'L', 'a', 'C',
+                                   (unsigned char)(lastBlock ? 0x80 : 0), 0,
+                                   0, 34});
+    uint32 blockSize = c_blockSize;
+    if (numSamples && numSamples < blockSize) blockSize = uint32(numSamples);
+
+    CFlacBitWriter bits(header);
+    bits.WriteBits(blockSize, 16);
+    bits.WriteBits(blockSize, 16);
+    bits.WriteBits(m_minFrameBytes == uint32(-1) ? 0 : m_minFrameBytes, 24);
+    bits.WriteBits(m_maxFrameBytes, 24);
+    bits.WriteBits(m_sampleRate, 20);
+    bits.WriteBits(m_numChannels - 1, 3);
+    bits.WriteBits(m_bitsPerSample - 1, 5);
+    bits.WriteBits(uint32(numSamples >> 32), 4);
+    bits.WriteBits(uint32(numSamples), 32);
+    // no MD5 of the audio, all zeros means it isn't known
+    for (int i = 0; i < 4; ++i) bits.WriteBits(0, 32);
+    bits.Flush();
+
+    if (lastBlock) return;
+    for (size_t i = 0; i < metadata->size(); ++i) {
+      const SWaveChunk& chunk = (*metadata)[i];
+      uint32 size = uint32(chunk.m_data.size());
+      uint32 padding = size & 1;
+      bits.WriteBits(i + 1 == metadata->size() ? 1 : 0, 1);
+      bits.WriteBits(2, 7);  // APPLICATION
+      bits.WriteBits(4 + 8 + size + padding, 24);
+      bits.Flush();
+      header->insert(header->end(), {'r', 'i', 'f', 'f'});
+      header->insert(header->end(), chunk.m_id, chunk.m_id + 4);
+      AppendBytes(header, size);
+      header->insert(header->end(), chunk.m_data.begin(), chunk.m_data.end());
+      if (padding) header->push_back(0);
+    }
+  }
+
+  // whether a chunk is small enough for an APPLICATION block, whose length
+  // has 24 bits
+  static bool FitsInBlock(const SWaveChunk& chunk) {
+    return chunk.m_data.size() + 1 + 4 + 8 < (size_t(1) << 24);
+  }
+
+  // encodes numSamples interleaved samples (frames) and appends them to out.
+  // Every call but the last has to pass a multiple of c_blockSize samples.
+  void Encode(const int32* samples, size_t numSamples,
+              std::vector<unsigned char>* out) {
+    size_t numFrames = (numSamples + c_blockSize - 1) / c_blockSize;
+    m_frames.resize(std::max(m_frames.size(), numFrames));
+
+    auto encodeFrames = [&](size_t begin, size_t end) {
+      for (size_t frame = begin; frame < end; ++frame) {
+        size_t start = frame * c_blockSize;
+        uint32 blockSize =
+            uint32(std::min<size_t>(c_blockSize, numSamples - start));
+        m_frames[frame].clear();
+        EncodeFrame(&samples[start * m_numChannels], blockSize,
+                    m_nextFrame + frame, &m_frames[frame]);
+      }
+    };
+    if (m_threadPool)
+      m_threadPool->ParallelFor(numFrames, 1, encodeFrames);
+    else
+      encodeFrames(0, numFrames);
+
+    for (size_t frame = 0; frame < numFrames; ++frame) {
+      const std::vector<unsigned char>& bytes = m_frames[frame];
+      out->insert(out->end(), bytes.begin(), bytes.end());
+      m_minFrameBytes = std::min(m_minFrameBytes, uint32(bytes.size()));
+      m_maxFrameBytes = std::max(m_maxFrameBytes, uint32(bytes.size()));
+    }
+    m_nextFrame += numFrames;
+  }
+
+ private:
+  // how one channel of a frame gets encoded
+  struct SSubframe {
+    enum class EType { Constant, Verbatim, Fixed, LPC } m_type;
+    uint32 m_bitsPerSample = 0;  // after removing wasted bits
+    uint32 m_wastedBits = 0;
+    uint32 m_order = 0;
+    uint32 m_precision = 0;
+    int32 m_shift = 0;
+    int32 m_coefficients[c_maxLPCOrder];
+    std::vector<int32> m_samples;  // wasted bits removed
+    std::vector<int32> m_residual;
+    uint32 m_partitionOrder = 0;
+    uint32 m_riceParameters[1 << 8];
+    uint64_t m_bits = 0;  // size when written
+  };
+
+  void EncodeFrame(const int32* samples, uint32 blockSize, uint64_t frameNumber,
+                   std::vector<unsigned char>* out) const {
+    // split the channels, and make mid and side for stereo
+    std::vector<int32> channels[4];
+    for (uint16 channel = 0; channel < m_numChannels; ++channel) {
+      channels[channel].resize(blockSize);
+      for (uint32 i = 0; i < blockSize; ++i)
+        channels[channel][i] = samples[i * m_numChannels + channel];
+    }
+    if (m_numChannels == 2) {
+      channels[2].resize(blockSize);
+      channels[3].resize(blockSize);
+      for (uint32 i = 0; i < blockSize; ++i) {
+        int32 left = channels[0][i];
+        int32 right = channels[1][i];
+        channels[2][i] = (left + right) >> 1;
+        channels[3][i] = left - right;
+      }
+    }
+
+    // estimate what each channel costs from its best fixed predictor, and
+    // pick the cheapest stereo pair from that: 1 is left/right, 8 left/side,
+    // 9 side/right and 10 mid/side. Only the pair that is used gets encoded.
+    uint32 fixedOrders[4];
+    uint64_t estimates[4];
+    for (uint16 channel = 0; channel < (m_numChannels == 2 ? 4 : 1); ++channel)
+      estimates[channel] = EstimateFixed(
+          channels[channel].data(), blockSize,
+          m_bitsPerSample + (channel == 3 ? 1 : 0), &fixedOrders[channel]);
+
+    uint32 channelAssignment = m_numChannels - 1;
+    uint32 firstChannel = 0;
+    uint32 secondChannel = 1;
+    if (m_numChannels == 2) {
+      uint64_t best = estimates[0] + estimates[1];
+      if (estimates[0] + estimates[3] < best) {
+        best = estimates[0] + estimates[3];
+        channelAssignment = 8;
+        secondChannel = 3;
+      }
+      if (estimates[3] + estimates[1] < best) {
+        best = estimates[3] + estimates[1];
+        channelAssignment = 9;
+        firstChannel = 3;
+        secondChannel = 1;
+      }
+      if (estimates[2] + estimates[3] < best) {
+        channelAssignment = 10;
+        firstChannel = 2;
+        secondChannel = 3;
+      }
+    }
+
+    // the side channel needs one more bit
+    SSubframe first, second;
+    AnalyzeSubframe(channels[firstChannel], fixedOrders[firstChannel],
+                    m_bitsPerSample + (firstChannel == 3 ? 1 : 0), &first);
+    if (m_numChannels == 2)
+      AnalyzeSubframe(channels[secondChannel], fixedOrders[secondChannel],
+                      m_bitsPerSample + (secondChannel == 3 ? 1 : 0), &second);
+
+    out->reserve(size_t(blockSize) * m_numChannels * m_bitsPerSample / 8 + 64);
+    CFlacBitWriter bits(out);
+    WriteFrameHeader(&bits, out, blockSize, frameNumber, channelAssignment);
+    WriteSubframe(&bits, first);
+    if (m_numChannels == 2) WriteSubframe(&bits, second);
+    bits.AlignToByte();
+    uint16 crc = FlacCRC16(0, out->data(), out->size());
+    bits.WriteBits(crc, 16);
+    bits.Flush();
+  }
+
+  void WriteFrameHeader(CFlacBitWriter* bits, std::vector<unsigned char>* out,
+                        uint32 blockSize, uint64_t frameNumber,
+                        uint32 channelAssignment) const {
+    // sync code and fixed block size
+    bits->WriteBits(0xFFF8, 16);
+
+    uint32 blockSizeCode = (blockSize == 4096) ? 12 : 7;
+    uint32 sampleRateCode = 0;  // from STREAMINFO
+    switch (m_sampleRate) {
+      case 8000: sampleRateCode = 4; break;
+      case 16000: sampleRateCode = 5; break;
+      case 22050: sampleRateCode = 6; break;
+      case 24000: sampleRateCode = 7; break;
+      case 32000: sampleRateCode = 8; break;
+      case 44100: sampleRateCode = 9; break;
+      case 48000: sampleRateCode = 10; break;
+      case 96000: sampleRateCode = 11; break;
+    }
+    uint32 sampleSizeCode =
+        (m_bitsPerSample == 8) ? 1 : (m_bitsPerSample == 16) ? 4 : 6;
+    bits->WriteBits(blockSizeCode, 4);
+    bits->WriteBits(sampleRateCode, 4);
+    bits->WriteBits(channelAssignment, 4);
+    bits->WriteBits(sampleSizeCode, 3);
+    bits->WriteBits(0, 1);
+
+    // frame number, UTF-8 style
+    if (frameNumber < 0x80) {
+      bits->WriteBits(uint32(frameNumber), 8);
+    } else {
+      uint32 extraBytes = 1;
+      while (frameNumber >> (6 * extraBytes + 6 - extraBytes)) ++extraBytes;
+      uint32 lead = (0xFF00 >> (extraBytes + 1)) & 0xFF;
+      bits->WriteBits(lead | uint32(frameNumber >> (6 * extraBytes)), 8);
+      for (uint32 i = extraBytes; i-- > 0;)
+        bits->WriteBits(0x80 | uint32((frameNumber >> (6 * i)) & 0x3F), 8);
+    }
+
+    if (blockSizeCode == 7) bits->WriteBits(blockSize - 1, 16);
+
+    bits->Flush();
+    unsigned char crc = 0;
+    for (unsigned char byte : *out) crc = FlacCRC8(crc, byte);
+    bits->WriteBits(crc, 8);
+  }
+
+  // picks how to encode a channel and works out its size
+  static void AnalyzeSubframe(const std::vector<int32>& samples,
+                              uint32 fixedOrder, uint32 bitsPerSample,
+                              SSubframe* subframe) {
+    uint32 blockSize = uint32(samples.size());
+    subframe->m_wastedBits = 0;
+
+    // constant
+    bool constant = true;
+    int32 ored = 0;
+    for (int32 sample : samples) {
+      constant = constant && sample == samples[0];
+      ored |= sample;
+    }
+    if (constant) {
+      subframe->m_type = SSubframe::EType::Constant;
+      subframe->m_bitsPerSample = bitsPerSample;
+      subframe->m_samples.assign(1, samples[0]);
+      subframe->m_bits = 8 + bitsPerSample;
+      return;
+    }
+
+    // low bits that are zero in every sample don't need to be stored
+    while (!(ored & 1)) {
+      ored >>= 1;
+      ++subframe->m_wastedBits;
+    }
+    bitsPerSample -= subframe->m_wastedBits;
+    subframe->m_bitsPerSample = bitsPerSample;
+    subframe->m_samples.resize(blockSize);
+    for (uint32 i = 0; i < blockSize; ++i)
+      subframe->m_samples[i] = samples[i] >> subframe->m_wastedBits;
+    const int32* s = subframe->m_samples.data();
+
+    uint64_t headerBits = 8 + subframe->m_wastedBits;
+
+    // verbatim is the worst case
+    subframe->m_type = SSubframe::EType::Verbatim;
+    subframe->m_bits = headerBits + uint64_t(blockSize) * bitsPerSample;
+
+    // the fixed predictor EstimateFixed() picked
+    SSubframe fixed;
+    fixed.m_type = SSubframe::EType::Fixed;
+    fixed.m_order = std::min(fixedOrder, blockSize);
+    static const int32 c_fixedCoefficients[5][4] = {{0, 0, 0, 0},
+                                                    {1, 0, 0, 0},
+                                                    {2, -1, 0, 0},
+                                                    {3, -3, 1, 0},
+                                                    {4, -6, 4, -1}};
+    fixed.m_residual.resize(blockSize - fixed.m_order);
+    if (MakeResidual(s, blockSize, c_fixedCoefficients[fixed.m_order],
+                     fixed.m_order, 0, &fixed.m_residual[0])) {
+      fixed.m_bits = headerBits + uint64_t(fixed.m_order) * bitsPerSample +
+                     PlanRice(fixed.m_residual, blockSize, fixed.m_order,
+                              &fixed.m_partitionOrder, fixed.m_riceParameters);
+      if (fixed.m_bits < subframe->m_bits) TakeEncoding(&fixed, subframe);
+    }
+
+    // linear prediction, when the block is long enough to be worth it
+    SSubframe lpc;
+    lpc.m_type = SSubframe::EType::LPC;
+    if (blockSize > 64 && ComputeLPC(s, blockSize, bitsPerSample, &lpc)) {
+      lpc.m_residual.resize(blockSize - lpc.m_order);
+      if (MakeResidual(s, blockSize, lpc.m_coefficients, lpc.m_order,
+                       lpc.m_shift, &lpc.m_residual[0])) {
+        lpc.m_bits = headerBits + uint64_t(lpc.m_order) * bitsPerSample + 9 +
+                     uint64_t(lpc.m_order) * lpc.m_precision +
+                     PlanRice(lpc.m_residual, blockSize, lpc.m_order,
+                              &lpc.m_partitionOrder, lpc.m_riceParameters);
+        if (lpc.m_bits < subframe->m_bits) TakeEncoding(&lpc, subframe);
+      }
+    }
+  }
+
+  // finds the fixed predictor order with the smallest total error, and
+  // estimates the bits the channel takes with it, or verbatim if that's less
+  static uint64_t EstimateFixed(const int32* s, uint32 blockSize,
+                                uint32 bitsPerSample, uint32* bestOrder) {
+    uint64_t verbatimBits = uint64_t(blockSize) * bitsPerSample;
+    *bestOrder = 0;
+    if (blockSize <= 4) return verbatimBits;
+    uint64_t errors[5] = {};
+    for (uint32 i = 4; i < blockSize; ++i) {
+      int64_t e0 = s[i];
+      int64_t e1 = e0 - s[i - 1];
+      int64_t e2 = e1 - (int64_t(s[i - 1]) - s[i - 2]);
+      int64_t e3 =
+          e2 - (int64_t(s[i - 1]) - 2 * int64_t(s[i - 2]) + s[i - 3]);
+      int64_t e4 = e3 - (int64_t(s[i - 1]) - 3 * int64_t(s[i - 2]) +
+                         3 * int64_t(s[i - 3]) - s[i - 4]);
+      errors[0] += uint64_t(e0 < 0 ? -e0 : e0);
+      errors[1] += uint64_t(e1 < 0 ? -e1 : e1);
+      errors[2] += uint64_t(e2 < 0 ? -e2 : e2);
+      errors[3] += uint64_t(e3 < 0 ? -e3 : e3);
+      errors[4] += uint64_t(e4 < 0 ? -e4 : e4);
+    }
+    for (uint32 order = 1; order <= 4; ++order)
+      if (errors[order] < errors[*bestOrder]) *bestOrder = order;
+
+    // rice coded with a parameter of log2 of the mean error, see PlanRice()
+    uint32 count = blockSize - 4;
+    uint64_t sum = errors[*bestOrder] * 2;
+    uint32 parameter = 0;
+    while (parameter < 30 && (uint64_t(count) << (parameter + 1)) <= sum)
+      ++parameter;
+    uint64_t bits = uint64_t(count) * (parameter + 1) + (sum >> parameter);
+    return std::min(verbatimBits, bits);
+  }
+
+  // moves a candidate encoding into subframe, keeping its samples
+  static void TakeEncoding(SSubframe* candidate, SSubframe* subframe) {
+    candidate->m_bitsPerSample = subframe->m_bitsPerSample;
+    candidate->m_wastedBits = subframe->m_wastedBits;
+    candidate->m_samples.swap(subframe->m_samples);
+    *subframe = std::move(*candidate);
+  }
+
+  // prediction errors of samples[order...]. False if one doesn't fit the
+  // 31 bits rice coding can take, which only happens on full scale noise.
+  static bool MakeResidual(const int32* samples, uint32 blockSize,
+                           const int32* coefficients, uint32 order,
+                           int32 shift, int32* residual) {
+    typedef bool (*ResidualFunction)(const int32*, uint32, const int32*,
+                                     int32, int32*);
+    static const ResidualFunction c_functions[c_maxLPCOrder + 1] = {
+        MakeResidualOrder<0>, MakeResidualOrder<1>, MakeResidualOrder<2>,
+        MakeResidualOrder<3>, MakeResidualOrder<4>, MakeResidualOrder<5>,
+        MakeResidualOrder<6>, MakeResidualOrder<7>, MakeResidualOrder<8>};
+    return c_functions[order](samples, blockSize, coefficients, shift,
+                              residual);
+  }
+
+  // the order is a template parameter so the inner loop unrolls
+  template <uint32 ORDER>
+  static bool MakeResidualOrder(const int32* samples, uint32 blockSize,
+                                const int32* coefficients, int32 shift,
+                                int32* residual) {
+    int64_t largest = 0;
+    for (uint32 i = ORDER; i < blockSize; ++i) {
+      int64_t sum = 0;
+      for (uint32 j = 0; j < ORDER; ++j)
+        sum += int64_t(coefficients[j]) * samples[i - 1 - j];
+      int64_t error = samples[i] - (sum >> shift);
+      largest = std::max(largest, error < 0 ? -error : error);
+      residual[i - ORDER] = int32(error);
+    }
+    return largest <= 0x3FFFFFFF;
+  }
+
+  // windowed autocorrelation and Levinson-Durbin, quantized to 12 bit
+  // coefficients
+  static bool ComputeLPC(const int32* samples, uint32 blockSize,
+                         uint32 bitsPerSample, SSubframe* lpc) {
+    const uint32 order = c_maxLPCOrder;
+    std::vector<double> windowed(blockSize);
+    double scale = 2.0 / (blockSize + 1);
+    for (uint32 i = 0; i < blockSize; ++i) {
+      // Welch window
+      double x = (i - (blockSize - 1) * 0.5) * scale;
+      windowed[i] = samples[i] * (1.0 - x * x);
+    }
+    // four partial sums per lag, so the loop vectorizes
+    double autocorrelation[order + 1];
+    for (uint32 lag = 0; lag <= order; ++lag) {
+      double sums[4] = {};
+      uint32 i = lag;
+      for (; i + 4 <= blockSize; i += 4)
+        for (uint32 lane = 0; lane < 4; ++lane)
+          sums[lane] += windowed[i + lane] * windowed[i + lane - lag];
+      for (; i < blockSize; ++i) sums[0] += windowed[i] * windowed[i - lag];
+      autocorrelation[lag] = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    }
+    if (autocorrelation[0] == 0.0) return false;
+
+    double lpc64[order] = {};
+    double error = autocorrelation[0];
+    for (uint32 i = 0; i < order; ++i) {
+      double reflection = -autocorrelation[i + 1];
+      for (uint32 j = 0; j < i; ++j)
+        reflection -= lpc64[j] * autocorrelation[i - j];
+      reflection /= error;
+
+      double previous[order];
+      std::copy(lpc64, lpc64 + i, previous);
+      for (uint32 j = 0; j < i; ++j)
+        lpc64[j] = previous[j] + reflection * previous[i - 1 - j];
+      lpc64[i] = reflection;
+      error *= 1.0 - reflection * reflection;
+      if (error <= 0.0) return false;
+    }
+
+    // the predictor is the negated prediction error filter. Scale so the
+    // largest coefficient uses the whole precision.
+    const uint32 precision = bitsPerSample <= 16 ? 12 : 15;
+    double largest = 0.0;
+    for (uint32 i = 0; i < order; ++i)
+      largest = std::max(largest, fabs(lpc64[i]));
+    if (largest <= 0.0) return false;
+    int exponent;
+    frexp(largest, &exponent);
+    int32 shift = int32(precision) - 1 - exponent;
+    shift = std::min(std::max(shift, 0), 15);
+
+    int32 limit = (1 << (precision - 1)) - 1;
+    double quantizationError = 0.0;
+    for (uint32 i = 0; i < order; ++i) {
+      double value = -lpc64[i] * double(1 << shift) + quantizationError;
+      int32 quantized = int32(floor(value + 0.5));
+      quantized = std::min(std::max(quantized, -limit - 1), limit);
+      quantizationError = value - quantized;
+      lpc->m_coefficients[i] = quantized;
+    }
+    lpc->m_order = order;
+    lpc->m_precision = precision;
+    lpc->m_shift = shift;
+    return true;
+  }
+
+  // chooses the partition order and rice parameter of each partition that
+  // give the fewest bits, and returns that size including the residual
+  // header
+  static uint64_t PlanRice(const std::vector<int32>& residual,
+                           uint32 blockSize, uint32 order,
+                           uint32* bestPartitionOrder, uint32* bestParameters) {
+    // sums of the zigzagged errors over the finest partitions, merged pairwise
+    // for the coarser ones
+    uint32 maxPartitionOrder = 0;
+    while (maxPartitionOrder < 8 &&
+           (blockSize >> (maxPartitionOrder + 1)) > order &&
+           (blockSize & ((2u << maxPartitionOrder) - 1)) == 0)
+      ++maxPartitionOrder;
+
+    std::vector<uint64_t> sums(size_t(1) << maxPartitionOrder);
+    uint32 partitionSize = blockSize >> maxPartitionOrder;
+    size_t index = 0;
+    for (size_t partition = 0; partition < sums.size(); ++partition) {
+      uint32 count = partition ? partitionSize : partitionSize - order;
+      uint64_t sum = 0;
+      for (uint32 i = 0; i < count; ++i) {
+        int32 value = residual[index++];
+        sum += uint32(value << 1) ^ uint32(value >> 31);
+      }
+      sums[partition] = sum;
+    }
+
+    uint64_t bestBits = uint64_t(-1);
+    uint32 parameters[1 << 8];
+    for (uint32 partitionOrder = maxPartitionOrder + 1; partitionOrder-- > 0;) {
+      uint32 numPartitions = 1u << partitionOrder;
+      uint32 size = blockSize >> partitionOrder;
+      uint64_t bits = 2 + 4;
+      bool needsWideParameters = false;
+      for (uint32 partition = 0; partition < numPartitions; ++partition) {
+        uint32 count = partition ? size : size - order;
+        uint64_t sum = sums[partition];
+        uint32 parameter = 0;
+        if (count > 0 && sum > count) {
+          uint64_t mean = sum / count;
+          while (parameter < 30 && (uint64_t(1) << (parameter + 1)) <= mean)
+            ++parameter;
+        }
+        // rice coding costs about count * (parameter + 1) + sum >> parameter
+        uint64_t partitionBits =
+            uint64_t(count) * (parameter + 1) + (sum >> parameter);
+        if (parameter > 0) {
+          uint64_t smaller =
+              uint64_t(count) * parameter + (sum >> (parameter - 1));
+          if (smaller < partitionBits) {
+            partitionBits = smaller;
+            --parameter;
+          }
+        }
+        needsWideParameters = needsWideParameters || parameter > 14;
+        parameters[partition] = parameter;
+        bits += partitionBits;
+      }
+      bits += uint64_t(numPartitions) * (needsWideParameters ? 5 : 4);
+      if (bits < bestBits) {
+        bestBits = bits;
+        *bestPartitionOrder = partitionOrder;
+        std::copy(parameters, parameters + numPartitions, bestParameters);
+      }
+
+      // merge the sums for the next coarser order
+      for (uint32 partition = 0; partition < numPartitions / 2; ++partition)
+        sums[partition] = sums[partition * 2] + sums[partition * 2 + 1];
+    }
+    return bestBits;
+  }
+
+  static void WriteSubframe(CFlacBitWriter* bits, const SSubframe& subframe) {
+    uint32 type = 0;
+    switch (subframe.m_type) {
+      case SSubframe::EType::Constant: type = 0; break;
+      case SSubframe::EType::Verbatim: type = 1; break;
+      case SSubframe::EType::Fixed: type = 8 + subframe.m_order; break;
+      case SSubframe::EType::LPC: type = 31 + subframe.m_order; break;
+    }
+    bits->WriteBits(type, 7);  // zero padding bit and the type
+    if (subframe.m_wastedBits) {
+      bits->WriteBits(1, 1);
+      bits->WriteUnary(subframe.m_wastedBits - 1);
+    } else {
+      bits->WriteBits(0, 1);
+    }
+
+    uint32 bitsPerSample = subframe.m_bitsPerSample;
+    if (subframe.m_type == SSubframe::EType::Constant) {
+      bits->WriteSignedBits(subframe.m_samples[0], bitsPerSample);
+      return;
+    }
+    if (subframe.m_type == SSubframe::EType::Verbatim) {
+      for (int32 sample : subframe.m_samples)
+        bits->WriteSignedBits(sample, bitsPerSample);
+      return;
+    }
+
+    // warm up samples, then the predictor, then the residual
+    for (uint32 i = 0; i < subframe.m_order; ++i)
+      bits->WriteSignedBits(subframe.m_samples[i], bitsPerSample);
+    if (subframe.m_type == SSubframe::EType::LPC) {
+      bits->WriteBits(subframe.m_precision - 1, 4);
+      bits->WriteSignedBits(subframe.m_shift, 5);
+      for (uint32 i = 0; i < subframe.m_order; ++i)
+        bits->WriteSignedBits(subframe.m_coefficients[i], subframe.m_precision);
+    }
+
+    uint32 numPartitions = 1u << subframe.m_partitionOrder;
+    bool wide = false;
+    for (uint32 partition = 0; partition < numPartitions; ++partition)
+      wide = wide || subframe.m_riceParameters[partition] > 14;
+    bits->WriteBits(wide ? 1 : 0, 2);
+    bits->WriteBits(subframe.m_partitionOrder, 4);
+
+    uint32 blockSize = uint32(subframe.m_samples.size());
+    uint32 partitionSize = blockSize >> subframe.m_partitionOrder;
+    const int32* residual = subframe.m_residual.data();
+    for (uint32 partition = 0; partition < numPartitions; ++partition) {
+      uint32 parameter = subframe.m_riceParameters[partition];
+      bits->WriteBits(parameter, wide ? 5 : 4);
+      uint32 count =
+          partition ? partitionSize : partitionSize - subframe.m_order;
+      for (uint32 i = 0; i < count; ++i) {
+        int32 value = *residual++;
+        uint32 folded = uint32(value << 1) ^ uint32(value >> 31);
+        uint32 quotient = folded >> parameter;
+        uint32 remainder = folded & ((1u << parameter) - 1);
+
+        // the stop bit and the remainder usually go out in one write
+        if (quotient + 1 + parameter <= 32) {
+          bits->WriteBits((1u << parameter) | remainder,
+                          quotient + 1 + parameter);
+        } else {
+          bits->WriteUnary(quotient);
+          bits->WriteBits(remainder, parameter);
+        }
+      }
+    }
+  }
+
+  uint16 m_numChannels;
+  uint32 m_sampleRate;
+  uint16 m_bitsPerSample;
+  CThreadPool* m_threadPool;
+  uint64_t m_nextFrame = 0;
+  uint32 m_minFrameBytes = uint32(-1);
+  uint32 m_maxFrameBytes = 0;
+  std::vector<std::vector<unsigned char>> m_frames;
+};
+
+const uint32 CFlacEncoder::c_blockSize;
+const uint32 CFlacEncoder::c_maxLPCOrder;
+const size_t CFlacEncoder::c_headerSize;
+
+// drains a stage into a FLAC file, the same as WriteWaveFileStreaming(). A
+// batch of frames is encoded at a time, across threadPool if one is given
+// or on the calling thread if not. 32 bit output isn't supported.
+// Metadata chunks go into APPLICATION blocks (see CFlacEncoder::MakeHeader())
+// which ReadWaveFile() gives back, other FLAC readers skip them. A chunk of
+// 16MB or more doesn't fit in a block and fails the write.
+bool WriteFlacFileStreaming(const char* fileName, CAudioStage* stage,
+                            uint32 sampleRate, uint16 numBytes,
+                            uint32 outputSampleRate = 0,
+                            EDither dither = EDither::None,
+                            const std::vector<SWaveChunk>* metadata = nullptr,
+                            CThreadPool* threadPool = nullptr) {
+  GRANULAR_TIMER(WriteWaveFile);
+
+  if (numBytes < 1 || numBytes > 3) {
+    printf("[-----ERROR-----] Can't write %u bit audio to %s, FLAC output "
+           "is 8, 16 or 24 bit.\n", numBytes * 8, fileName);
+    return false;
+  }
+  if (metadata) {
+    for (const SWaveChunk& chunk : *metadata) {
+      if (!CFlacEncoder::FitsInBlock(chunk)) {
+        printf("[-----ERROR-----] The %.4s chunk is too big for a FLAC "
+               "metadata block in %s.\n", (const char*)chunk.m_id, fileName);
+        return false;
+      }
+    }
+  }
+
+  std::unique_ptr<CSampleRateStage> sampleRateStage;
+  if (outputSampleRate && outputSampleRate != sampleRate) {
+    sampleRateStage.reset(
+        new CSampleRateStage(stage, sampleRate, outputSampleRate));
+    stage = sampleRateStage.get();
+    sampleRate = outputSampleRate;
+  }
+
+  // a pool of one thread has no threads of its own
+  CThreadPool callingThread(1);
+  if (!threadPool) threadPool = &callingThread;
+
+  // open the file if we can. "-" writes to stdout.
+  FILE* File = OpenFile(fileName, "w+b");
+  if (!File) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
+
+  // the header goes first with the length if it's known, and gets rewritten
+  // with the real length and frame sizes at the end if the file can seek
+  uint16 numChannels = stage->NumChannels();
+  uint16 bitsPerSample = numBytes * 8;
+  CFlacEncoder encoder(numChannels, sampleRate, bitsPerSample, threadPool);
+  std::vector<unsigned char> header;
+  size_t numSamplesExpected = stage->NumSamples();
+  encoder.MakeHeader(&header,
+                     numSamplesExpected == c_unknownNumSamples
+                         ? 0
+                         : numSamplesExpected,
+                     metadata);
+  bool written = fwrite(&header[0], header.size(), 1, File) == 1;
+
+  // pull enough for a few frames per thread, convert to integers the same
+  // way wave output does, and encode the batch
+  const size_t batchSamples =
+      CFlacEncoder::c_blockSize * 4 * threadPool->NumThreads();
+  std::vector<float> block(c_pipelineBlockSamples * numChannels);
+  std::vector<unsigned char> PCM(block.size() * numBytes);
+  std::vector<int32> batch;
+  batch.reserve(batchSamples * numChannels);
+  std::vector<unsigned char> encoded;
+  CPCMEncoder pcmEncoder(numChannels, numBytes, dither);
+  uint64_t numSamplesWritten = 0;
+  size_t bytesWritten = header.size();
+  while (true) {
+    size_t numSamples = stage->Pull(&block[0], c_pipelineBlockSamples);
+    size_t numValues = numSamples * numChannels;
+    pcmEncoder.Encode(&block[0], numValues, &PCM[0]);
+    for (size_t i = 0; i < numValues; ++i) {
+      const unsigned char* value = &PCM[i * numBytes];
+      switch (numBytes) {
+        case 1:
+          batch.push_back(int32(value[0]) - 128);
+          break;
+        case 2:
+          batch.push_back(int16_t(value[0] | (value[1] << 8)));
+          break;
+        case 3:
+          batch.push_back(int32(uint32(value[0]) << 8 |
+                                uint32(value[1]) << 16 |
+                                uint32(value[2]) << 24) >> 8);
+          break;
+      }
+    }
+
+    // encode whole frames only, until the end
+    size_t batchedSamples = batch.size() / numChannels;
+    size_t encodeSamples =
+        numSamples == 0 ? batchedSamples
+                        : batchedSamples / CFlacEncoder::c_blockSize *
+                              CFlacEncoder::c_blockSize;
+    if (encodeSamples > 0 &&
+        (batchedSamples >= batchSamples || numSamples == 0)) {
+      encoded.clear();
+      encoder.Encode(batch.data(), encodeSamples, &encoded);
+      written = fwrite(&encoded[0], encoded.size(), 1, File) == 1 && written;
+      bytesWritten += encoded.size();
+      numSamplesWritten += encodeSamples;
+      batch.erase(batch.begin(), batch.begin() + encodeSamples * numChannels);
+    }
+    if (numSamples == 0) break;
+  }
+  GRANULAR_COUNT(BytesWritten, bytesWritten);
+
+  if (fseek(File, 0, SEEK_SET) == 0) {
+    encoder.MakeHeader(&header, numSamplesWritten, metadata);
+    written = fwrite(&header[0], header.size(), 1, File) == 1 && written;
+  }
+
+  // close the file and return success, unless something didn't make it out
+  // (the disk is full, say). Stay quiet when writing to stdout, since that
+  // is where the audio is going.
+  written = CloseFile(File) && written;
+  if (!written) {
+    printf("[-----ERROR-----] Could not write %s.\n", fileName);
+    return false;
+  }
+  if (File != stdout) printf("%s saved.\n", fileName);
+  return true;
+}
+
+// writes a buffer to a FLAC file
+bool WriteFlacFile(const char* fileName, std::vector<float>* dataFloat,
+                   uint16 numChannels, uint32 sampleRate, uint16 numBytes,
+                   const std::vector<SWaveChunk>* metadata,
+                   CThreadPool* threadPool) {
+  CBufferStage buffer(*dataFloat, numChannels);
+  return WriteFlacFileStreaming(fileName, &buffer, sampleRate, numBytes, 0,
+                                EDither::None, metadata, threadPool);
+}
+
+// drains a stage into a wave file, converting each block to PCM as it comes.
+// numBytes, metadata and threadPool are the same as WriteWaveFile(). If
+// outputSampleRate is given and isn't sampleRate, the audio is sample rate
+// converted on the way out.
+bool WriteWaveFileStreaming(const char* fileName, CAudioStage* stage,
+                            uint32 sampleRate, uint16 numBytes,
+                            uint32 outputSampleRate = 0,
+                            EDither dither = EDither::None,
+                            const std::vector<SWaveChunk>* metadata = nullptr,
+                            CThreadPool* threadPool = nullptr) {
+  if (IsFlacFileName(fileName))
+    return WriteFlacFileStreaming(fileName, stage, sampleRate, numBytes,
+                                  outputSampleRate, dither, metadata,
+                                  threadPool);
+
+  GRANULAR_TIMER(WriteWaveFile);
+
+  std::unique_ptr<CSampleRateStage> sampleRateStage;
+  if (outputSampleRate && outputSampleRate != sampleRate) {
+    sampleRateStage.reset(
+        new CSampleRateStage(stage, sampleRate, outputSampleRate));
+    stage = sampleRateStage.get();
+    sampleRate = outputSampleRate;
+  }
+
+  uint16 numChannels = stage->NumChannels();
+  bool sizeKnown = stage->NumSamples() != c_unknownNumSamples;
+  uint64_t dataSize =
+      sizeKnown ? uint64_t(stage->NumSamples()) * numChannels * numBytes
+                : c_unknownDataSize;
+
+  // open the file if we can. "-" writes to stdout.
+  FILE* File = OpenFile(fileName, "w+b");
+  if (!File) {
+    printf("[-----ERROR-----] Could not open %s for writing.\n", fileName);
+    return false;
+  }
+
+  // write the header. If the size isn't known yet it gets placeholder sizes,
+  // which are fixed up at the end if the file can seek, and room to turn it
+  // into RF64 then if it has to be.
+  std::vector<unsigned char> header;
+  MakeWaveHeader(&header, dataSize, numChannels, sampleRate, numBytes,
+                 metadata, !sizeKnown);
+  bool written = fwrite(&header[0], header.size(), 1, File) == 1;
+
+  // pull blocks through the pipeline and write them out
+  std::vector<float> block(c_pipelineBlockSamples * numChannels);
+  std::vector<unsigned char> data(block.size() * numBytes);
+  CPCMEncoder encoder(numChannels, numBytes, dither);
+  size_t numSamples;
+  size_t bytesWritten = 0;
+  while ((numSamples = stage->Pull(&block[0], c_pipelineBlockSamples)) > 0) {
+    size_t numValues = numSamples * numChannels;
+    encoder.Encode(&block[0], numValues, &data[0]);
+    written = fwrite(&data[0], numValues * numBytes, 1, File) == 1 && written;
+    bytesWritten += numValues * numBytes;
+  }
+  GRANULAR_COUNT(BytesWritten, header.size() + bytesWritten);
+
+  if (!sizeKnown && fseek(File, 0, SEEK_SET) == 0) {
+    MakeWaveHeader(&header, bytesWritten, numChannels, sampleRate, numBytes,
+                   metadata, true);
+    written = fwrite(&header[0], header.size(), 1, File) == 1 && written;
+  }
+
+  // close the file and return success, unless something didn't make it out
+  // (the disk is full, say). Stay quiet when writing to stdout, since that
+  // is where the audio is going.
+  written = CloseFile(File) && written;
+  if (!written) {
+    printf("[-----ERROR-----] Could not write %s.\n", fileName);
+    return false;
+  }
+  if (File != stdout) printf("%s saved.\n", fileName);
+  return true;
+}
+
+// WriteWaveFile() that sample rate converts to outputSampleRate and/or
+// dithers on the way out, in the same pass as the conversion to PCM
+bool WriteWaveFile(const char* fileName, std::vector<float>* dataFloat,
+                   uint16 numChannels, uint32 sampleRate, uint16 numBytes,
+                   uint32 outputSampleRate, EDither dither = EDither::None,
+                   const std::vector<SWaveChunk>* metadata = nullptr,
+                   CThreadPool* threadPool = nullptr) {
+  if (outputSampleRate == sampleRate && dither == EDither::None)
+    return WriteWaveFile(fileName, dataFloat, numChannels, sampleRate,
+                         numBytes, metadata, threadPool);
+
+  CBufferStage buffer(*dataFloat, numChannels);
+  return WriteWaveFileStreaming(fileName, &buffer, sampleRate, numBytes,
+                                outputSampleRate, dither, metadata,
+                                threadPool);
+}
+
+// Realtime audio devices. A device calls a callback from its own thread for
+// every buffer it plays, with the audio it captured if it captures too. How
+// long the callbacks take is kept as a histogram, in tenths of the time one
+// buffer lasts, so it's easy to see how close rendering comes to falling
+// behind. Xruns count the buffers that were late (or captured audio that was
+// lost).
+struct SDeviceStats {
+  static const size_t c_numBuckets = 11;  // the last is 100% and over
+
+  std::atomic<uint64_t> m_callbacks{0};
+  std::atomic<uint64_t> m_xruns{0};
+  std::atomic<uint64_t> m_maxCallbackNanoseconds{0};
+  std::atomic<uint64_t> m_histogram[c_numBuckets];
+
+  SDeviceStats() {
+    for (std::atomic<uint64_t>& bucket : m_histogram) bucket = 0;
+  }
+
+  void RecordCallback(uint64_t nanoseconds, uint64_t bufferNanoseconds) {
+    ++m_callbacks;
+    size_t bucket =
+        size_t(nanoseconds * 10 / std::max<uint64_t>(1, bufferNanoseconds));
+    ++m_histogram[std::min(bucket, c_numBuckets - 1)];
+    uint64_t maxNanoseconds = m_maxCallbackNanoseconds;
+    while (nanoseconds > maxNanoseconds &&
+           !m_maxCallbackNanoseconds.compare_exchange_weak(maxNanoseconds,
+                                                           nanoseconds)) {
+    }
+  }
+
+  void Print(uint64_t bufferNanoseconds) const {
+    printf("%" PRIu64 " callbacks, %" PRIu64
+           " xruns, longest %.3fms of %.3fms\n",
+           uint64_t(m_callbacks), uint64_t(m_xruns),
+           double(m_maxCallbackNanoseconds) / 1e6,
+           double(bufferNanoseconds) / 1e6);
+    for (size_t i = 0; i < c_numBuckets; ++i) {
+      if (i + 1 < c_numBuckets)
+        printf("  %3i-%3i%% %10" PRIu64 "\n", int(i * 10), int(i * 10 + 10),
+               uint64_t(m_histogram[i]));
+      else
+        printf("  %3i%%+    %10" PRIu64 "\n", int(i * 10),
+               uint64_t(m_histogram[i]));
+    }
+  }
+};
+
+class CAudioDevice {
+ public:
+  // input is null if the device doesn't capture. Both are interleaved with
+  // NumChannels() channels. Returning false ends playback.
+  typedef std::function<bool(const float* input, float* output,
+                             size_t numSamples)>
+      Callback;
+
+  virtual ~CAudioDevice() {}
+
+  // starts calling the callback, returning false if the device couldn't be
+  // started
+  virtual bool Start(const Callback& callback) = 0;
+
+  // stops calling the callback, waiting for the last call to finish
+  virtual void Stop() = 0;
+
+  // false once the callback has ended playback or the device has failed
+  bool Running() const { return m_running; }
+
+  uint32 SampleRate() const { return m_sampleRate; }
+  uint16 NumChannels() const { return m_numChannels; }
+  size_t BufferSamples() const { return m_bufferSamples; }
+  uint64_t BufferNanoseconds() const {
+    return uint64_t(m_bufferSamples) * 1000000000 / m_sampleRate;
+  }
+  const SDeviceStats& Stats() const { return m_stats; }
+
+ protected:
+  CAudioDevice(uint32 sampleRate, uint16 numChannels, size_t bufferSamples)
+      : m_sampleRate(sampleRate),
+        m_numChannels(numChannels),
+        m_bufferSamples(bufferSamples) {}
+
+  // calls the callback for a buffer, timing it
+  bool RunCallback(const float* input, float* output, size_t numSamples) {
+    auto start = std::chrono::steady_clock::now();
+    bool keepGoing = m_callback(input, output, numSamples);
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+    m_stats.RecordCallback(
+        uint64_t(elapsed.count()),
+        uint64_t(numSamples) * 1000000000 / m_sampleRate);
+    return keepGoing;
+  }
+
+  uint32 m_sampleRate;
+  uint16 m_numChannels;
+  size_t m_bufferSamples;
+  Callback m_callback;
+  SDeviceStats m_stats;
+  std::atomic<bool> m_running{false};
+};
+
+// A device without hardware, for testing and for machines without sound. It
+// captures by looping a buffer (silence if there is none) and optionally
+// records what it plays to a file when stopped. In realtime mode it calls
+// back once per buffer period and counts a buffer that finishes after its
+// deadline as an xrun, like a sound card would; otherwise it runs as fast as
+// the callback allows.
+class CNullAudioDevice : public CAudioDevice {
+ public:
+  CNullAudioDevice(uint32 sampleRate, uint16 numChannels, size_t bufferSamples,
+                   bool realtime, const std::vector<float>* loopback = nullptr,
+                   const char* recordFileName = nullptr, uint16 numBytes = 2)
+      : CAudioDevice(sampleRate, numChannels, bufferSamples),
+        m_realtime(realtime),
+        m_loopback(loopback),
+        m_recordFileName(recordFileName ? recordFileName : ""),
+        m_numBytes(numBytes) {}
+
+  ~CNullAudioDevice() { Stop(); }
+
+  bool Start(const Callback& callback) override {
+    m_callback = callback;
+    m_recording.clear();
+    m_running = true;
+    m_thread = std::thread(&CNullAudioDevice::DeviceThread, this);
+    return true;
+  }
+
+  void Stop() override {
+    m_running = false;
+    if (!m_thread.joinable()) return;
+    m_thread.join();
+    if (!m_recordFileName.empty())
+      WriteWaveFile(m_recordFileName.c_str(), &m_recording, m_numChannels,
+                    m_sampleRate, m_numBytes);
+  }
+
+ private:
+  void DeviceThread() {
+    std::vector<float> input(m_bufferSamples * m_numChannels, 0.0f);
+    std::vector<float> output(m_bufferSamples * m_numChannels);
+    size_t loopbackPosition = 0;
+    std::chrono::nanoseconds period(BufferNanoseconds());
+    auto deadline = std::chrono::steady_clock::now() + period;
+    while (m_running) {
+      // capture
+      if (m_loopback && !m_loopback->empty()) {
+        for (float& value : input) {
+          value = (*m_loopback)[loopbackPosition];
+          loopbackPosition = (loopbackPosition + 1) % m_loopback->size();
+        }
+      }
+
+      // play
+      std::fill(output.begin(), output.end(), 0.0f);
+      bool keepGoing =
+          RunCallback(input.data(), output.data(), m_bufferSamples);
+      if (!m_recordFileName.empty())
+        m_recording.insert(m_recording.end(), output.begin(), output.end());
+      if (!keepGoing) break;
+
+      // wait for the sound card that isn't there to want the next buffer
+      if (m_realtime) {
+        auto now = std::chrono::steady_clock::now();
+        if (now > deadline) {
+          ++m_stats.m_xruns;
+          deadline = now;
+        }
+        std::this_thread::sleep_until(deadline);
+        deadline += period;
+      }
+    }
+    m_running = false;
+  }
+
+  bool m_realtime;
+  const std::vector<float>* m_loopback;
+  std::string m_recordFileName;
+  uint16 m_numBytes;
+  std::vector<float> m_recording;
+  std::thread m_thread;
+};
+
+#ifdef GRANULAR_ALSA
+// Plays (and optionally captures) through ALSA, blocking reads and writes on
+// a thread of its own. Formats and rates the hardware doesn't do are converted
+// by ALSA's plug layer. Keeps two buffers queued.
+class CAlsaAudioDevice : public CAudioDevice {
+ public:
+  CAlsaAudioDevice(const char* deviceName, uint32 sampleRate,
+                   uint16 numChannels, size_t bufferSamples, bool capture)
+      : CAudioDevice(sampleRate, numChannels, bufferSamples),
+        m_deviceName(deviceName),
+        m_capture(capture) {}
+
+  ~CAlsaAudioDevice() { Stop(); }
+
+  bool Start(const Callback& callback) override {
+    m_callback = callback;
+    if (!Open(&m_playbackPCM, SND_PCM_STREAM_PLAYBACK)) return false;
+    if (m_capture && !Open(&m_capturePCM, SND_PCM_STREAM_CAPTURE)) {
+      Close();
+      return false;
+    }
+    m_running = true;
+    m_thread = std::thread(&CAlsaAudioDevice::DeviceThread, this);
+    return true;
+  }
+
+  void Stop() override {
+    m_running = false;
+    if (m_thread.joinable()) m_thread.join();
+    Close();
+  }
+
+ private:
+  bool Open(snd_pcm_t** pcm, snd_pcm_stream_t stream) {
+    int error = snd_pcm_open(pcm, m_deviceName.c_str(), stream, 0);
+    if (error >= 0) {
+      unsigned int latencyMicroseconds =
+          unsigned(BufferNanoseconds() * 2 / 1000);
+      error = snd_pcm_set_params(*pcm, SND_PCM_FORMAT_FLOAT,
+                                 SND_PCM_ACCESS_RW_INTERLEAVED, m_numChannels,
+                                 m_sampleRate, 1, latencyMicroseconds);
+    }
+    if (error < 0) {
+      printf("[-----ERROR-----]Could not open ALSA device %s: %s\n",
+             m_deviceName.c_str(), snd_strerror(error));
+      if (*pcm) snd_pcm_close(*pcm);
+      *pcm = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (m_playbackPCM) snd_pcm_close(m_playbackPCM);
+    if (m_capturePCM) snd_pcm_close(m_capturePCM);
+    m_playbackPCM = nullptr;
+    m_capturePCM = nullptr;
+  }
+
+  // reads or writes a whole buffer, recovering from xruns
+  template <typename TRANSFER>
+  bool Transfer(snd_pcm_t* pcm, float* data, const TRANSFER& transfer) {
+    size_t done = 0;
+    while (done < m_bufferSamples) {
+      snd_pcm_sframes_t result = transfer(pcm, &data[done * m_numChannels],
+                                          m_bufferSamples - done);
+      if (result < 0) {
+        if (result == -EPIPE) ++m_stats.m_xruns;
+        if (snd_pcm_recover(pcm, int(result), 1) < 0) {
+          printf("[-----ERROR-----]ALSA device %s failed: %s\n",
+                 m_deviceName.c_str(), snd_strerror(int(result)));
+          return false;
+        }
+        continue;
+      }
+      done += size_t(result);
+    }
+    return true;
+  }
+
+  void DeviceThread() {
+    std::vector<float> input(m_bufferSamples * m_numChannels, 0.0f);
+    std::vector<float> output(m_bufferSamples * m_numChannels);
+    while (m_running) {
+      if (m_capturePCM &&
+          !Transfer(m_capturePCM, input.data(),
+                    [](snd_pcm_t* pcm, float* data, size_t numSamples) {
+                      return snd_pcm_readi(pcm, data, numSamples);
+                    }))
+        break;
+
+      std::fill(output.begin(), output.end(), 0.0f);
+      bool keepGoing = RunCallback(m_capturePCM ? input.data() : nullptr,
+                                   output.data(), m_bufferSamples);
+      if (!Transfer(m_playbackPCM, output.data(),
+                    [](snd_pcm_t* pcm, float* data, size_t numSamples) {
+                      return snd_pcm_writei(pcm, data, numSamples);
+                    }))
+        break;
+      if (!keepGoing) {
+        snd_pcm_drain(m_playbackPCM);
+        break;
+      }
+    }
+    m_running = false;
+  }
+
+  std::string m_deviceName;
+  bool m_capture;
+  snd_pcm_t* m_playbackPCM = nullptr;
+  snd_pcm_t* m_capturePCM = nullptr;
+  std::thread m_thread;
+};
+#endif  // GRANULAR_ALSA
+
+#ifdef GRANULAR_JACK
+// Plays (and optionally captures) as a JACK client, connected to the first
+// physical ports. The sample rate and buffer size are the server's, so they
+// are known once the device is constructed. JACK's ports are one per channel,
+// so audio is interleaved on the way in and out of the callback.
+class CJackAudioDevice : public CAudioDevice {
+ public:
+  CJackAudioDevice(uint16 numChannels, bool capture)
+      : CAudioDevice(48000, numChannels, 1024) {
+    m_client = jack_client_open("GranularSynth", JackNoStartServer, nullptr);
+    if (!m_client) {
+      printf("[-----ERROR-----]Could not connect to the JACK server.\n");
+      return;
+    }
+    m_sampleRate = jack_get_sample_rate(m_client);
+    m_bufferSamples = jack_get_buffer_size(m_client);
+    for (uint16 channel = 0; channel < numChannels; ++channel) {
+      char name[32];
+      snprintf(name, sizeof(name), "out_%i", channel + 1);
+      m_outputPorts.push_back(jack_port_register(
+          m_client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0));
+      if (capture) {
+        snprintf(name, sizeof(name), "in_%i", channel + 1);
+        m_inputPorts.push_back(jack_port_register(
+            m_client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0));
+      }
+    }
+    m_input.resize(m_bufferSamples * numChannels, 0.0f);
+    m_output.resize(m_bufferSamples * numChannels, 0.0f);
+    jack_set_process_callback(m_client, &CJackAudioDevice::Process, this);
+    jack_set_xrun_callback(m_client, &CJackAudioDevice::Xrun, this);
+  }
+
+  ~CJackAudioDevice() {
+    Stop();
+    if (m_client) jack_client_close(m_client);
+  }
+
+  bool Start(const Callback& callback) override {
+    if (!m_client) return false;
+    m_callback = callback;
+    m_running = true;
+    if (jack_activate(m_client)) {
+      printf("[-----ERROR-----]Could not activate the JACK client.\n");
+      m_running = false;
+      return false;
+    }
+    m_active = true;
+    Connect(m_outputPorts, JackPortIsInput, true);
+    Connect(m_inputPorts, JackPortIsOutput, false);
+    return true;
+  }
+
+  void Stop() override {
+    m_running = false;
+    if (m_active) jack_deactivate(m_client);
+    m_active = false;
+  }
+
+ private:
+  // connects our ports to the physical ports with the given flags, in order
+  void Connect(const std::vector<jack_port_t*>& ports, unsigned long flags,
+               bool outgoing) {
+    const char** physical = jack_get_ports(m_client, nullptr, nullptr,
+                                           JackPortIsPhysical | flags);
+    if (!physical) return;
+    for (size_t i = 0; i < ports.size() && physical[i]; ++i) {
+      const char* ours = jack_port_name(ports[i]);
+      if (outgoing)
+        jack_connect(m_client, ours, physical[i]);
+      else
+        jack_connect(m_client, physical[i], ours);
+    }
+    jack_free(physical);
+  }
+
+  static int Process(jack_nframes_t numSamples, void* arg) {
+    CJackAudioDevice* device = static_cast<CJackAudioDevice*>(arg);
+    uint16 numChannels = device->m_numChannels;
+
+    // the buffer size can change while running. Play silence rather than
+    // allocate in the callback.
+    if (!device->m_running || numSamples > device->m_bufferSamples) {
+      for (jack_port_t* port : device->m_outputPorts)
+        memset(jack_port_get_buffer(port, numSamples), 0,
+               numSamples * sizeof(float));
+      return 0;
+    }
+
+    for (size_t channel = 0; channel < device->m_inputPorts.size(); ++channel) {
+      const float* in = static_cast<const float*>(
+          jack_port_get_buffer(device->m_inputPorts[channel], numSamples));
+      for (jack_nframes_t i = 0; i < numSamples; ++i)
+        device->m_input[i * numChannels + channel] = in[i];
+    }
+    std::fill(device->m_output.begin(), device->m_output.end(), 0.0f);
+    if (!device->RunCallback(
+            device->m_inputPorts.empty() ? nullptr : device->m_input.data(),
+            device->m_output.data(), numSamples))
+      device->m_running = false;
+    for (size_t channel = 0; channel < device->m_outputPorts.size();
+         ++channel) {
+      float* out = static_cast<float*>(
+          jack_port_get_buffer(device->m_outputPorts[channel], numSamples));
+      for (jack_nframes_t i = 0; i < numSamples; ++i)
+        out[i] = device->m_output[i * numChannels + channel];
+    }
+    return 0;
+  }
+
+  static int Xrun(void* arg) {
+    ++static_cast<CJackAudioDevice*>(arg)->m_stats.m_xruns;
+    return 0;
+  }
+
+  jack_client_t* m_client = nullptr;
+  std::vector<jack_port_t*> m_outputPorts;
+  std::vector<jack_port_t*> m_inputPorts;
+  std::vector<float> m_input;
+  std::vector<float> m_output;
+  bool m_active = false;
+};
+#endif  // GRANULAR_JACK
+
+// a device callback that plays a pipeline stage, for up to maxSamples samples
+// (frames). Mono stages are played on every channel of the device. Ends
+// playback when the stage ends.
+class CStagePlayer {
+ public:
+  CStagePlayer(CAudioStage* stage, uint16 deviceChannels,
+               size_t maxSamples = c_unknownNumSamples)
+      : m_stage(stage),
+        m_deviceChannels(deviceChannels),
+        m_maxSamples(maxSamples),
+        m_block(c_pipelineBlockSamples * stage->NumChannels()) {}
+
+  bool operator()(const float* input, float* output, size_t numSamples) {
+    uint16 stageChannels = m_stage->NumChannels();
+    size_t done = 0;
+    while (done < numSamples && m_played < m_maxSamples) {
+      size_t wanted = std::min(
+          {numSamples - done, c_pipelineBlockSamples, m_maxSamples - m_played});
+      size_t pulled = m_stage->Pull(m_block.data(), wanted);
+      if (pulled == 0) return false;
+      for (size_t i = 0; i < pulled; ++i) {
+        float* frame = &output[(done + i) * m_deviceChannels];
+        for (uint16 channel = 0; channel < m_deviceChannels; ++channel)
+          frame[channel] =
+              m_block[i * stageChannels +
+                      (stageChannels == 1 ? 0 : channel % stageChannels)];
+      }
+      done += pulled;
+      m_played += pulled;
+    }
+    return m_played < m_maxSamples;
+  }
+
+ private:
+  CAudioStage* m_stage;
+  uint16 m_deviceChannels;
+  size_t m_maxSamples;
+  size_t m_played = 0;
+  std::vector<float> m_block;
+};
+
+// writes the stats of the job that just finished, if asked to, and starts
+// counting again for the next one
+void ReportJob(const char* statsFileName, const char* jobName) {
+  if (statsFileName) StatsAppendSummary(statsFileName, jobName);
+  StatsReset();
+}
+
+// A job of the demo: renders one of the data/out_*.wav files from the
+// source audio. The shipped files are the golden outputs of these, which
+// the regression check compares against. Scenarios that render another's
+// output a different way (from a pipe, say) name that one's golden output,
+// and are only run by the check.
+struct SScenario {
+  const char* m_name;
+  std::function<void(std::vector<float>* out)> m_render;
+  const char* m_goldenName;
+};
+
+// Feeds a pipe from a thread of its own, the way a shell pipeline feeds
+// stdin, for scenarios that read their input from one. write gets the write
+// end, which is closed after it returns.
+class CPipeFeeder {
+ public:
+  explicit CPipeFeeder(std::function<void(FILE* file)> write) {
+    int fds[2];
+#ifdef _WIN32
+    if (_pipe(fds, 1 << 16, _O_BINARY) != 0) return;
+    m_readEnd = _fdopen(fds[0], "rb");
+    FILE* writeEnd = _fdopen(fds[1], "wb");
+#else
+    // a reader that gives up early mustn't take the process down with it
+    signal(SIGPIPE, SIG_IGN);
+    if (pipe(fds) != 0) return;
+    m_readEnd = fdopen(fds[0], "rb");
+    FILE* writeEnd = fdopen(fds[1], "wb");
+#endif
+    m_thread = std::thread([write, writeEnd]() {
+      write(writeEnd);
+      fclose(writeEnd);
+    });
+  }
+
+  ~CPipeFeeder() {
+    if (m_thread.joinable()) m_thread.join();
+  }
+
+  // the read end, for whoever reads the pipe to take ownership of. Null if
+  // the pipe couldn't be made.
+  FILE* ReadEnd() const { return m_readEnd; }
+
+ private:
+  FILE* m_readEnd = nullptr;
+  std::thread m_thread;
+};
+
+// the demo jobs, rendering from source. Everything is captured by reference
+// and has to outlive the scenarios.
+std::vector<SScenario> MakeScenarios(const std::vector<float>& source,
+                                     uint16 numChannels, uint32 sampleRate,
+                                     CThreadPool& threadPool,
+                                     CRenderPlanCache& planCache) {
+  std::vector<SScenario> scenarios;
+  auto add = [&scenarios](const char* name,
+                 std::function<void(std::vector<float>* out)> render) {
+    scenarios.push_back({name, render, name});
+  };
+  auto timeAdjust = [&](float timeMultiplier) {
+    return [=, &source, &threadPool](std::vector<float>* out) {
+      TimeAdjust(source, out, numChannels, timeMultiplier, &threadPool);
+    };
+  };
+  auto granular = [&](float timeMultiplier, float pitchMultiplier) {
+    return [=, &source](std::vector<float>* out) {
+      GranularTimePitchAdjust(source, out, numChannels, sampleRate,
+                              timeMultiplier, pitchMultiplier, 0.02f, 0.002f);
+    };
+  };
+
+  // speed up the audio and increase pitch
+  add("out_A_FastHigh", timeAdjust(0.7f));
+  add("out_A_FasterHigher", timeAdjust(0.4f));
+
+  // slow down the audio and decrease pitch
+  add("out_A_SlowLow", timeAdjust(1.3f));
+  add("out_A_SlowerLower", timeAdjust(2.1f));
+
+  // speed up audio without affecting pitch
+  add("out_B_Fast", granular(0.7f, 1.0f));
+  add("out_B_Faster", granular(0.4f, 1.0f));
+
+  // slow down audio without affecting pitch
+  add("out_B_Slow", granular(1.3f, 1.0f));
+  add("out_B_Slower", granular(2.1f, 1.0f));
+
+  // Make pitch higher without affecting length
+  //
+  // do it in two steps - first as a granular time adjust, and then as a
+  // pitch/time adjust. The steps are chained a block at a time, so the
+  // stretched audio in between never exists in full.
+  add("out_C_HighAlternate", [=, &source,
+                               &planCache](std::vector<float>* out) {
+    CPipeline pipeline;
+    pipeline.Add(new CGranularStage(
+        source, planCache.Get(source.size() / numChannels, numChannels,
+                              sampleRate, 1.0f / 0.7f, 1.0f, 0.02f, 0.002f)));
+    pipeline.Add(new CResampleStage(pipeline.Last(), 0.7f));
+    DrainStage(pipeline.Last(), out);
+  });
+
+  // do it in one step by changing grain playback speeds
+  add("out_C_High", granular(1.0f, 1.0f / 0.7f));
+  add("out_C_Higher", granular(1.0f, 1.0f / 0.4f));
+
+  // make pitch lower without affecting length
+  add("out_C_Low", granular(1.0f, 1.0f / 1.3f));
+  add("out_C_Lower", granular(1.0f, 1.0f / 2.1f));
+
+  // Make pitch lower but speed higher
+  add("out_D_SlowHigh", granular(1.3f, 1.0f / 0.7f));
+  add("out_D_FastLow", granular(0.7f, 1.0f / 1.3f));
+
+  // dynamic tests which change time and pitch multipliers over time (for each
+  // input grain). Their grains are rendered on the thread pool.
+  //
+  // adjust pitch on a sine wave
+  add("out_E_Pitch", [=, &source, &threadPool](std::vector<float>* out) {
+    GranularTimePitchAdjustDynamic(
+        source, out, numChannels, sampleRate, 0.02f, 0.002f,
+        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
+          // time is 1
+          // pitch is 10hz from 0.75 to 1.25
+          timeMultiplier = 1.0f;
+          pitchMultiplier =
+              1.0f /
+              ((std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 0.5f + 0.75f);
+        },
+        EInterpolation::Cubic, &threadPool);
+  });
+
+  // adjust speed on a sine wave
+  add("out_E_Time", [=, &source, &threadPool](std::vector<float>* out) {
+    GranularTimePitchAdjustDynamic(
+        source, out, numChannels, sampleRate, 0.02f, 0.002f,
+        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
+          // time is 13hz from 0.5 to 2.5
+          // pitch is 1
+          timeMultiplier =
+              (std::sin(percent * c_pi * 13.0f) * 0.5f + 0.5f) * 2.0f + 0.5f;
+          pitchMultiplier = 1.0f;
+        },
+        EInterpolation::Cubic, &threadPool);
+  });
+
+  // adjust time and speed on a sine wave
+  add("out_E_TimePitch", [=, &source, &threadPool](std::vector<float>* out) {
+    GranularTimePitchAdjustDynamic(
+        source, out, numChannels, sampleRate, 0.02f, 0.002f,
+        [](float percent, float& timeMultiplier, float& pitchMultiplier) {
+          // time is 13hz from 0.5 to 2.5
+          // pitch is 10hz from 0.75 to 1.25
+          timeMultiplier =
+              (std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 2.0f + 0.5f;
+          pitchMultiplier =
+              1.0f /
+              ((std::sin(percent * c_pi * 10.0f) * 0.5f + 0.5f) * 0.5f + 0.75f);
+        },
+        EInterpolation::Cubic, &threadPool);
+  });
+
+  // the wave file piped in, read by the streaming wave reader as it arrives
+  scenarios.push_back({"pipe_B_Fast", [=](std::vector<float>* out) {
+    std::vector<unsigned char> file;
+    ReadFileIntoMemory("data/legend1.wav", &file);
+    CPipeFeeder feeder([&file](FILE* pipe) {
+      fwrite(file.data(), 1, file.size(), pipe);
+    });
+    out->clear();
+    if (!feeder.ReadEnd()) return;
+    std::unique_ptr<CInputStage> input =
+        OpenInputStage(feeder.ReadEnd(), "pipe");
+    if (!input) return;
+    std::vector<float> piped;
+    DrainStage(input.get(), &piped);
+    GranularTimePitchAdjust(piped, out, input->NumChannels(),
+                            input->SampleRate(), 0.7f, 1.0f, 0.02f, 0.002f);
+  }, "out_B_Fast"});
+
+  // the source piped in as FLAC, decoded a frame at a time on the decode
+  // ahead thread while the resampler pulls from it, the way a resample job
+  // reads its input. It's encoded from the wave file's own 24 bit samples,
+  // since floats don't make the round trip through PCM exactly.
+  scenarios.push_back({"pipe_A_SlowLow", [=](std::vector<float>* out) {
+    std::vector<unsigned char> file;
+    std::vector<SRiffChunk> chunks;
+    ReadFileIntoMemory("data/legend1.wav", &file);
+    IndexWaveChunks(file, "data/legend1.wav", &chunks);
+    CPipeFeeder feeder([&](FILE* pipe) {
+      for (const SRiffChunk& chunk : chunks) {
+        if (memcmp(chunk.m_id, "data", 4)) continue;
+        std::vector<int32> samples(size_t(chunk.m_size) / 3);
+        for (size_t i = 0; i < samples.size(); ++i) {
+          const unsigned char* PCM = &file[chunk.m_offset + i * 3];
+          samples[i] = int32(uint32(PCM[0]) << 8 | uint32(PCM[1]) << 16 |
+                             uint32(PCM[2]) << 24) >> 8;
+        }
+        CThreadPool encodeThreadPool(1);
+        CFlacEncoder encoder(numChannels, sampleRate, 24, &encodeThreadPool);
+        std::vector<unsigned char> encoded;
+        encoder.MakeHeader(&encoded, samples.size() / numChannels);
+        encoder.Encode(samples.data(), samples.size() / numChannels,
+                       &encoded);
+        fwrite(encoded.data(), 1, encoded.size(), pipe);
+      }
+    });
+    out->clear();
+    if (!feeder.ReadEnd()) return;
+    std::unique_ptr<CInputStage> input =
+        OpenInputStage(feeder.ReadEnd(), "pipe");
+    if (!input) return;
+    CResampleStage resample(input.get(), 1.3f);
+    DrainStage(&resample, out);
+  }, "out_A_SlowLow"});
+
+  // the live engine, driven by a control thread before each second of
+  // output. Each time it pushes far more settings than the engine takes in a
+  // block, of which only the last should count.
+  add("live_Sweep", [=, &source](std::vector<float>* out) {
+    CLiveGranularStage stage(source, numChannels, sampleRate, SLiveParams());
+    out->clear();
+    std::vector<float> block(c_pipelineBlockSamples * numChannels);
+    const float c_sweepTo[][2] = {{0.7f, 1.25f}, {1.5f, 0.8f}, {1.0f, 1.0f}};
+    for (const float* sweepTo : c_sweepTo) {
+      std::thread control([&stage, sweepTo]() {
+        SLiveParams params;
+        for (int i = 1; i <= 1000; ++i) {
+          float amount = float(i) / 1000.0f;
+          params.m_timeMultiplier = 1.0f + (sweepTo[0] - 1.0f) * amount;
+          params.m_pitchMultiplier = 1.0f + (sweepTo[1] - 1.0f) * amount;
+          stage.PushParams(params);
+        }
+      });
+      control.join();
+
+      for (size_t pulled = 0; pulled < sampleRate;) {
+        size_t numSamples = stage.Pull(
+            block.data(),
+            std::min(c_pipelineBlockSamples, size_t(sampleRate) - pulled));
+        if (numSamples == 0) return;
+        out->insert(out->end(), block.begin(),
+                    block.begin() + numSamples * numChannels);
+        pulled += numSamples;
+      }
+    }
+  });
+
+  // the same for the live input engine, capturing the source a block at a
+  // time as it goes, the way a sound card would
+  add("live_RingSweep", [=, &source](std::vector<float>* out) {
+    CCaptureRing ring(numChannels,
+                      CRingGranularStage::RingSamplesNeeded(sampleRate, 0.5f));
+    CRingGranularStage stage(ring, sampleRate, SRingParams());
+    out->clear();
+    std::vector<float> block(c_pipelineBlockSamples * numChannels);
+    size_t captured = 0;
+    const float c_sweepTo[][2] = {{0.3f, 1.25f}, {0.1f, 0.8f}, {0.2f, 1.0f}};
+    for (const float* sweepTo : c_sweepTo) {
+      std::thread control([&stage, sweepTo]() {
+        SRingParams params;
+        for (int i = 1; i <= 1000; ++i) {
+          float amount = float(i) / 1000.0f;
+          params.m_delaySeconds = 0.1f + (sweepTo[0] - 0.1f) * amount;
+          params.m_pitchMultiplier = 1.0f + (sweepTo[1] - 1.0f) * amount;
+          stage.PushParams(params);
+        }
+      });
+      control.join();
+
+      for (size_t pulled = 0; pulled < sampleRate;) {
+        size_t numSamples =
+            std::min(c_pipelineBlockSamples, size_t(sampleRate) - pulled);
+        numSamples = std::min(numSamples,
+                              source.size() / numChannels - captured);
+        if (numSamples == 0) return;
+        ring.Write(&source[captured * numChannels], numSamples);
+        captured += numSamples;
+        numSamples = stage.Pull(block.data(), numSamples);
+        out->insert(out->end(), block.begin(),
+                    block.begin() + numSamples * numChannels);
+        pulled += numSamples;
+      }
+    }
+  });
+
+  return scenarios;
+}
+
+// how far a render is from its golden output
+struct SCompareResult {
+  bool m_sameFormat = false;  // same channels, sample rate, size and length
+  size_t m_numDifferent = 0;  // samples that aren't bit exact
+  double m_maxAbsError = 0.0;
+  double m_snr = 0.0;  // dB, infinity when identical
+};
+
+// compares a render against the golden output, after quantizing it the same
+// way WriteWaveFile() would, so bit exact means the files would be identical
+void CompareToGolden(const std::vector<float>& rendered, uint16 numBytes,
+                     const std::vector<float>& golden, SCompareResult* result) {
+  std::vector<unsigned char> PCM(rendered.size() * numBytes);
+  CPCMEncoder encoder(1, numBytes, EDither::None);
+  encoder.Encode(rendered.data(), rendered.size(), PCM.data());
+
+  // samples past the end of the shorter one count as errors against silence
+  size_t numSamples = std::max(rendered.size(), golden.size());
+  double signal = 0.0;
+  double noise = 0.0;
+  for (size_t i = 0; i < numSamples; ++i) {
+    float value = 0.0f;
+    if (i < rendered.size()) PCMToFloat(&value, &PCM[i * numBytes], numBytes);
+    float expected = i < golden.size() ? golden[i] : 0.0f;
+    if (value != expected) ++result->m_numDifferent;
+    double error = double(value) - double(expected);
+    result->m_maxAbsError = std::max(result->m_maxAbsError, fabs(error));
+    signal += double(expected) * expected;
+    noise += error * error;
+  }
+  result->m_snr = noise > 0.0 ? 10.0 * log10(signal / noise) : INFINITY;
+}
+
+// scenario timings, one "name,milliseconds" line each
+bool ReadTimings(const char* fileName, std::map<std::string, double>* timings) {
+  FILE* file = nullptr;
+  fopen_s(&file, fileName, "rt");
+  if (!file) {
+    printf("[-----ERROR-----]Could not open %s for reading.\n", fileName);
+    return false;
+  }
+  char name[256];
+  double milliseconds;
+  while (fscanf(file, " %255[^,],%lf", name, &milliseconds) == 2)
+    (*timings)[name] = milliseconds;
+  fclose(file);
+  return true;
+}
+
+// Regression check. Renders every scenario without writing it, and compares
+// it to its golden output in data/, either bit for bit or, when a minimum SNR
+// or maximum error is given, within that tolerance. Prints the render time of
+// each scenario, and the speedup over a baseline run if given one.
+//
+//   --check [--snr dB] [--max-abs error] [--repeat count]
+//           [--baseline timings.csv] [--save-times timings.csv]
+//
+// Returns the process exit code: 0 if everything passed.
+int RunRegressionCheck(int argc, char** argv) {
+  double minSNR = 0.0;
+  double maxAbsError = 0.0;
+  bool tolerance = false;
+  int repeat = 1;
+  const char* baselineFileName = nullptr;
+  const char* saveTimesFileName = nullptr;
+  size_t numThreads = 0;
+  for (int i = 2; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--snr") && hasValue) {
+      minSNR = atof(argv[++i]);
+      tolerance = true;
+    } else if (!strcmp(argv[i], "--max-abs") && hasValue) {
+      maxAbsError = atof(argv[++i]);
+      tolerance = true;
+    } else if (!strcmp(argv[i], "--repeat") && hasValue) {
+      repeat = std::max(1, atoi(argv[++i]));
+    } else if (!strcmp(argv[i], "--baseline") && hasValue) {
+      baselineFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--save-times") && hasValue) {
+      saveTimesFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--threads") && hasValue) {
+      numThreads = size_t(std::max(0, atoi(argv[++i])));
+    } else {
+      printf("[-----ERROR-----]Unknown option %s.\n", argv[i]);
+      return 2;
+    }
+  }
+
+  std::map<std::string, double> baseline;
+  if (baselineFileName && !ReadTimings(baselineFileName, &baseline)) return 2;
+
+  uint16 numChannels;
+  uint32 sampleRate;
+  uint16 numBytes;
+  std::vector<float> source;
+  if (!ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
+                    &numBytes))
+    return 2;
+  CThreadPool threadPool(numThreads);
+  CRenderPlanCache planCache;
+  std::vector<SScenario> scenarios =
+      MakeScenarios(source, numChannels, sampleRate, threadPool, planCache);
+
+  std::string timings;
+  int numFailed = 0;
+  printf("\n%-22s %-6s %10s %12s %10s %10s\n", "scenario", "result",
+         "SNR (dB)", "max error", "time (ms)", "speedup");
+  for (const SScenario& scenario : scenarios) {
+    // the best of a few renders, to keep noise out of the timings. The plan
+    // cache is cleared so every render pays for planning, like the first.
+    std::vector<float> out;
+    double milliseconds = INFINITY;
+    for (int i = 0; i < repeat; ++i) {
+      planCache.Clear();
+      auto start = std::chrono::steady_clock::now();
+      scenario.m_render(&out);
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      milliseconds = std::min(milliseconds, elapsed.count());
+    }
+    StatsReset();
+
+    std::string goldenFileName =
+        std::string("data/") + scenario.m_goldenName + ".wav";
+    std::vector<float> golden;
+    uint16 goldenChannels = 0;
+    uint32 goldenSampleRate = 0;
+    uint16 goldenBytes = 0;
+    SCompareResult result;
+    if (ReadWaveFile(goldenFileName.c_str(), &golden, &goldenChannels,
+                     &goldenSampleRate, &goldenBytes)) {
+      result.m_sameFormat = goldenChannels == numChannels &&
+                            goldenSampleRate == sampleRate &&
+                            goldenBytes == numBytes &&
+                            golden.size() == out.size();
+      CompareToGolden(out, numBytes, golden, &result);
+    }
+
+    bool passed;
+    if (tolerance)
+      passed = result.m_sameFormat && result.m_snr >= minSNR &&
+               (maxAbsError <= 0.0 || result.m_maxAbsError <= maxAbsError);
+    else
+      passed = result.m_sameFormat && result.m_numDifferent == 0;
+    if (!passed) ++numFailed;
+
+    char speedup[32] = "-";
+    auto it = baseline.find(scenario.m_name);
+    if (it != baseline.end())
+      snprintf(speedup, sizeof(speedup), "%.2fx", it->second / milliseconds);
+    printf("%-22s %-6s %10.1f %12.3g %10.2f %10s\n", scenario.m_name,
+           passed ? "ok" : "FAILED", result.m_snr, result.m_maxAbsError,
+           milliseconds, speedup);
+
+    char line[300];
+    snprintf(line, sizeof(line), "%s,%f\n", scenario.m_name, milliseconds);
+    timings += line;
+  }
+
+  if (saveTimesFileName) {
+    FILE* file = nullptr;
+    fopen_s(&file, saveTimesFileName, "wt");
+    if (!file) {
+      printf("[-----ERROR-----]Could not open %s for writing.\n",
+             saveTimesFileName);
+      return 2;
+    }
+    fputs(timings.c_str(), file);
+    fclose(file);
+  }
+
+  printf("\n%i of %i scenarios %s.\n", int(scenarios.size()) - numFailed,
+         int(scenarios.size()), tolerance ? "within tolerance" : "bit exact");
+  return numFailed ? 1 : 0;
+}
+
+// finds name in a table of enum value names
+template <typename T, size_t N>
+bool ParseEnumName(const char* name, const char* (&names)[N], T* value) {
+  for (size_t i = 0; i < N; ++i) {
+    if (!strcmp(name, names[i])) {
+      *value = T(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// ./source --cloud [--grains n] [--seconds s] [--quality q] [--out file]:
+// renders a grain cloud averaging n overlapping grains from the demo source
+// and reports how much faster than real time it went, optionally writing it
+// out.
+int RunCloudBenchmark(int argc, char** argv) {
+  float numGrains = 1000.0f;
+  float seconds = 10.0f;
+  EInterpolation quality = EInterpolation::Cubic;
+  const char* outFileName = nullptr;
+  for (int i = 2; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--grains") && hasValue) {
+      numGrains = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--seconds") && hasValue) {
+      seconds = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--quality") && hasValue &&
+               ParseEnumName(argv[i + 1], c_interpolationNames, &quality)) {
+      ++i;
+    } else if (!strcmp(argv[i], "--out") && hasValue) {
+      outFileName = argv[++i];
+    } else {
+      printf("[-----ERROR-----]Unknown option %s.\n", argv[i]);
+      return 2;
+    }
+  }
+
+  uint16 numChannels;
+  uint32 sampleRate;
+  uint16 numBytes;
+  std::vector<float> source;
+  if (!ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
+                    &numBytes))
+    return 2;
+
+  SGrainCloudParams params;
+  params.m_positionSpread = 0.5f;
+  params.m_pitchSpread = 12.0f;
+  params.m_density = numGrains / params.m_durationSeconds;
+  params.m_quality = quality;
+  CGrainCloud cloud(source, numChannels, sampleRate,
+                    size_t(seconds * float(sampleRate)));
+  cloud.SetParams(params);
+
+  std::vector<float> out;
+  out.reserve(cloud.NumSamples() * 2);
+  std::vector<float> block(c_pipelineBlockSamples * 2);
+  size_t numBlocks = 0;
+  size_t voiceSum = 0;
+  size_t maxVoices = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (size_t numSamples = cloud.Pull(block.data(), c_pipelineBlockSamples)) {
+    out.insert(out.end(), block.begin(), block.begin() + numSamples * 2);
+    ++numBlocks;
+    voiceSum += cloud.NumActiveVoices();
+    maxVoices = std::max(maxVoices, cloud.NumActiveVoices());
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("%.1f seconds with %.0f grains on average (%zu at most, %zu "
+         "dropped) in %.1fms, %.1fx real time.\n",
+         seconds, numBlocks ? double(voiceSum) / double(numBlocks) : 0.0,
+         maxVoices, cloud.NumDroppedGrains(), elapsed.count() * 1000.0,
+         double(seconds) / elapsed.count());
+
+  if (outFileName &&
+      !WriteWaveFile(outFileName, &out, 2, sampleRate, numBytes))
+    return 2;
+  return 0;
+}
+
+// ./source --interpolation [--repeat n]: times each interpolation quality on
+// a granular pitch shift and a resample of the demo source, and measures how
+// accurately each resamples sine waves, against the exact sine.
+int RunInterpolationBenchmark(int argc, char** argv) {
+  int repeat = 3;
+  for (int i = 2; i < argc; ++i) {
+    if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+      repeat = std::max(1, atoi(argv[++i]));
+    } else {
+      printf("[-----ERROR-----]Unknown option %s.\n", argv[i]);
+      return 2;
+    }
+  }
+
+  uint16 numChannels;
+  uint32 sampleRate;
+  uint16 numBytes;
+  std::vector<float> source;
+  if (!ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
+                    &numBytes))
+    return 2;
+
+  // the best of a few runs of a job, in milliseconds
+  auto time = [repeat](const std::function<void()>& job) {
+    double milliseconds = INFINITY;
+    for (int i = 0; i < repeat; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      job();
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      milliseconds = std::min(milliseconds, elapsed.count());
+    }
+    return milliseconds;
+  };
+
+  // SNR of resampling a second of a sine of the given frequency by a time
+  // multiplier, ignoring the ends where the input is clamped
+  auto sineSNR = [sampleRate](float frequency, EInterpolation quality) {
+    const float timeMultiplier = 1.37f;
+    std::vector<float> sine(sampleRate), out;
+    for (size_t i = 0; i < sine.size(); ++i)
+      sine[i] = float(std::sin(2.0 * 3.14159265358979323846 * frequency *
+                               double(i) / double(sampleRate)));
+    TimeAdjust(sine, &out, 1, timeMultiplier, nullptr, quality);
+    double signal = 0.0, noise = 0.0;
+    for (size_t i = 64; i + 64 < out.size(); ++i) {
+      // where TimeAdjust() read this sample from
+      float percent = float(i) / float(out.size() - 1);
+      double position = double(float(sine.size()) * percent);
+      double exact = std::sin(2.0 * 3.14159265358979323846 * frequency *
+                              position / double(sampleRate));
+      signal += exact * exact;
+      noise += (out[i] - exact) * (out[i] - exact);
+    }
+    return 10.0 * std::log10(signal / std::max(noise, 1e-30));
+  };
+
+  printf("\n%-10s %14s %14s %12s %12s\n", "quality", "granular (ms)",
+         "resample (ms)", "1kHz SNR", "8kHz SNR");
+  std::vector<float> out;
+  for (int i = 0; i < int(EInterpolation::Count); ++i) {
+    EInterpolation quality = EInterpolation(i);
+    double granular = time([&] {
+      GranularTimePitchAdjust(source, &out, numChannels, sampleRate, 1.0f,
+                              1.0f / 0.7f, 0.02f, 0.002f, EGrainWindow::None,
+                              4.0f, quality);
+    });
+    double resample = time([&] {
+      TimeAdjust(source, &out, numChannels, 0.7f, nullptr, quality);
+    });
+    printf("%-10s %14.2f %14.2f %10.1fdB %10.1fdB\n",
+           c_interpolationNames[i], granular, resample,
+           sineSNR(1000.0f, quality), sineSNR(8000.0f, quality));
+  }
+
+  // the same cubic jobs from each source format, compared to the float
+  // source's output
+  std::vector<float> reference;
+  GranularTimePitchAdjust(source, &reference, numChannels, sampleRate, 1.0f,
+                          1.0f / 0.7f, 0.02f, 0.002f);
+  std::vector<int16> sourceInt16;
+  std::vector<SHalf> sourceHalf;
+  ConvertSource(source, &sourceInt16);
+  ConvertSource(source, &sourceHalf);
+  auto formatTimes = [&](const std::function<void(std::vector<float>*)>&
+                             granular,
+                         const std::function<void()>& resample,
+                         const char* name, size_t bytes) {
+    double granularTime = time([&] { granular(&out); });
+    double signal = 0.0, noise = 0.0;
+    for (size_t i = 0; i < reference.size() && i < out.size(); ++i) {
+      signal += double(reference[i]) * double(reference[i]);
+      noise += double(out[i] - reference[i]) * double(out[i] - reference[i]);
+    }
+    double resampleTime = time(resample);
+    printf("%-10s %10.1fMB %14.2f %14.2f", name,
+           double(bytes) / (1024.0 * 1024.0), granularTime, resampleTime);
+    if (noise > 0.0)
+      printf(" %10.1fdB\n", 10.0 * std::log10(signal / noise));
+    else
+      printf(" %12s\n", "exact");
+  };
+
+  printf("\n%-10s %12s %14s %14s %12s\n", "source", "memory",
+         "granular (ms)", "resample (ms)", "SNR");
+  formatTimes(
+      [&](std::vector<float>* result) {
+        GranularTimePitchAdjust(source, result, numChannels, sampleRate, 1.0f,
+                                1.0f / 0.7f, 0.02f, 0.002f);
+      },
+      [&] { TimeAdjust(source, &out, numChannels, 0.7f); }, "float",
+      source.size() * sizeof(float));
+  formatTimes(
+      [&](std::vector<float>* result) {
+        GranularTimePitchAdjust(sourceInt16, result, numChannels, sampleRate,
+                                1.0f, 1.0f / 0.7f, 0.02f, 0.002f);
+      },
+      [&] { TimeAdjust(sourceInt16, &out, numChannels, 0.7f); }, "int16",
+      sourceInt16.size() * sizeof(int16));
+  formatTimes(
+      [&](std::vector<float>* result) {
+        GranularTimePitchAdjust(sourceHalf, result, numChannels, sampleRate,
+                                1.0f, 1.0f / 0.7f, 0.02f, 0.002f);
+      },
+      [&] { TimeAdjust(sourceHalf, &out, numChannels, 0.7f); }, "half",
+      sourceHalf.size() * sizeof(SHalf));
+  StatsReset();
+  return 0;
+}
+
+// ./source --play [--device null|null-realtime|alsa[:name]|jack] [--seconds s]
+// [--buffer samples] [--time t] [--pitch p] [--quality q] [--record file.wav]
+// [--sweep s] [--input [--delay s] [--spread s] [--freeze-after s]]: plays the
+// demo source through the live granular engine on an audio device, then
+// prints the device's xruns and callback times. The null devices need no
+// sound hardware; --record writes what they played. --sweep has a control
+// thread push settings to the engine every 10ms while it plays, sweeping the
+// pitch an octave either side and back every s seconds. With --input, what
+// the device captures is granulated instead (the null devices capture the
+// demo source), delayed and optionally frozen after a while.
+int RunPlayback(int argc, char** argv) {
+  const char* deviceName = "null";
+  float seconds = 10.0f;
+  size_t bufferSamples = 256;
+  SLiveParams params;
+  const char* recordFileName = nullptr;
+  bool liveInput = false;
+  SRingParams ringParams;
+  float freezeAfterSeconds = INFINITY;
+  float sweepSeconds = 0.0f;
+  for (int i = 2; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--device") && hasValue) {
+      deviceName = argv[++i];
+    } else if (!strcmp(argv[i], "--seconds") && hasValue) {
+      seconds = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--buffer") && hasValue) {
+      bufferSamples = size_t(std::max(16, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--time") && hasValue) {
+      params.m_timeMultiplier = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--pitch") && hasValue) {
+      params.m_pitchMultiplier = float(atof(argv[++i]));
+      ringParams.m_pitchMultiplier = params.m_pitchMultiplier;
+    } else if (!strcmp(argv[i], "--quality") && hasValue &&
+               ParseEnumName(argv[i + 1], c_interpolationNames,
+                             &params.m_interpolation)) {
+      ringParams.m_interpolation = params.m_interpolation;
+      ++i;
+    } else if (!strcmp(argv[i], "--input")) {
+      liveInput = true;
+    } else if (!strcmp(argv[i], "--delay") && hasValue) {
+      ringParams.m_delaySeconds = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--spread") && hasValue) {
+      ringParams.m_spreadSeconds = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--freeze-after") && hasValue) {
+      freezeAfterSeconds = float(atof(argv[++i]));
+    } else if (!strcmp(argv[i], "--record") && hasValue) {
+      recordFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--sweep") && hasValue) {
+      sweepSeconds = float(atof(argv[++i]));
+    } else {
+      printf("[-----ERROR-----]Unknown option %s.\n", argv[i]);
+      return 2;
+    }
+  }
+
+  uint16 numChannels;
+  uint32 sampleRate;
+  uint16 numBytes;
+  std::vector<float> source;
+  if (!ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
+                    &numBytes))
+    return 2;
+
+  std::unique_ptr<CAudioDevice> device;
+  if (!strcmp(deviceName, "null") || !strcmp(deviceName, "null-realtime")) {
+    device.reset(new CNullAudioDevice(sampleRate, numChannels, bufferSamples,
+                                      !strcmp(deviceName, "null-realtime"),
+                                      &source, recordFileName, numBytes));
+  }
+#ifdef GRANULAR_ALSA
+  else if (!strncmp(deviceName, "alsa", 4)) {
+    const char* alsaName = deviceName[4] == ':' ? deviceName + 5 : "default";
+    device.reset(new CAlsaAudioDevice(alsaName, sampleRate, numChannels,
+                                      bufferSamples, liveInput));
+  }
+#endif
+#ifdef GRANULAR_JACK
+  else if (!strcmp(deviceName, "jack")) {
+    device.reset(new CJackAudioDevice(numChannels, liveInput));
+  }
+#endif
+  else {
+    printf("[-----ERROR-----]Unknown device %s (ALSA and JACK need building "
+           "with make ALSA=1 or JACK=1).\n",
+           deviceName);
+    return 2;
+  }
+
+  // the engine runs at the source's rate, converted to the device's if the
+  // device has its own, as JACK does. Live input is granulated at the
+  // device's rate.
+  CPipeline pipeline;
+  std::unique_ptr<CCaptureRing> ring;
+  CLiveGranularStage* liveStage = nullptr;
+  CRingGranularStage* ringStage = nullptr;
+  if (liveInput) {
+    float maxDelaySeconds =
+        ringParams.m_delaySeconds + ringParams.m_spreadSeconds;
+    ring.reset(new CCaptureRing(
+        device->NumChannels(),
+        CRingGranularStage::RingSamplesNeeded(device->SampleRate(),
+                                              maxDelaySeconds)));
+    ringStage = pipeline.Add(
+        new CRingGranularStage(*ring, device->SampleRate(), ringParams));
+  } else {
+    liveStage = pipeline.Add(
+        new CLiveGranularStage(source, numChannels, sampleRate, params));
+    if (device->SampleRate() != sampleRate)
+      pipeline.Add(new CSampleRateStage(pipeline.Last(), sampleRate,
+                                        device->SampleRate()));
+  }
+
+  // capture into the ring, then play what the engine makes of it
+  CStagePlayer player(pipeline.Last(), device->NumChannels(),
+                      size_t(seconds * float(device->SampleRate())));
+  size_t freezeAfterSamples =
+      std::isinf(freezeAfterSeconds)
+          ? size_t(-1)
+          : size_t(freezeAfterSeconds * float(device->SampleRate()));
+  size_t captured = 0;
+  CAudioDevice::Callback callback = [&](const float* input, float* output,
+                                        size_t numSamples) {
+    if (ring && input) {
+      if (captured >= freezeAfterSamples) ring->SetFrozen(true);
+      ring->Write(input, numSamples);
+      captured += numSamples;
+    }
+    return player(input, output, numSamples);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  if (!device->Start(callback)) return 2;
+
+  // the control thread, standing in for a UI or MIDI
+  std::atomic<bool> playing{true};
+  std::thread control;
+  if (sweepSeconds > 0.0f) {
+    control = std::thread([&]() {
+      while (playing) {
+        std::chrono::duration<float> elapsed =
+            std::chrono::steady_clock::now() - start;
+        float octaves = std::sin(2.0f * c_pi * elapsed.count() / sweepSeconds);
+        if (liveStage) {
+          SLiveParams swept = params;
+          swept.m_pitchMultiplier *= std::exp2(octaves);
+          liveStage->PushParams(swept);
+        } else {
+          SRingParams swept = ringParams;
+          swept.m_pitchMultiplier *= std::exp2(octaves);
+          ringStage->PushParams(swept);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    });
+  }
+
+  while (device->Running())
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  device->Stop();
+  playing = false;
+  if (control.joinable()) control.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  printf("played %.1f seconds in %.1f seconds on %s, %zu sample buffers:\n",
+         seconds, elapsed.count(), deviceName, device->BufferSamples());
+  device->Stats().Print(device->BufferNanoseconds());
+  return 0;
+}
+
+// Command line jobs. A job renders one input file into one output file, wave
+// or FLAC by extension:
+//   ./source --time 1.3 --pitch 0.8 in.wav out.flac
+// A batch file lists one job per line, with the same file names and options.
+// Options given on the command line are the defaults for every line.
+enum class EEngine {
+  Granular,  // GranularTimePitchAdjust()
+  Resample,  // TimeAdjust(), which changes pitch along with time
+
+  Count
+};
+
+static const char* c_engineNames[] = {"granular", "resample"};
+
+static const char* c_grainWindowNames[] = {"none", "hann", "tukey",
+                                           "gaussian"};
+
+enum class EJobOption {
+  Time,
+  Pitch,
+  Grain,
+  CrossFade,
+  Window,
+  Overlap,
+  Quality,
+  Engine,
+  Bits,
+  SourceFormat,
+
+  Count
+};
+
+static const char* c_jobOptionNames[] = {
+    "--time",    "--pitch",   "--grain",  "--crossfade", "--window",
+    "--overlap", "--quality", "--engine", "--bits",   "--source-format",
+};
+
+struct SJob {
+  std::string m_inputFileName;
+  std::string m_outputFileName;
+  EEngine m_engine = EEngine::Granular;
+  float m_timeMultiplier = 1.0f;
+  float m_pitchMultiplier = 1.0f;
+  float m_grainSizeSeconds = 0.02f;
+  float m_crossFadeSeconds = 0.002f;  // 0 to the grain size
+  EGrainWindow m_window = EGrainWindow::None;
+  float m_overlap = 4.0f;
+  EInterpolation m_quality = EInterpolation::Cubic;
+  uint16 m_numBytes = 0;  // per output sample, 0 keeps the input's
+  ESourceFormat m_sourceFormat = ESourceFormat::Float;
+};
+
+// the whole of text has to be a finite number
+bool ParseFloat(const char* text, float* value) {
+  char* end = nullptr;
+  errno = 0;
+  *value = strtof(text, &end);
+  return end != text && *end == 0 && errno == 0 && std::isfinite(*value);
+}
+
+// Reads options and file names into job, the first file name being the input
+// and the second the output. Returns false, after saying why, on an unknown
+// option or a value that makes no sense.
+bool ParseJobArguments(const std::vector<std::string>& args, SJob* job) {
+  size_t numFileNames = 0;
+  for (size_t i = 0; i < args.size(); ++i) {
+    const char* arg = args[i].c_str();
+
+    // "-" is stdin
+    if (arg[0] != '-' || !arg[1]) {
+      if (numFileNames >= 2) {
+        printf("[-----ERROR-----]Unexpected file name %s, a job has one "
+               "input and one output.\n",
+               arg);
+        return false;
+      }
+      if (numFileNames++ == 0)
+        job->m_inputFileName = arg;
+      else
+        job->m_outputFileName = arg;
+      continue;
+    }
+
+    EJobOption option;
+    if (!ParseEnumName(arg, c_jobOptionNames, &option)) {
+      printf("[-----ERROR-----]Unknown option %s.\n", arg);
+      return false;
+    }
+    if (i + 1 >= args.size()) {
+      printf("[-----ERROR-----]Option %s needs a value.\n", arg);
+      return false;
+    }
+    const char* value = args[++i].c_str();
+
+    float number = 0.0f;
+    bool valid = ParseFloat(value, &number);
+    switch (option) {
+      case EJobOption::Time:
+        job->m_timeMultiplier = number;
+        valid = valid && number > 0.0f;
+        break;
+      case EJobOption::Pitch:
+        job->m_pitchMultiplier = number;
+        valid = valid && number > 0.0f;
+        break;
+      case EJobOption::Grain:
+        job->m_grainSizeSeconds = number;
+        valid = valid && number > 0.0f;
+        break;
+      case EJobOption::CrossFade:
+        job->m_crossFadeSeconds = number;
+        valid = valid && number >= 0.0f;
+        break;
+      case EJobOption::Overlap:
+        job->m_overlap = number;
+        valid = valid && number >= 1.0f;
+        break;
+      case EJobOption::Bits:
+        job->m_numBytes = uint16(number) / 8;
+        valid = valid && (number == 8.0f || number == 16.0f ||
+                          number == 24.0f || number == 32.0f);
+        break;
+      case EJobOption::Window:
+        valid = ParseEnumName(value, c_grainWindowNames, &job->m_window);
+        break;
+      case EJobOption::Quality:
+        valid = ParseEnumName(value, c_interpolationNames, &job->m_quality);
+        break;
+      case EJobOption::Engine:
+        valid = ParseEnumName(value, c_engineNames, &job->m_engine);
+        break;
+      case EJobOption::SourceFormat:
+        valid =
+            ParseEnumName(value, c_sourceFormatNames, &job->m_sourceFormat);
+        break;
+      case EJobOption::Count:
+        break;
+    }
+    if (!valid) {
+      printf("[-----ERROR-----]Bad value %s for %s.\n", value, arg);
+      return false;
+    }
+  }
+  return true;
+}
+
+// the checks that need all of a job's options at once
+bool ValidateJob(const SJob& job) {
+  if (job.m_inputFileName.empty() || job.m_outputFileName.empty()) {
+    printf("[-----ERROR-----]A job needs an input and an output file.\n");
+    return false;
+  }
+  if (job.m_crossFadeSeconds > job.m_grainSizeSeconds) {
+    printf("[-----ERROR-----]The cross fade can't be longer than a grain.\n");
+    return false;
+  }
+  if (job.m_engine == EEngine::Resample && job.m_pitchMultiplier != 1.0f) {
+    printf("[-----ERROR-----]The resample engine can't change pitch apart "
+           "from time.\n");
+    return false;
+  }
+  return true;
+}
+
+// Splits a batch file into one list of arguments per line, skipping blank
+// lines and # comments. Arguments are separated by spaces, and can be quoted
+// to contain them.
+void SplitBatchFile(const char* text, size_t size,
+                    std::vector<std::vector<std::string>>* lines,
+                    std::vector<size_t>* lineNumbers) {
+  std::vector<std::string> args;
+  std::string arg;
+  bool inArg = false, quoted = false, comment = false;
+  size_t lineNumber = 1;
+  auto endArg = [&]() {
+    if (inArg) args.push_back(arg);
+    arg.clear();
+    inArg = false;
+  };
+  for (size_t i = 0; i <= size; ++i) {
+    char c = i < size ? text[i] : '\n';
+    if (c == '\n' || c == '\r') {
+      endArg();
+      if (!args.empty()) {
+        lines->push_back(args);
+        lineNumbers->push_back(lineNumber);
+        args.clear();
+      }
+      quoted = comment = false;
+      if (c == '\n') ++lineNumber;
+    } else if (comment) {
+      continue;
+    } else if (c == '"') {
+      quoted = !quoted;
+      inArg = true;
+    } else if (quoted) {
+      arg += c;
+    } else if (c == ' ' || c == '\t') {
+      endArg();
+    } else if (c == '#' && !inArg) {
+      comment = true;
+    } else {
+      arg += c;
+      inArg = true;
+    }
+  }
+}
+
+// buffers a job renders with, kept between jobs by the daemon so their
+// memory stays allocated and paged in
+struct SJobBuffers {
+  SDecodedSource m_source;  // unless it comes from a CSourceCache
+  std::vector<float> m_out;
+  std::vector<unsigned char> m_file;  // the encoded output for a "-" output
+};
+
+// renders a job from its decoded source, in whichever format that's in
+template <typename SAMPLE>
+void RenderJob(const SJob& job, const std::vector<SAMPLE>& source,
+               uint16 numChannels, uint32 sampleRate, std::vector<float>* out,
+               CThreadPool* threadPool, CRenderPlanCache* planCache) {
+  switch (job.m_engine) {
+    case EEngine::Granular:
+      if (planCache && job.m_window == EGrainWindow::None) {
+        ExecuteRenderPlan(
+            source,
+            *planCache->Get(source.size() / numChannels, numChannels,
+                            sampleRate, job.m_timeMultiplier,
+                            job.m_pitchMultiplier, job.m_grainSizeSeconds,
+                            job.m_crossFadeSeconds),
+            out, job.m_quality);
+      } else {
+        GranularTimePitchAdjust(source, out, numChannels, sampleRate,
+                                job.m_timeMultiplier, job.m_pitchMultiplier,
+                                job.m_grainSizeSeconds,
+                                job.m_crossFadeSeconds, job.m_window,
+                                job.m_overlap, job.m_quality);
+      }
+      break;
+    case EEngine::Resample:
+      TimeAdjust(source, out, numChannels, job.m_timeMultiplier, threadPool,
+                 job.m_quality);
+      break;
+    case EEngine::Count:
+      break;
+  }
+}
+
+// renders a resample job as a pipeline from its input, which is decoded (on
+// a thread of its own for FLAC) while it's resampled and written out
+bool RunResamplePipeline(const SJob& job, CInputStage* input,
+                         CThreadPool* threadPool) {
+  CResampleStage resample(input, job.m_timeMultiplier, job.m_quality);
+  uint16 numBytes = job.m_numBytes ? job.m_numBytes : input->NumBytes();
+  return WriteWaveFileStreaming(job.m_outputFileName.c_str(), &resample,
+                                input->SampleRate(), numBytes, 0,
+                                EDither::None, nullptr, threadPool) &&
+         !input->Failed();
+}
+
+// Renders a job. An output of "-" is encoded into buffers->m_file instead of
+// written. threadPool, planCache and sourceCache are optional. threadPool is
+// used for resampling and FLAC encoding, which run on the calling thread
+// without one. Returns false, after saying why, if the input can't be read
+// or the output can't be written.
+bool RunJob(const SJob& job, SJobBuffers* buffers,
+            CThreadPool* threadPool = nullptr,
+            CRenderPlanCache* planCache = nullptr,
+            CSourceCache* sourceCache = nullptr) {
+  const char* inputFileName = job.m_inputFileName.c_str();
+  std::shared_ptr<const SDecodedSource> cached;
+  const SDecodedSource* source = &buffers->m_source;
+  if (sourceCache) {
+    cached = sourceCache->Get(inputFileName, job.m_sourceFormat);
+    if (!cached) return false;
+    source = cached.get();
+  } else if (job.m_engine == EEngine::Resample &&
+             job.m_outputFileName != "-") {
+    // the resampler needs to know the length up front, input that doesn't
+    // say (a pipe from a streaming writer) is decoded in full first
+    std::unique_ptr<CInputStage> input = OpenInputStage(inputFileName);
+    if (!input) return false;
+    if (input->NumSamples() != c_unknownNumSamples)
+      return RunResamplePipeline(job, input.get(), threadPool);
+    if (!DecodeSource(inputFileName, job.m_sourceFormat, &buffers->m_source,
+                      input.get()))
+      return false;
+  } else if (!DecodeSource(inputFileName, job.m_sourceFormat,
+                           &buffers->m_source)) {
+    return false;
+  }
+
+  uint16 numChannels = source->m_numChannels;
+  uint32 sampleRate = source->m_sampleRate;
+  std::vector<float>& out = buffers->m_out;
+  switch (source->m_format) {
+    case ESourceFormat::Int16:
+      RenderJob(job, source->m_int16, numChannels, sampleRate, &out,
+                threadPool, planCache);
+      break;
+    case ESourceFormat::Half:
+      RenderJob(job, source->m_half, numChannels, sampleRate, &out,
+                threadPool, planCache);
+      break;
+    default:
+      RenderJob(job, source->m_data, numChannels, sampleRate, &out,
+                threadPool, planCache);
+      break;
+  }
+
+  uint16 numBytes = job.m_numBytes ? job.m_numBytes : source->m_numBytes;
+  if (job.m_outputFileName == "-") {
+    EncodeWaveFile(&buffers->m_file, out, numChannels, sampleRate, numBytes);
+    return true;
+  }
+  return WriteWaveFile(job.m_outputFileName.c_str(), &out, numChannels,
+                       sampleRate, numBytes, nullptr, threadPool);
+}
+
+void PrintUsage() {
+  printf(
+      "usage: source [options] input output\n"
+      "       source [options] --batch file\n"
+      "\n"
+      "Renders input (wave or FLAC) into output (wave, or FLAC if it ends in\n"
+      ".flac). A batch file has a job per line: file names and options, the\n"
+      "options on the command line being the defaults. - reads it from "
+      "stdin.\n"
+      "\n"
+      "job options:\n"
+      "  --time x        length multiplier (1)\n"
+      "  --pitch x       pitch multiplier (1)\n"
+      "  --grain s       grain size in seconds (0.02)\n"
+      "  --crossfade s   cross fade in seconds (0.002)\n"
+      "  --window w      none, hann, tukey or gaussian overlap-add (none)\n"
+      "  --overlap x     grains covering each sample with a window (4)\n"
+      "  --quality q     nearest, linear, cubic, lagrange6 or sinc (cubic)\n"
+      "  --engine e      granular, or resample for time and pitch together\n"
+      "                  (granular)\n"
+      "  --bits n        8, 16, 24 or 32 bits per output sample (input's)\n"
+      "  --source-format f\n"
+      "                  float, int16 or half, to hold the input in (float)\n"
+      "\n"
+      "run options:\n"
+      "  --threads n     threads, 0 for one per core (0)\n"
+      "  --stats file    summary per job, csv or json by extension\n"
+      "  --trace file    chrome trace of the run\n"
+      "\n"
+      "other modes: --demo, --check, --cloud, --interpolation, --play,\n"
+      "  --serve, --load-test\n"
+      "\n"
+      "exit codes: 0 when every job succeeded, 1 when any failed, 2 for bad\n"
+      "arguments (nothing is rendered then).\n");
+}
+
+// Exit code 0 when every job rendered, 1 when any didn't and 2 when the
+// arguments or batch file had problems, in which case nothing gets rendered.
+int RunJobs(int argc, char** argv) {
+  const char* batchFileName = nullptr;
+  const char* statsFileName = nullptr;
+  const char* traceFileName = nullptr;
+  size_t numThreads = 0;
+  std::vector<std::string> jobArgs;
+  for (int i = 1; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+      PrintUsage();
+      return 0;
+    } else if (!strcmp(argv[i], "--batch") && hasValue) {
+      batchFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--threads") && hasValue) {
+      numThreads = size_t(std::max(0, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--stats") && hasValue) {
+      statsFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && hasValue) {
+      traceFileName = argv[++i];
+    } else {
+      jobArgs.push_back(argv[i]);
+    }
+  }
+  if (argc < 2) {
+    PrintUsage();
+    return 2;
+  }
+
+  // every job gets checked before any is rendered
+  std::vector<SJob> jobs;
+  SJob defaults;
+  if (!ParseJobArguments(jobArgs, &defaults)) return 2;
+  if (!batchFileName) {
+    if (!ValidateJob(defaults)) return 2;
+    jobs.push_back(defaults);
+  } else {
+    if (!defaults.m_inputFileName.empty()) {
+      printf("[-----ERROR-----]File names go in the batch file.\n");
+      return 2;
+    }
+    std::vector<unsigned char> batchFile;
+    if (!ReadFileIntoMemory(batchFileName, &batchFile)) return 2;
+    std::vector<std::vector<std::string>> lines;
+    std::vector<size_t> lineNumbers;
+    SplitBatchFile(reinterpret_cast<const char*>(batchFile.data()),
+                   batchFile.size(), &lines, &lineNumbers);
+    for (size_t i = 0; i < lines.size(); ++i) {
+      SJob job = defaults;
+      if (!ParseJobArguments(lines[i], &job) || !ValidateJob(job)) {
+        printf("[-----ERROR-----]In %s line %zu.\n", batchFileName,
+               lineNumbers[i]);
+        return 2;
+      }
+      jobs.push_back(job);
+    }
+  }
+
+  // the daemon can send output back, the command line has nowhere to put it
+  for (const SJob& job : jobs) {
+    if (job.m_outputFileName == "-") {
+      printf("[-----ERROR-----]Output - only works with --serve.\n");
+      return 2;
+    }
+  }
+
+  // Jobs of a batch render in parallel, each on one thread, FLAC encoding
+  // included. Stats are gathered for the whole process, so per job stats
+  // need them one at a time, each using all the threads it can. A lone
+  // granular job to a wave file doesn't need the threads at all, so it
+  // doesn't pay to start them.
+  bool parallelJobs = jobs.size() > 1 && !statsFileName && numThreads != 1;
+  bool needThreads = parallelJobs;
+  for (const SJob& job : jobs)
+    needThreads = needThreads || job.m_engine == EEngine::Resample ||
+                  IsFlacFileName(job.m_outputFileName.c_str());
+  std::unique_ptr<CThreadPool> threadPool;
+  if (needThreads) threadPool.reset(new CThreadPool(numThreads));
+
+  if (traceFileName) TraceStart();
+  std::atomic<size_t> numFailed(0);
+  if (parallelJobs) {
+    threadPool->ParallelFor(jobs.size(), 1, [&](size_t begin, size_t end) {
+      // a pool can't be used from its own workers, this one has no threads
+      CThreadPool jobThreadPool(1);
+      SJobBuffers buffers;
+      for (size_t i = begin; i < end; ++i) {
+        if (!RunJob(jobs[i], &buffers, &jobThreadPool)) ++numFailed;
+      }
+    });
+  } else {
+    SJobBuffers buffers;
+    for (const SJob& job : jobs) {
+      if (!RunJob(job, &buffers, threadPool.get())) ++numFailed;
+      ReportJob(statsFileName, job.m_outputFileName.c_str());
+    }
+  }
+  if (traceFileName) TraceStop(traceFileName);
+
+  if (numFailed) {
+    printf("[-----ERROR-----]%zu of %zu jobs failed.\n", size_t(numFailed),
+           jobs.size());
+    return 1;
+  }
+  return 0;
+}
+
+// renders every demo job from data/legend1.wav into data/
+int RunDemo(int argc, char** argv) {
+  const char* statsFileName = nullptr;
+  const char* traceFileName = nullptr;
+  for (int i = 2; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--stats") && hasValue) {
+      statsFileName = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && hasValue) {
+      traceFileName = argv[++i];
+    } else {
+      printf("[-----ERROR-----]Unknown option %s.\n", argv[i]);
+      return 2;
+    }
+  }
+
+  // optionally record a chrome trace of the whole run
+  if (traceFileName) TraceStart();
+
+  // load the wave file
+  uint16 numChannels;
+  uint32 sampleRate;
+  uint16 numBytes;
+  std::vector<float> source, out;
+  CThreadPool threadPool;
+  CRenderPlanCache planCache;
+  if (!ReadWaveFile("data/legend1.wav", &source, &numChannels, &sampleRate,
+                    &numBytes))
+    return 2;
+  ReportJob(statsFileName, "load");
+
+  // render and write every job
+  size_t numFailed = 0;
+  for (const SScenario& scenario :
+       MakeScenarios(source, numChannels, sampleRate, threadPool, planCache)) {
+    if (strcmp(scenario.m_name, scenario.m_goldenName)) continue;
+    scenario.m_render(&out);
+    std::string fileName = std::string("data/") + scenario.m_name + ".wav";
+    if (!WriteWaveFile(fileName.c_str(), &out, numChannels, sampleRate,
+                       numBytes))
+      ++numFailed;
+    ReportJob(statsFileName, scenario.m_name);
+  }
+
+  if (traceFileName) TraceStop(traceFileName);
+  return numFailed ? 1 : 0;
+}
+
+// Daemon. ./source --serve path listens on a unix domain socket and renders
+// jobs sent to it, so a caller rendering many files pays for process startup,
+// page faults and thread creation once instead of once per file. Each
+// connection thread keeps its buffers between jobs, and all of them share a
+// cache of decoded input files (see CSourceCache), a plan cache and the
+// window and sinc tables, which are built at startup. --cache-mb and
+// --plan-cache-mb set the caches' budgets.
+//
+// A request is one line of text, in the same form as a batch file line:
+// file names and job options. Job options given to --serve are the defaults
+// for every request. File names are relative to the daemon's working
+// directory. An output of - sends the rendered wave file back. Each request
+// gets a one line reply, then the file if one is sent back:
+//   ok <bytes>\n<bytes of wave file>   (ok 0 when written to a file)
+//   error <code>\n                     (the exit code the command line gives)
+// A connection can send any number of requests, one after another. A request
+// of "shutdown" stops the daemon once its open connections are closed.
+#ifndef _WIN32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+bool SendAll(int socket, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t count = send(socket, bytes, size, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    bytes += count;
+    size -= size_t(count);
+  }
+  return true;
+}
+
+// reads lines and byte counts off a socket, keeping what came in past them
+class CSocketReader {
+ public:
+  explicit CSocketReader(int socket) : m_socket(socket) {}
+
+  // false if the connection closed first
+  bool ReadLine(std::string* line) {
+    size_t end;
+    while ((end = m_buffer.find('\n')) == std::string::npos) {
+      if (!Receive()) return false;
+    }
+    line->assign(m_buffer, 0, end);
+    m_buffer.erase(0, end + 1);
+    return true;
+  }
+
+  bool Read(size_t size, std::vector<unsigned char>* data) {
+    while (m_buffer.size() < size) {
+      if (!Receive()) return false;
+    }
+    data->assign(m_buffer.begin(), m_buffer.begin() + size);
+    m_buffer.erase(0, size);
+    return true;
+  }
+
+ private:
+  bool Receive() {
+    char chunk[1 << 16];
+    ssize_t count;
+    do {
+      count = recv(m_socket, chunk, sizeof(chunk), 0);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) return false;
+    m_buffer.append(chunk, size_t(count));
+    return true;
+  }
+
+  int m_socket;
+  std::string m_buffer;
+};
+
+bool MakeSocketAddress(const char* path, sockaddr_un* address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    printf("[-----ERROR-----]Socket path %s is too long.\n", path);
+    return false;
+  }
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+// connects to a daemon, returning -1 if it can't
+int ConnectSocket(const char* path) {
+  sockaddr_un address;
+  if (!MakeSocketAddress(path, &address)) return -1;
+  int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connection < 0 ||
+      connect(connection, reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) < 0) {
+    printf("[-----ERROR-----]Could not connect to %s: %s.\n", path,
+           strerror(errno));
+    if (connection >= 0) close(connection);
+    return -1;
+  }
+  return connection;
+}
+
+class CJobServer {
+ public:
+  // numThreads of 0 means one per hardware thread. Each serves one
+  // connection at a time. A sourceCacheBytes or planCacheBytes of 0 turns
+  // that cache off.
+  // Resampling and FLAC encoding run on a pool with one thread per hardware
+  // thread, started once and shared by every job; jobs that want it at the
+  // same time take turns.
+  CJobServer(const char* socketPath, size_t numThreads,
+             size_t sourceCacheBytes, size_t planCacheBytes,
+             const SJob& defaults)
+      : m_socketPath(socketPath), m_numThreads(numThreads),
+        m_defaults(defaults) {
+    if (m_numThreads == 0)
+      m_numThreads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    if (sourceCacheBytes > 0)
+      m_sourceCache.reset(new CSourceCache(sourceCacheBytes));
+    if (planCacheBytes > 0)
+      m_planCache.reset(new CRenderPlanCache(planCacheBytes));
+  }
+
+  // serves until a shutdown request, false if the socket can't be opened
+  bool Run() {
+    sockaddr_un address;
+    if (!MakeSocketAddress(m_socketPath, &address)) return false;
+
+    // a daemon that didn't shut down cleanly leaves its socket behind
+    unlink(m_socketPath);
+    m_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listener < 0 ||
+        bind(m_listener, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) < 0 ||
+        listen(m_listener, 128) < 0) {
+      printf("[-----ERROR-----]Could not listen on %s: %s.\n", m_socketPath,
+             strerror(errno));
+      if (m_listener >= 0) close(m_listener);
+      return false;
+    }
+
+    // build the tables now, rather than in the first job that needs them
+    GrainWindowTable(EGrainWindow::Hann);
+    GrainWindowTable(EGrainWindow::Tukey);
+    GrainWindowTable(EGrainWindow::Gaussian);
+    SInterpolationKernel<EInterpolation::Sinc>::Table();
+
+    printf("serving on %s with %zu threads and a pool of %zu.\n",
+           m_socketPath, m_numThreads, m_threadPool.NumThreads());
+    fflush(stdout);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < m_numThreads; ++i)
+      threads.push_back(std::thread(&CJobServer::ConnectionThread, this));
+    ConnectionThread();
+    for (std::thread& thread : threads) thread.join();
+
+    close(m_listener);
+    unlink(m_socketPath);
+    printf("served %zu jobs.\n", size_t(m_numJobs));
+    if (m_sourceCache) {
+      printf("source cache: %zu hits, %zu misses, %zu evictions, %.1fMB "
+             "held.\n",
+             m_sourceCache->NumHits(), m_sourceCache->NumMisses(),
+             m_sourceCache->NumEvictions(),
+             double(m_sourceCache->UsedBytes()) / (1024.0 * 1024.0));
+    }
+    if (m_planCache) {
+      printf("plan cache: %zu evictions, %.1fMB held.\n",
+             m_planCache->NumEvictions(),
+             double(m_planCache->UsedBytes()) / (1024.0 * 1024.0));
+    }
+    return true;
+  }
+
+ private:
+  void ConnectionThread() {
+    SJobBuffers buffers;
+    while (!m_stopping) {
+      int connection = accept(m_listener, nullptr, nullptr);
+      if (connection < 0) {
+        if (m_stopping) break;
+        if (errno != EINTR && errno != ECONNABORTED)
+          printf("[-----ERROR-----]accept() failed: %s.\n", strerror(errno));
+        continue;
+      }
+      ServeConnection(connection, &buffers);
+      close(connection);
+    }
+  }
+
+  void ServeConnection(int connection, SJobBuffers* buffers) {
+    CSocketReader reader(connection);
+    std::string request;
+    while (reader.ReadLine(&request)) {
+      if (request == "shutdown") {
+        // wakes the other threads out of accept()
+        m_stopping = true;
+        shutdown(m_listener, SHUT_RDWR);
+        SendAll(connection, "ok 0\n", 5);
+        return;
+      }
+
+      std::vector<std::vector<std::string>> lines;
+      std::vector<size_t> lineNumbers;
+      SplitBatchFile(request.data(), request.size(), &lines, &lineNumbers);
+      if (lines.empty()) continue;
+
+      int exitCode = 0;
+      SJob job = m_defaults;
+      if (lines.size() > 1 || !ParseJobArguments(lines[0], &job) ||
+          !ValidateJob(job)) {
+        exitCode = 2;
+      } else if (!RunJob(job, buffers, &m_threadPool, m_planCache.get(),
+                         m_sourceCache.get())) {
+        exitCode = 1;
+      }
+      ++m_numJobs;
+
+      bool sendFile = exitCode == 0 && job.m_outputFileName == "-";
+      char reply[64];
+      if (exitCode)
+        snprintf(reply, sizeof(reply), "error %d\n", exitCode);
+      else
+        snprintf(reply, sizeof(reply), "ok %zu\n",
+                 sendFile ? buffers->m_file.size() : size_t(0));
+      if (!SendAll(connection, reply, strlen(reply))) return;
+      if (sendFile && !SendAll(connection, buffers->m_file.data(),
+                               buffers->m_file.size()))
+        return;
+    }
+  }
+
+  const char* m_socketPath;
+  size_t m_numThreads;
+  SJob m_defaults;
+  int m_listener = -1;
+  std::atomic<bool> m_stopping{false};
+  std::atomic<size_t> m_numJobs{0};
+  CThreadPool m_threadPool;
+  std::unique_ptr<CRenderPlanCache> m_planCache;
+  std::unique_ptr<CSourceCache> m_sourceCache;
+};
+
+int RunServer(int argc, char** argv) {
+  if (argc < 3) {
+    printf("[-----ERROR-----]--serve needs a socket path.\n");
+    return 2;
+  }
+  size_t numThreads = 0;
+  size_t sourceCacheMB = 512;
+  size_t planCacheMB = 64;
+  std::vector<std::string> jobArgs;
+  for (int i = 3; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--threads") && hasValue) {
+      numThreads = size_t(std::max(0, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--cache-mb") && hasValue) {
+      sourceCacheMB = size_t(std::max(0, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--plan-cache-mb") && hasValue) {
+      planCacheMB = size_t(std::max(0, atoi(argv[++i])));
+    } else {
+      jobArgs.push_back(argv[i]);
+    }
+  }
+  SJob defaults;
+  if (!ParseJobArguments(jobArgs, &defaults)) return 2;
+  if (!defaults.m_inputFileName.empty()) {
+    printf("[-----ERROR-----]File names go in the requests.\n");
+    return 2;
+  }
+
+  CJobServer server(argv[2], numThreads, sourceCacheMB * 1024 * 1024,
+                    planCacheMB * 1024 * 1024, defaults);
+  return server.Run() ? 0 : 2;
+}
+
+// Load test. ./source --load-test path [options] [job] sends the same job
+// (by default data/legend1.wav - --time 1.3) over a number of connections to
+// a daemon, as fast as it renders them, and reports jobs per second and
+// latencies. --process runs a ./source process per job instead, the way a
+// caller without the daemon would, writing - outputs to /dev/null.
+int RunLoadTest(int argc, char** argv) {
+  if (argc < 3) {
+    printf("[-----ERROR-----]--load-test needs a socket path.\n");
+    return 2;
+  }
+  const char* socketPath = argv[2];
+  size_t numJobs = 200;
+  size_t numConnections = 1;
+  bool processes = false;
+  std::vector<std::string> jobArgs;
+  for (int i = 3; i < argc; ++i) {
+    bool hasValue = i + 1 < argc;
+    if (!strcmp(argv[i], "--jobs") && hasValue) {
+      numJobs = size_t(std::max(1, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--connections") && hasValue) {
+      numConnections = size_t(std::max(1, atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "--process")) {
+      processes = true;
+    } else {
+      jobArgs.push_back(argv[i]);
+    }
+  }
+  if (jobArgs.empty()) jobArgs = {"data/legend1.wav", "-", "--time", "1.3"};
+
+  // the request line, quoting every argument in case of spaces
+  std::string request;
+  for (const std::string& arg : jobArgs)
+    request += (request.empty() ? "\"" : " \"") + arg + "\"";
+  request += "\n";
+
+  // and the command line for --process
+  std::vector<std::string> processArgs = {argv[0]};
+  for (const std::string& arg : jobArgs)
+    processArgs.push_back(arg == "-" ? "/dev/null" : arg);
+  std::vector<char*> processArgv;
+  for (std::string& arg : processArgs) processArgv.push_back(&arg[0]);
+  processArgv.push_back(nullptr);
+
+  // each connection sends a job, waits for the reply, and goes again until
+  // numJobs have been sent between them
+  std::atomic<size_t> nextJob(0), numFailed(0);
+  std::vector<std::vector<double>> latencies(numConnections);
+  auto runConnection = [&](size_t index) {
+    int connection = processes ? -1 : ConnectSocket(socketPath);
+    if (!processes && connection < 0) {
+      numFailed += 1;
+      return;
+    }
+    CSocketReader reader(connection);
+    std::vector<unsigned char> file;
+    std::string reply;
+    while (nextJob++ < numJobs) {
+      auto start = std::chrono::steady_clock::now();
+      bool succeeded = false;
+      if (processes) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY,
+                                         0);
+        pid_t pid;
+        int status = 0;
+        succeeded = posix_spawn(&pid, argv[0], &actions, nullptr,
+                                processArgv.data(), environ) == 0 &&
+                    waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+                    WEXITSTATUS(status) == 0;
+        posix_spawn_file_actions_destroy(&actions);
+      } else {
+        if (!SendAll(connection, request.data(), request.size()) ||
+            !reader.ReadLine(&reply)) {
+          numFailed += 1;
+          break;
+        }
+        size_t fileSize = 0;
+        succeeded = sscanf(reply.c_str(), "ok %zu", &fileSize) == 1 &&
+                    reader.Read(fileSize, &file);
+      }
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      if (succeeded)
+        latencies[index].push_back(elapsed.count());
+      else
+        numFailed += 1;
+    }
+    if (connection >= 0) close(connection);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < numConnections; ++i)
+    threads.push_back(std::thread(runConnection, i));
+  runConnection(0);
+  for (std::thread& thread : threads) thread.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::vector<double> all;
+  for (const std::vector<double>& connection : latencies)
+    all.insert(all.end(), connection.begin(), connection.end());
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double fraction) {
+    return all.empty() ? 0.0
+                       : all[std::min(all.size() - 1,
+                                      size_t(fraction * double(all.size())))];
+  };
+
+  printf("%zu jobs %s %zu %s in %.2f seconds: %.1f jobs/sec\n", all.size(),
+         processes ? "as processes," : "over", numConnections,
+         processes ? "at a time" : "connections", elapsed.count(),
+         double(all.size()) / elapsed.count());
+  printf("latency ms: p50 %.2f, p99 %.2f, max %.2f\n", percentile(0.5),
+         percentile(0.99), all.empty() ? 0.0 : all.back());
+  if (numFailed) {
+    printf("[-----ERROR-----]%zu jobs failed.\n", size_t(numFailed));
+    return 1;
+  }
+  return 0;
+}
+
+#else
+
+int RunServer(int, char**) {
+  printf("[-----ERROR-----]--serve needs unix domain sockets.\n");
+  return 2;
+}
+
+int RunLoadTest(int, char**) {
+  printf("[-----ERROR-----]--load-test needs unix domain sockets.\n");
+  return 2;
+}
+
+#endif
+
+// the entry point of our application
+int main(int argc, char** argv) {
+  // ./source --demo renders the demo jobs into data/
+  if (argc > 1 && !strcmp(argv[1], "--demo")) return RunDemo(argc, argv);
+
+  // ./source --check ... compares against the golden outputs instead of
+  // writing them
+  if (argc > 1 && !strcmp(argv[1], "--check"))
+    return RunRegressionCheck(argc, argv);
+
+  // ./source --cloud ... times the granular cloud engine
+  if (argc > 1 && !strcmp(argv[1], "--cloud"))
+    return RunCloudBenchmark(argc, argv);
+
+  // ./source --interpolation ... compares the interpolation qualities
+  if (argc > 1 && !strcmp(argv[1], "--interpolation"))
+    return RunInterpolationBenchmark(argc, argv);
+
+  // ./source --play ... plays live on an audio device
+  if (argc > 1 && !strcmp(argv[1], "--play")) return RunPlayback(argc, argv);
+
+  // ./source --serve path ... renders jobs sent over a unix domain socket
+  if (argc > 1 && !strcmp(argv[1], "--serve")) return RunServer(argc, argv);
+
+  // ./source --load-test path ... times a daemon
+  if (argc > 1 && !strcmp(argv[1], "--load-test"))
+    return RunLoadTest(argc, argv);
 
-  system("pause");
+  // ./source [options] input output, or --batch
+  return RunJobs(argc, argv);
 }